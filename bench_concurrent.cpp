@@ -0,0 +1,74 @@
+/*!\file bench_concurrent.cpp
+ * \brief Write throughput of a concurrent object versus a globally locked dictionary
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nconcurrent.h"
+
+/*!\brief Run writer threads updating counters for a while
+ * \param name Name of the benchmark
+ * \param threads Number of writer threads
+ * \param seconds Duration of the benchmark
+ * \param write Function performing one update for a given thread and key
+ */
+template<typename W> void run(const char *name,const int &threads,const double &seconds,W write){
+    std::atomic<bool> running(true);
+    std::vector<unsigned long> counts(threads,0);
+    std::vector<std::thread> writers;
+    auto start=std::chrono::steady_clock::now();
+    for(int i=0;i<threads;i++){
+        writers.push_back(std::thread([&,i](){
+            unsigned long count=0;
+            while(running.load(std::memory_order_relaxed)){
+                write(i,count);
+                count++;
+            }
+            counts[i]=count;
+        }));
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running=false;
+    for(int i=0;i<threads;i++) writers[i].join();
+    double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    unsigned long total=0;
+    for(int i=0;i<threads;i++) total+=counts[i];
+    printf("    %-12s%3d threads %12.0f writes/s\n",name,threads,total/elapsed);
+}
+
+/*!\brief Compare write scaling of a sharded and a globally locked object
+ * \param argc Argument count
+ * \param argv Optional maximum thread count and duration in seconds
+ * \return 0
+ */
+int main(int argc,char *argv[]){
+    int maxthreads=argc>1?atoi(argv[1]):std::max(2u,std::thread::hardware_concurrency());
+    double seconds=argc>2?atof(argv[2]):1;
+    const int sessions=1000;
+    std::vector<std::string> keys;
+    for(int i=0;i<sessions;i++) keys.push_back("session"+std::to_string(i));
+    printf("Counter update throughput over %d keys:\n",sessions);
+    for(int threads=1;threads<=maxthreads;threads*=2){
+        // Baseline: a single lock around a dictionary object
+        std::mutex lock;
+        ndict global;
+        run("mutex",threads,seconds,[&](int thread,unsigned long count){
+            const std::string &key=keys[(count*7+thread)%sessions];
+            std::lock_guard<std::mutex> guard(lock);
+            ndict &member=global[key];
+            member=(member.type==ndict::TNULL?0:member.getint())+1;
+        });
+
+        // Sharded concurrent object
+        nconcurrent sharded(64);
+        run("nconcurrent",threads,seconds,[&](int thread,unsigned long count){
+            sharded.increment(keys[(count*7+thread)%sessions]);
+        });
+    }
+    return 0;
+}
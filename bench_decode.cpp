@@ -0,0 +1,97 @@
+/*!\file bench_decode.cpp
+ * \brief Decode throughput and heap allocations of a reused decoder versus fresh decodes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include "njson.h"
+
+//! Number of heap allocations made so far
+static unsigned long allocations=0;
+
+/*!\brief Count heap allocations
+ * \param size Number of bytes to allocate
+ * \return Pointer to the allocated memory
+ */
+void *operator new(size_t size){
+    allocations++;
+    void *ptr=malloc(size?size:1);
+    if(!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+/*!\brief Release memory allocated by the counting operator new
+ * \param ptr Pointer to the memory
+ */
+void operator delete(void *ptr) noexcept{
+    free(ptr);
+}
+
+/*!\brief Release memory allocated by the counting operator new
+ * \param ptr Pointer to the memory
+ */
+void operator delete(void *ptr,size_t) noexcept{
+    free(ptr);
+}
+
+/*!\brief Decode messages repeatedly and report throughput and allocations
+ * \param name Name of the benchmark
+ * \param messages Messages to decode in turn
+ * \param count Number of messages to decode
+ * \param decode Function decoding one message
+ */
+template<typename D> void run(const char *name,const std::vector<std::string> &messages,const unsigned &count,D decode){
+    // Warm up, then measure
+    for(unsigned i=0;i<messages.size();i++) decode(messages[i]);
+    unsigned long before=allocations;
+    auto start=std::chrono::steady_clock::now();
+    for(unsigned i=0;i<count;i++) decode(messages[i%messages.size()]);
+    double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    printf("    %-10s%12.0f messages/s %10.2f allocations/message\n",name,count/elapsed,(double)(allocations-before)/count);
+}
+
+/*!\brief Compare fresh decoding against decoding into a reused object
+ * \param argc Argument count
+ * \param argv Optional number of messages to decode
+ * \return 0
+ */
+int main(int argc,char *argv[]){
+    unsigned count=argc>1?atoi(argv[1]):200000;
+
+    // Similarly shaped messages with varying values
+    std::vector<std::string> messages;
+    for(unsigned i=0;i<16;i++){
+        messages.push_back(
+            "{\"type\" : \"telemetry_sample_reading\", \"sequence\" : "+std::to_string(i*7919)+", "
+            "\"device\" : {\"identifier\" : \"sensor-unit-"+std::to_string(i)+"-north-wing\", \"online\" : true}, "
+            "\"values\" : [1.5, 2.25, "+std::to_string(i)+".75], \"tags\" : [\"calibrated\", \"warehouse-"+std::to_string(i)+"\"]}");
+    }
+    printf("Decoding %u messages of %zu bytes:\n",count,messages[0].size());
+
+    // Baseline: a new decoder and dictionary object per message
+    run("fresh",messages,count,[](const std::string &message){
+        njson json;
+        ndict object=json.decode(message);
+    });
+
+    // Reused decoder and dictionary object
+    njson json;
+    ndict object;
+    run("reused",messages,count,[&](const std::string &message){
+        json.decode(message,object);
+    });
+
+    // Reused decoder and dictionary object, with the shape of the messages known
+    njson_schema schema;
+    schema.member("type",ndict::TSTRING)
+          .member("sequence",ndict::TNUMBER)
+          .member("device",njson_schema().member("identifier",ndict::TSTRING).member("online",ndict::TBOOL))
+          .member("values",njson_schema(ndict::TARRAY).items(ndict::TNUMBER,3))
+          .member("tags",njson_schema(ndict::TARRAY).items(ndict::TSTRING,2));
+    run("schema",messages,count,[&](const std::string &message){
+        json.decode(message,schema,object);
+    });
+    return 0;
+}
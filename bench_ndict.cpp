@@ -0,0 +1,395 @@
+/*!\file bench_ndict.cpp
+ * \brief Throughput, latency and allocations of common operations on standard corpora
+ *
+ * Usage: bench_ndict [--time seconds] [--save file] [--compare file] [--threshold percent] [corpus...]
+ *
+ * Each operation is repeated for at least the given time on every corpus.
+ * Results can be saved as a baseline, and a later run compared against it
+ * exits with status 1 if any operation is slower by more than the threshold.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include "njson.h"
+
+//! Number of heap allocations made so far
+static unsigned long allocations=0;
+
+/*!\brief Count heap allocations
+ * \param size Number of bytes to allocate
+ * \return Pointer to the allocated memory
+ */
+void *operator new(size_t size){
+    allocations++;
+    void *ptr=malloc(size?size:1);
+    if(!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+/*!\brief Release memory allocated by the counting operator new
+ * \param ptr Pointer to the memory
+ */
+void operator delete(void *ptr) noexcept{
+    free(ptr);
+}
+
+/*!\brief Release memory allocated by the counting operator new
+ * \param ptr Pointer to the memory
+ */
+void operator delete(void *ptr,size_t) noexcept{
+    free(ptr);
+}
+
+//! Generated test document
+struct corpus{
+    std::string name;
+    std::string json;
+    std::vector<std::string> lines;
+};
+
+//! Measured result of one operation
+struct result{
+    std::string corpus;
+    std::string operation;
+    double nsop;
+};
+
+//! Object with many keys of mixed types
+static corpus makewide(){
+    corpus c={"wide","{",{}};
+    for(int i=0;i<10000;i++){
+        if(i) c.json+=", ";
+        if(i%3==0)      c.json+="\"key"+std::to_string(i)+"\" : "+std::to_string(i);
+        else if(i%3==1) c.json+="\"key"+std::to_string(i)+"\" : \"value"+std::to_string(i)+"\"";
+        else            c.json+="\"key"+std::to_string(i)+"\" : true";
+    }
+    c.json+="}";
+    return c;
+}
+
+//! Arrays of small records, as long as arrays are allowed to be
+static corpus makearray(){
+    corpus c={"array","{",{}};
+    for(int j=0;j<8;j++){
+        if(j) c.json+=", ";
+        c.json+="\"items"+std::to_string(j)+"\" : [";
+        for(int i=0;i<NDICT_MAX_ARRAY_SIZE;i++){
+            if(i) c.json+=", ";
+            c.json+="{\"id\" : "+std::to_string(i)+", \"name\" : \"item"+std::to_string(i)+"\", \"score\" : "+std::to_string(i*0.25)+", \"active\" : "+(i&1?"true":"false")+"}";
+        }
+        c.json+="]";
+    }
+    c.json+="}";
+    return c;
+}
+
+//! Deeply nested objects, below the default decoding depth limit
+static corpus makedeep(){
+    corpus c={"deep","",{}};
+    const int depth=NJSON_MAX_DEPTH/2;
+    for(int i=0;i<depth;i++) c.json+="{\"level\" : "+std::to_string(i)+", \"label\" : \"depth"+std::to_string(i)+"\", \"next\" : ";
+    c.json+="{}";
+    for(int i=0;i<depth;i++) c.json+="}";
+    return c;
+}
+
+//! Arrays of floating point and integer numbers
+static corpus makenumbers(){
+    corpus c={"numbers","{",{}};
+    for(int j=0;j<32;j++){
+        if(j) c.json+=", ";
+        c.json+="\"series"+std::to_string(j)+"\" : [";
+        for(int i=0;i<NDICT_MAX_ARRAY_SIZE;i++){
+            if(i) c.json+=", ";
+            if(i&1) c.json+=std::to_string(i*j);
+            else    c.json+=std::to_string(i*3.14159+j)+"e-3";
+        }
+        c.json+="]";
+    }
+    c.json+="}";
+    return c;
+}
+
+//! Long strings with escape sequences
+static corpus makestrings(){
+    corpus c={"strings","{\"strings\" : [",{}};
+    for(int i=0;i<NDICT_MAX_ARRAY_SIZE;i++){
+        if(i) c.json+=", ";
+        c.json+="\"line "+std::to_string(i)+": \\\"quoted\\\" text with a back\\\\slash,\\ta tab and\\na newline, caf\\u00e9 ";
+        c.json+=std::string(64+i%64,'x')+"\"";
+    }
+    c.json+="]}";
+    return c;
+}
+
+//! Newline delimited messages, each a separate document
+static corpus makendjson(){
+    corpus c={"ndjson","",{}};
+    for(int i=0;i<4096;i++){
+        std::string line="{\"sequence\" : "+std::to_string(i)+", \"event\" : \"update\", \"user\" : {\"id\" : "+std::to_string(i%97)+
+                         ", \"name\" : \"user"+std::to_string(i%97)+"\"}, \"values\" : ["+std::to_string(i)+", "+std::to_string(i*0.5)+"]}";
+        c.lines.push_back(line);
+        c.json+=line+"\n";
+    }
+    return c;
+}
+
+/*!\brief Collect paths to leaf values
+ * \param dict Dictionary to walk
+ * \param path Path to the dictionary
+ * \param paths Collected paths
+ * \param limit Maximum number of paths to collect
+ */
+static void collect(const ndict &dict,std::vector<std::string> &path,std::vector<std::vector<std::string> > &paths,const size_t &limit){
+    if(dict.type!=ndict::TOBJECT && dict.type!=ndict::TARRAY){
+        paths.push_back(path);
+        return;
+    }
+    std::vector<std::string> keys=dict.getkeys();
+    for(unsigned i=0;i<keys.size() && paths.size()<limit;i++){
+        path.push_back(keys[i]);
+        collect(dict[keys[i]],path,paths,limit);
+        path.pop_back();
+    }
+}
+
+/*!\brief Look up a leaf value
+ * \param dict Dictionary to search
+ * \param path Keys and array indices leading to the value
+ * \return Found value
+ */
+static const ndict &lookup(const ndict &dict,const std::vector<std::string> &path){
+    const ndict *node=&dict;
+    for(const std::string &key : path){
+        if(node->type==ndict::TARRAY)   node=&(*node)[(unsigned)atoi(key.c_str())];
+        else                            node=&(*node)[key];
+    }
+    return *node;
+}
+
+/*!\brief Read leaf values through an access policy
+ * \param leaves Leaf values to read
+ * \param types Types of the leaf values, as known by the caller
+ * \return Sum of the values read, so the reads cannot be optimized away
+ */
+template<typename P> static double readleaves(const std::vector<const ndict*> &leaves,const std::vector<ndict::type_t> &types){
+    double total=0;
+    for(size_t i=0;i<leaves.size();i++){
+        switch(types[i]){
+            case ndict::TNUMBER:    total+=leaves[i]->getdouble<P>();   break;
+            case ndict::TSTRING:    total+=*leaves[i]->getchar<P>();    break;
+            case ndict::TBOOL:      total+=leaves[i]->getbool<P>();     break;
+            default:                                                    break;
+        }
+    }
+    return total;
+}
+
+/*!\brief Repeat an operation for a while and report its cost
+ * \param results Collected results
+ * \param c Corpus the operation works on
+ * \param operation Name of the operation
+ * \param seconds Minimum time to repeat the operation for
+ * \param bytes Bytes processed per call, or 0 if throughput does not apply
+ * \param ops Number of operations performed per call
+ * \param function Operation to measure
+ */
+static void run(std::vector<result> &results,const corpus &c,const char *operation,const double &seconds,const size_t &bytes,const size_t &ops,const std::function<void()> &function){
+    // Warm up, then repeat in growing batches until enough time has passed
+    function();
+    unsigned long count=0,batch=1;
+    unsigned long before=allocations;
+    double elapsed=0;
+    auto start=std::chrono::steady_clock::now();
+    while(elapsed<seconds){
+        for(unsigned long i=0;i<batch;i++) function();
+        count+=batch;
+        batch*=2;
+        elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    }
+    double nsop=elapsed*1e9/count/ops;
+    double allocs=(double)(allocations-before)/count/ops;
+    if(bytes)   printf("%-10s%-10s%12.1f%14.0f%14.1f\n",c.name.c_str(),operation,bytes/(elapsed/count)/1e6,nsop,allocs);
+    else        printf("%-10s%-10s%12s%14.0f%14.1f\n",c.name.c_str(),operation,"-",nsop,allocs);
+    results.push_back({c.name,operation,nsop});
+}
+
+/*!\brief Measure all operations on a corpus
+ * \param results Collected results
+ * \param c Corpus to measure
+ * \param seconds Minimum time to repeat each operation for
+ */
+static void measure(std::vector<result> &results,const corpus &c,const double &seconds){
+    njson json;
+    ndict doc;
+    size_t bytes=c.json.size();
+
+    // Decode and encode the whole corpus
+    if(c.lines.size()){
+        run(results,c,"decode",seconds,bytes,1,[&](){
+            for(const std::string &line : c.lines) json.decode(line,doc);
+        });
+        std::vector<ndict> messages;
+        for(const std::string &line : c.lines) messages.push_back(json.decode(line));
+        run(results,c,"encode",seconds,bytes,1,[&](){
+            for(const ndict &message : messages) json.encode(message);
+        });
+        doc=messages[0];
+    }
+    else{
+        run(results,c,"decode",seconds,bytes,1,[&](){
+            json.decode(c.json,doc);
+        });
+        run(results,c,"encode",seconds,bytes,1,[&](){
+            json.encode(doc);
+        });
+
+        // Read the corpus from a file
+        char path[32];
+        strcpy(path,"/tmp/bench_ndict_XXXXXX");
+        int fd=mkstemp(path);
+        if(fd<0 || write(fd,c.json.data(),c.json.size())!=(ssize_t)c.json.size()){
+            printf("Failed to write %s\n",path);
+            exit(1);
+        }
+        close(fd);
+        run(results,c,"read",seconds,bytes,1,[&](){
+            json.read(path);
+        });
+        unlink(path);
+    }
+
+    // Look up leaf values
+    std::vector<std::string> path;
+    std::vector<std::vector<std::string> > paths;
+    collect(doc,path,paths,1000);
+    const ndict &constdoc=doc;
+    run(results,c,"lookup",seconds,0,paths.size(),[&](){
+        for(const std::vector<std::string> &path : paths) lookup(constdoc,path);
+    });
+
+    // Read leaf values with and without access checks
+    std::vector<const ndict*> leaves;
+    std::vector<ndict::type_t> types;
+    for(const std::vector<std::string> &path : paths){
+        leaves.push_back(&lookup(constdoc,path));
+        types.push_back(leaves.back()->type);
+    }
+    double checked=0,unchecked=0;
+    run(results,c,"checked",seconds,0,leaves.size(),[&](){
+        checked=readleaves<ndict_checked>(leaves,types);
+    });
+    run(results,c,"unchecked",seconds,0,leaves.size(),[&](){
+        unchecked=readleaves<ndict_unchecked>(leaves,types);
+    });
+    if(checked!=unchecked) printf("    Checked and unchecked reads differ on %s\n",c.name.c_str());
+
+    // Merge into an empty and a populated dictionary, copy and detach
+    run(results,c,"merge",seconds,0,1,[&](){
+        ndict target;
+        target.merge(doc);
+    });
+    ndict populated=doc;
+    run(results,c,"remerge",seconds,0,1,[&](){
+        populated.merge(doc);
+    });
+    run(results,c,"copy",seconds,0,1,[&](){
+        ndict copy=doc;
+        copy["bench"]=1;
+    });
+}
+
+/*!\brief Read a baseline file
+ * \param path Path to the baseline
+ * \return Time per operation, keyed by corpus and operation
+ */
+static std::map<std::string,double> readbaseline(const char *path){
+    std::map<std::string,double> baseline;
+    FILE *fd=fopen(path,"r");
+    if(!fd){
+        printf("Failed to open baseline %s\n",path);
+        exit(1);
+    }
+    char corpus[64],operation[64];
+    double nsop;
+    while(fscanf(fd,"%63s %63s %lf",corpus,operation,&nsop)==3){
+        baseline[std::string(corpus)+" "+operation]=nsop;
+    }
+    fclose(fd);
+    return baseline;
+}
+
+/*!\brief Run the benchmark suite
+ * \param argc Argument count
+ * \param argv Options and optional corpus names
+ * \return 0, or 1 if a regression against the baseline was found
+ */
+int main(int argc,char *argv[]){
+    double seconds=0.2,threshold=10;
+    const char *save=NULL,*compare=NULL;
+    std::vector<std::string> selected;
+    for(int i=1;i<argc;i++){
+        std::string arg=argv[i];
+        if(arg=="--time" && i+1<argc)           seconds=atof(argv[++i]);
+        else if(arg=="--save" && i+1<argc)      save=argv[++i];
+        else if(arg=="--compare" && i+1<argc)   compare=argv[++i];
+        else if(arg=="--threshold" && i+1<argc) threshold=atof(argv[++i]);
+        else if(arg.compare(0,2,"--")==0){
+            printf("Usage: %s [--time seconds] [--save file] [--compare file] [--threshold percent] [corpus...]\n",argv[0]);
+            return 1;
+        }
+        else selected.push_back(arg);
+    }
+
+    // Generate and measure the corpora
+    std::vector<corpus (*)()> generators={makewide,makearray,makedeep,makenumbers,makestrings,makendjson};
+    std::vector<result> results;
+    printf("%-10s%-10s%12s%14s%14s\n","corpus","operation","MB/s","ns/op","allocs/op");
+    for(auto generator : generators){
+        corpus c=generator();
+        bool run=selected.empty();
+        for(const std::string &name : selected) run=run || name==c.name;
+        if(run) measure(results,c,seconds);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    printf("\nPeak RSS: %ld kB\n",usage.ru_maxrss);
+
+    // Save the results as a baseline
+    if(save){
+        FILE *fd=fopen(save,"w");
+        if(!fd){
+            printf("Failed to write baseline %s\n",save);
+            return 1;
+        }
+        for(const result &r : results) fprintf(fd,"%s %s %.1f\n",r.corpus.c_str(),r.operation.c_str(),r.nsop);
+        fclose(fd);
+        printf("Saved baseline to %s\n",save);
+    }
+
+    // Compare against a baseline
+    int regressions=0;
+    if(compare){
+        std::map<std::string,double> baseline=readbaseline(compare);
+        printf("\nCompared to %s (threshold %.0f%%):\n",compare,threshold);
+        for(const result &r : results){
+            auto it=baseline.find(r.corpus+" "+r.operation);
+            if(it==baseline.end() || it->second<=0) continue;
+            double change=(r.nsop/it->second-1)*100;
+            bool regressed=change>threshold;
+            printf("%-10s%-10s%+11.1f%% %s\n",r.corpus.c_str(),r.operation.c_str(),change,regressed?"REGRESSION":"");
+            if(regressed) regressions++;
+        }
+        if(regressions) printf("\n%d regressions found!\n",regressions);
+        else            printf("\nNo regressions\n");
+    }
+    return regressions?1:0;
+}
@@ -0,0 +1,110 @@
+/*!\file bench_snapshot.cpp
+ * \brief Read throughput of a shared configuration during continuous reloads
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "njson.h"
+#include "nsnapshot.h"
+
+/*!\brief Generate a configuration document
+ * \param sections Number of nested sections
+ * \param keys Number of keys per section
+ * \param generation Value stored in every key
+ * \return JSON string
+ */
+std::string makeconfig(const int &sections,const int &keys,const int &generation){
+    std::string json="{";
+    for(int i=0;i<sections;i++){
+        if(i) json+=",";
+        json+="\"section"+std::to_string(i)+"\":{";
+        for(int j=0;j<keys;j++){
+            if(j) json+=",";
+            json+="\"key"+std::to_string(j)+"\":"+std::to_string(generation);
+        }
+        json+="}";
+    }
+    return json+"}";
+}
+
+/*!\brief Run readers and a reloading writer for a while
+ * \param name Name of the benchmark
+ * \param threads Number of reader threads
+ * \param seconds Duration of the benchmark
+ * \param read Function performing one lookup for a given reader thread
+ * \param reload Function decoding and publishing a new configuration
+ */
+template<typename R,typename W> void run(const char *name,const int &threads,const double &seconds,R read,W reload){
+    std::atomic<bool> running(true);
+    std::vector<unsigned long> counts(threads,0);
+    std::vector<std::thread> readers;
+    for(int i=0;i<threads;i++){
+        readers.push_back(std::thread([&,i](){
+            unsigned long count=0;
+            while(running.load(std::memory_order_relaxed)){
+                read(i,count);
+                count++;
+            }
+            counts[i]=count;
+        }));
+    }
+    unsigned long reloads=0;
+    auto start=std::chrono::steady_clock::now();
+    while(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()<seconds){
+        reload(++reloads);
+    }
+    running=false;
+    for(int i=0;i<threads;i++) readers[i].join();
+    double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    unsigned long total=0;
+    for(int i=0;i<threads;i++) total+=counts[i];
+    printf("    %-20s%12.0f reads/s %10.1f ns/read %8lu reloads\n",name,total/elapsed,elapsed*1e9*threads/total,reloads);
+}
+
+/*!\brief Compare mutex-protected and snapshot-based configuration reads
+ * \param argc Argument count
+ * \param argv Optional reader thread count and duration in seconds
+ * \return 0
+ */
+int main(int argc,char *argv[]){
+    int threads=argc>1?atoi(argv[1]):std::max(2u,std::thread::hardware_concurrency());
+    double seconds=argc>2?atof(argv[2]):2;
+    const int sections=20,keys=20;
+    njson json;
+    printf("Snapshot read throughput, %d readers during continuous reloads:\n",threads);
+
+    // Baseline: every read and reload takes a global lock
+    {
+        std::mutex lock;
+        ndict config=json.decode(makeconfig(sections,keys,0));
+        run("mutex",threads,seconds,[&](int thread,unsigned long count){
+            std::lock_guard<std::mutex> guard(lock);
+            const ndict &cfg=config;
+            volatile int value=cfg["section"+std::to_string(count%sections)]["key"+std::to_string(thread%keys)].getint();
+            (void)value;
+        },[&](unsigned long generation){
+            ndict next=json.decode(makeconfig(sections,keys,generation));
+            std::lock_guard<std::mutex> guard(lock);
+            config=next;
+        });
+    }
+
+    // Snapshots: readers only check the version on the fast path
+    {
+        nsnapshot config(json.decode(makeconfig(sections,keys,0)));
+        std::vector<nsnapshot::reader> handles(threads,nsnapshot::reader(config));
+        run("nsnapshot",threads,seconds,[&](int thread,unsigned long count){
+            const ndict &cfg=handles[thread].get();
+            volatile int value=cfg["section"+std::to_string(count%sections)]["key"+std::to_string(thread%keys)].getint();
+            (void)value;
+        },[&](unsigned long generation){
+            config.publish(json.decode(makeconfig(sections,keys,generation)));
+        });
+    }
+    return 0;
+}
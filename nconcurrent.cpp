@@ -0,0 +1,207 @@
+#include "nconcurrent.h"
+
+#define LOCK(SHARD)     std::lock_guard<std::mutex> guard((SHARD).lock)
+
+/*!\brief Create an empty concurrent object
+ * \param shards Number of independently locked shards
+ */
+nconcurrent::nconcurrent(const unsigned &shards) : shards(new shard[shards?shards:1]), count(shards?shards:1) {
+}
+
+/*!\brief Select the shard holding a key
+ * \param key Key to look up
+ * \return Reference to the shard
+ */
+nconcurrent::shard &nconcurrent::select(const std::string &key) const{
+    return shards[std::hash<std::string>()(key)%count];
+}
+
+/*!\brief Prepare a value for storing in a shard
+ * \param value Value to store
+ * \return Copy sharing the members of the value
+ *
+ * Structural hashes are computed and JSON caching is turned off before the
+ * value is published, so threads reading copies of it, or comparing against
+ * it, never write to the members they share.
+ */
+static ndict prepare(const ndict &value){
+    ndict copy=value;
+    copy.cachejson(false);
+    copy.hash();
+    return copy;
+}
+
+/*!\brief Get a copy of a keyed value
+ * \param key Key to look up
+ * \return Copy of the value, or a null object if not set
+ *
+ * The copy shares its members with the stored value, so getting large
+ * objects is cheap.
+ */
+ndict nconcurrent::get(const std::string &key) const{
+    shard &s=select(key);
+    LOCK(s);
+    auto it=s.members.find(key);
+    return it==s.members.end()?ndict():it->second;
+}
+
+/*!\brief Set a keyed value
+ * \param key Key to set
+ * \param value Value to store
+ */
+void nconcurrent::set(const std::string &key,const ndict &value){
+    ndict stored=prepare(value);
+    shard &s=select(key);
+    LOCK(s);
+    s.members[key]=stored;
+}
+
+/*!\brief Set a keyed value and return the previous one
+ * \param key Key to set
+ * \param value Value to store
+ * \return Previous value, or a null object if not set
+ */
+ndict nconcurrent::exchange(const std::string &key,const ndict &value){
+    ndict stored=prepare(value);
+    shard &s=select(key);
+    LOCK(s);
+    ndict &member=s.members[key];
+    ndict previous=member;
+    member=stored;
+    return previous;
+}
+
+/*!\brief Set a keyed value if it equals an expected value
+ * \param key Key to set
+ * \param expected Value the key must hold, a null object for unset keys
+ * \param desired Value to store
+ * \return true if the value was stored
+ */
+bool nconcurrent::compareexchange(const std::string &key,const ndict &expected,const ndict &desired){
+    ndict stored=prepare(desired);
+    shard &s=select(key);
+    LOCK(s);
+    auto it=s.members.find(key);
+    const ndict &current=(it==s.members.end())?ndict():it->second;
+    if(current!=expected) return false;
+    s.members[key]=stored;
+    return true;
+}
+
+/*!\brief Modify a keyed value in place
+ * \param key Key to modify
+ * \param function Function modifying the value, unset keys are passed as null objects
+ * \return Copy of the modified value
+ *
+ * The function runs while holding the lock of the shard, so it must not
+ * access this object.
+ */
+ndict nconcurrent::update(const std::string &key,const std::function<void(ndict &value)> &function){
+    shard &s=select(key);
+    LOCK(s);
+    ndict &member=s.members[key];
+    function(member);
+    member.cachejson(false);
+    member.hash();
+    return member;
+}
+
+/*!\brief Atomically add to a numeric counter
+ * \param key Key of the counter, unset keys count from 0
+ * \param delta Value to add
+ * \return New value of the counter
+ *
+ * Throws ndict_exception if the key holds a value that is not a number.
+ */
+int nconcurrent::increment(const std::string &key,const int &delta){
+    shard &s=select(key);
+    LOCK(s);
+    ndict &member=s.members[key];
+    int value=(member.type==ndict::TNULL?0:member.getint())+delta;
+    member=value;
+    member.hash();
+    return value;
+}
+
+/*!\brief Remove a keyed value
+ * \param key Key to remove
+ * \return true if the key was found and removed
+ */
+bool nconcurrent::erase(const std::string &key){
+    shard &s=select(key);
+    LOCK(s);
+    return s.members.erase(key)>0;
+}
+
+/*!\brief Check if key is present in this object
+ * \param key Key to look up
+ * \return true if key was found with a valid value
+ */
+bool nconcurrent::haskey(const std::string &key) const{
+    shard &s=select(key);
+    LOCK(s);
+    auto it=s.members.find(key);
+    return it!=s.members.end() && it->second.type!=ndict::TNULL;
+}
+
+/*!\brief Get number of keys
+ * \return Number of keys at the time each shard was visited
+ */
+unsigned nconcurrent::size() const{
+    unsigned size=0;
+    for(unsigned i=0;i<count;i++){
+        LOCK(shards[i]);
+        size+=shards[i].members.size();
+    }
+    return size;
+}
+
+/*!\brief Remove all keys
+ */
+void nconcurrent::clear(){
+    for(unsigned i=0;i<count;i++){
+        LOCK(shards[i]);
+        shards[i].members.clear();
+    }
+}
+
+/*!\brief Take a consistent snapshot of all keys
+ * \return Dictionary object holding every key at a single point in time
+ *
+ * All shards are locked while their members are copied, which is O(1) per
+ * member as the copies share their children.
+ */
+ndict nconcurrent::snapshot() const{
+    // Lock every shard in order, then copy the members
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for(unsigned i=0;i<count;i++){
+        locks.push_back(std::unique_lock<std::mutex>(shards[i].lock));
+    }
+    std::vector<std::pair<std::string,ndict>> members;
+    for(unsigned i=0;i<count;i++){
+        members.insert(members.end(),shards[i].members.begin(),shards[i].members.end());
+    }
+    locks.clear();
+
+    // Build the dictionary object outside of the locks, keys are unique
+    std::sort(members.begin(),members.end(),[](const std::pair<std::string,ndict> &a,const std::pair<std::string,ndict> &b){
+        return a.first<b.first;
+    });
+    ndict object;
+    if(members.size()){
+        ndict_builder::setblock(object,ndict::TOBJECT);
+        for(unsigned i=0;i<members.size();i++){
+            const std::string &key=members[i].first;
+            ndict_builder::setmember(object,i,key.data(),key.size())=members[i].second;
+        }
+    }
+    return object;
+}
+
+/*!\brief Encode a consistent snapshot of all keys as a JSON string
+ * \param indent Number of spaces to use for indentation
+ * \return A JSON string with keys in sorted order
+ */
+std::string nconcurrent::getjson(const int &indent) const{
+    return snapshot().getjson(indent);
+}
@@ -0,0 +1,67 @@
+/*!\file nconcurrent.h
+ * \brief A concurrent keyed dictionary for multi-writer workloads
+ */
+#ifndef _NCONCURRENT_H_
+#define _NCONCURRENT_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "ndict.h"
+
+/*!\class nconcurrent
+ * \brief Implements a concurrent object with independently locked shards
+ *
+ * Keys are distributed over a number of shards, each guarding its members
+ * with its own lock, so threads updating different keys rarely contend.
+ * Every operation on a single key is atomic, and a consistent snapshot of
+ * all keys can be taken as a regular dictionary object. Stored values are
+ * hashed before they are published, so copies returned by get() can be read
+ * and compared on any thread.
+ */
+class nconcurrent {
+    private:
+        //! Members of one shard, padded to avoid false sharing
+        struct alignas(64) shard{
+            std::mutex lock;
+            std::unordered_map<std::string,ndict> members;
+        };
+        std::unique_ptr<shard[]> shards;
+        unsigned count;
+        shard &select(const std::string &key) const;
+    public:
+        nconcurrent(const unsigned &shards=16);
+
+        // Atomic single-key operations
+        ndict get(const std::string &key) const;
+        void set(const std::string &key,const ndict &value);
+        ndict exchange(const std::string &key,const ndict &value);
+        bool compareexchange(const std::string &key,const ndict &expected,const ndict &desired);
+        ndict update(const std::string &key,const std::function<void(ndict &value)> &function);
+        int increment(const std::string &key,const int &delta=1);
+        bool erase(const std::string &key);
+        bool haskey(const std::string &key) const;
+
+        //! Set a keyed value from any type assignable to a dictionary object
+        template<typename T> void set(const std::string &key,const T &value){
+            ndict object;
+            object=value;
+            set(key,object);
+        }
+
+        //! Exchange a keyed value with any type assignable to a dictionary object
+        template<typename T> ndict exchange(const std::string &key,const T &value){
+            ndict object;
+            object=value;
+            return exchange(key,object);
+        }
+
+        // Whole-object operations
+        unsigned size() const;
+        void clear();
+        ndict snapshot() const;
+        std::string getjson(const int &indent=4) const;
+};
+
+#endif
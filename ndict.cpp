@@ -1,74 +1,169 @@
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include "ndict.h"
+#include "nstats.h"
+#include "ntrace.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define QUOTE(STR)      (std::string("\"")+std::string(STR)+std::string("\""))
-#define SET(TYPE,VALUE) {type=TYPE; value=VALUE; return *this;}
+#define SET(TYPE,VALUE) {block.reset(); touch(); type=TYPE; value=VALUE; return *this;}
 
 /*!\brief Assignemnt operator for boolean values
  * \param Value Value to assign to dictionary object
  * \return Reference to assigned dictionary object
  */
-ndict& ndict::operator=(const bool &Value) SET(TBOOL,Value?"true":"false")
+NDICT_INLINE ndict& ndict::operator=(const bool &Value) SET(TBOOL,Value?"true":"false")
 
 /*!\brief Assignemnt operator for boolean values
  * \param Value Value to assign to dictionary object
  * \return Reference to assigned dictionary object
  */
-ndict& ndict::operator=(const std::string &Value) SET(TSTRING,Value)
+NDICT_INLINE ndict& ndict::operator=(const std::string &Value) SET(TSTRING,Value)
 
 /*!\brief Assignemnt operator for boolean values
  * \param Value Value to assign to dictionary object
  * \return Reference to assigned dictionary object
  */
-ndict& ndict::operator=(const char *Value) SET(TSTRING,Value)
+NDICT_INLINE ndict& ndict::operator=(const char *Value) SET(TSTRING,Value)
 
 /*!\brief Assignemnt operator for boolean values
  * \param Value Value to assign to dictionary object
  * \return Reference to assigned dictionary object
  */
-ndict& ndict::operator=(const int &Value) SET(TNUMBER,std::to_string(Value))
+NDICT_INLINE ndict& ndict::operator=(const int &Value) SET(TNUMBER,std::to_string(Value))
 
 /*!\brief Assignemnt operator for boolean values
  * \param Value Value to assign to dictionary object
  * \return Reference to assigned dictionary object
  */
-ndict& ndict::operator=(const unsigned int &Value) SET(TNUMBER,std::to_string(Value))
+NDICT_INLINE ndict& ndict::operator=(const unsigned int &Value) SET(TNUMBER,std::to_string(Value))
 
 /*!\brief Assignemnt operator for boolean values
  * \param Value Value to assign to dictionary object
  * \return Reference to assigned dictionary object
  */
-ndict& ndict::operator=(const double &Value) SET(TNUMBER,std::to_string(Value))
+NDICT_INLINE ndict& ndict::operator=(const double &Value) SET(TNUMBER,std::to_string(Value))
+
+/*!\brief Copy a dictionary object
+ * \param other Dictionary object to copy
+ *
+ * Members are shared with the other object, unless references to them have
+ * been handed out by its non-const subscripts. Those are cloned, so writes
+ * through the references don't reach the copy.
+ */
+NDICT_INLINE ndict::ndict(const ndict &other) : block(other.block), value(other.value), jsoncaching(other.jsoncaching), type(other.type) {
+    if(block && block->leaked) block=clone(*block);
+}
+
+/*!\brief Move a dictionary object
+ * \param other Dictionary object to take the members of, left null
+ */
+NDICT_INLINE ndict::ndict(ndict &&other) noexcept : block(std::move(other.block)), value(std::move(other.value)), jsoncaching(other.jsoncaching), type(other.type) {
+    if(block && block->leaked) block->holder=this;
+    other.type=TNULL;
+}
+
+/*!\brief Assign a copy of another dictionary object
+ * \param other Dictionary object to copy, may be a member of this one
+ * \return Reference to this object
+ */
+NDICT_INLINE ndict& ndict::operator=(const ndict &other){
+    if(this!=&other) *this=ndict(other);
+    return *this;
+}
+
+/*!\brief Take the members of another dictionary object
+ * \param other Dictionary object to take the members of, may be a member of this one
+ * \return Reference to this object
+ *
+ * The members holding this object are invalidated, as it may be a reference
+ * handed out by their subscripts.
+ */
+NDICT_INLINE ndict& ndict::operator=(ndict &&other) noexcept{
+    if(this==&other) return *this;
+    // Release the previous members last, they may hold the other object
+    std::shared_ptr<children> previous=std::move(block);
+    block=std::move(other.block);
+    value=std::move(other.value);
+    jsoncaching=other.jsoncaching;
+    type=other.type;
+    other.type=TNULL;
+    if(block && block->leaked) block->holder=this;
+    touchparents();
+    return *this;
+}
 
 /*!\brief Subscript operator for keyed dictionary values
  * \param Key Key to return object for
  * \return Reference to keyed dictionary object
+ *
+ * The returned member may be modified by the caller at any later time, so
+ * copies of this object clone its members from now on.
+ */
+NDICT_INLINE ndict& ndict::operator[](const std::string &Key){
+    ndict &item=member(Key);
+    block->leaked=true;
+    block->holder=this;
+    item.owner=block.get();
+    return item;
+}
+
+/*!\brief Subscript operator for indexed dictionary values
+ * \param Index Numerical index to return object for
+ * \return Reference to indexed dictionary object
+ *
+ * The returned member may be modified by the caller at any later time, so
+ * copies of this object clone its members from now on.
+ */
+NDICT_INLINE ndict& ndict::operator[](const unsigned &Index){
+    ndict &item=member(Index);
+    block->leaked=true;
+    block->holder=this;
+    item.owner=block.get();
+    return item;
+}
+
+/*!\brief Get or create a keyed member for modification
+ * \param Key Key to return object for
+ * \return Reference to keyed dictionary object, valid until this object is modified
  */
-ndict& ndict::operator[](const std::string &Key){
+NDICT_INLINE ndict& ndict::member(const std::string &Key){
     // Clear existing array values
     if(type==TARRAY){
-        keys.clear();
-        items.clear();
+        block.reset();
     }
 
+    // The caller may modify the returned member
+    children &c=wr();
+    touch();
+
     // Find existing value
-    for(unsigned i=0;i<keys.size();i++){
-        if(keys[i]==Key){
-            return items[i];
+    NSTATS_COUNT(CLOOKUPS,1);
+    for(unsigned i=0;i<c.keys.size();i++){
+        if(c.keys[i]==Key){
+            NSTATS_COUNT(CPROBES,i+1);
+            return c.items[i];
         }
     }
+    NSTATS_COUNT(CPROBES,c.keys.size());
 
     // Push new value
     type=TOBJECT;
-    keys.push_back(Key);
-    items.push_back(ndict());
-    return items.back();
+    const ndict *data=c.items.data();
+    c.keys.push_back(Key);
+    c.items.push_back(ndict());
+    adopt(c,c.items.data()==data?c.items.size()-1:0);
+    return c.items.back();
 }
 
-/*!\brief Subscript operator for indexed dictionary values
+/*!\brief Get or create an indexed member for modification
  * \param Index Numerical index to return object for
- * \return Reference to indexed dictionary object
+ * \return Reference to indexed dictionary object, valid until this object is modified
  */
-ndict& ndict::operator[](const unsigned &Index){
+NDICT_INLINE ndict& ndict::member(const unsigned &Index){
     // Check bounds
     if(Index>NDICT_MAX_ARRAY_SIZE){
         throw ndict_exception("Array index is out of bound");
@@ -76,46 +171,534 @@ ndict& ndict::operator[](const unsigned &Index){
 
     // Clear non-array values
     if(type!=TARRAY){
-        keys.clear();
-        items.clear();
+        block.reset();
     }
 
-    // Assert array contents
+    // The caller may modify the returned member
     type=TARRAY;
-    for(unsigned i=0;i<=Index;i++){
-        bool hit=false;
-        for(unsigned j=0;!hit && j<keys.size();j++){
-            hit|=(keys[j]==std::to_string(i));
-        }
-        if(!hit){
-            keys.push_back(std::to_string(i));
-            items.push_back(ndict());
-        }
+    children &c=wr();
+    touch();
+    markindex(Index);
+
+    // Assert array contents, array keys are always their ordered indices
+    const ndict *data=c.items.data();
+    size_t count=c.items.size();
+    while(c.items.size()<=Index){
+        c.keys.push_back(std::to_string(c.keys.size()));
+        c.items.push_back(ndict());
     }
+    adopt(c,c.items.data()==data?count:0);
+    return c.items[Index];
+}
 
-    // Find item
-    for(unsigned i=0;i<keys.size();i++){
-        if(keys[i]==std::to_string(Index)){
-            return items[i];
+/*!\brief Read-only subscript operator for keyed dictionary values
+ * \param Key Key to return object for
+ * \return Reference to keyed dictionary object, or a null object if not found
+ *
+ * Does not modify or detach the dictionary, and is safe to use concurrently
+ * with other readers.
+ */
+NDICT_INLINE const ndict& ndict::operator[](const std::string &Key) const{
+    const children &c=rd();
+    NSTATS_COUNT(CLOOKUPS,1);
+    for(unsigned i=0;i<c.keys.size();i++){
+        if(c.keys[i]==Key){
+            NSTATS_COUNT(CPROBES,i+1);
+            return c.items[i];
         }
     }
+    NSTATS_COUNT(CPROBES,c.keys.size());
+    return null();
+}
+
+/*!\brief Read-only subscript operator for indexed dictionary values
+ * \param Index Numerical index to return object for
+ * \return Reference to indexed dictionary object, or a null object if not found
+ *
+ * Does not modify or detach the dictionary, and is safe to use concurrently
+ * with other readers.
+ */
+NDICT_INLINE const ndict& ndict::operator[](const unsigned &Index) const{
+    const children &c=rd();
+    if(type==TARRAY && Index<c.items.size()){
+        return c.items[Index];
+    }
+    return null();
+}
+
+/*!\brief Get a shared null object
+ * \return Reference to an immutable null object
+ */
+NDICT_INLINE const ndict &ndict::null(){
+    static const ndict empty;
+    return empty;
+}
+
+/*!\brief Get read access to child members
+ * \return Child members, empty for scalar values
+ */
+NDICT_INLINE const ndict::children &ndict::rd() const{
+    static const children empty;
+    if(!block) return empty;
+    if(block->lazyexpand.load(std::memory_order_acquire)) expand();
+    return *block;
+}
+
+/*!\brief Get write access to child members
+ * \return Child members owned exclusively by this object
+ *
+ * Members shared with copies of this object are cloned first, see clone().
+ */
+NDICT_INLINE ndict::children &ndict::wr(){
+    if(!block){
+        NSTATS_COUNT(CALLOCATIONS,1);
+        block=std::make_shared<children>();
+        return *block;
+    }
+    if(block->lazyexpand.load(std::memory_order_acquire)){
+        expand();
+    }
+    if(block.use_count()>1){
+        block=clone(*block);
+    }
+    else if(!block->numbers.empty()){
+        // Packed numbers are only kept while the members are unmodified
+        block->numbers.clear();
+        block->integers.clear();
+    }
+    return *block;
+}
+
+/*!\brief Clone child members for modification by a single object
+ * \param c Child members to clone
+ * \return New child members
+ *
+ * The clone is shallow, as the members themselves keep sharing their own
+ * children, except where those have been handed out for modification.
+ */
+NDICT_INLINE std::shared_ptr<ndict::children> ndict::clone(const children &c){
+    NSTATS_COUNT(CALLOCATIONS,1);
+    std::shared_ptr<children> copy=std::make_shared<children>();
+    copy->keys=c.keys;
+    copy->items=c.items;
+    copy->indexes=c.indexes;
+    copy->dirty=c.dirty;
+    copy->indexstale=c.indexstale;
+    copy->hashcache.store(c.hashcache.load(std::memory_order_relaxed),std::memory_order_relaxed);
+    copy->hashvalid.store(c.hashvalid.load(std::memory_order_acquire),std::memory_order_relaxed);
+    return copy;
+}
 
-    // Fallback to satisfy compiler: TODO: Throw
-    throw ndict_exception("Invalid array allocation");
+/*!\brief Link members to the members holding them
+ * \param c Child members that were added to or moved
+ * \param from Position of the first member to link
+ *
+ * Only members that references may have been handed out for are linked, so
+ * writes through those references can invalidate the holders, see touch().
+ */
+NDICT_INLINE void ndict::adopt(children &c,const size_t &from){
+    if(!c.leaked) return;
+    for(size_t i=from;i<c.items.size();i++){
+        c.items[i].owner=&c;
+    }
+}
+
+/*!\brief Materialize lazily decoded or packed child members
+ *
+ * Members are decoded from the unparsed source text one level at a time,
+ * or created from packed numbers, and shared with all copies of this
+ * object. Concurrent readers using the const accessors wait for the first
+ * one to finish, while other blocks are expanded independently. Non-const accessors are writes: they detach the members
+ * from copies and drop packed numbers, so they must not be used on an
+ * object read by other threads.
+ */
+NDICT_INLINE void ndict::expand() const{
+    std::lock_guard<std::mutex> guard(block->lazylock);
+    void (*callback)(children &c)=block->lazyexpand.load(std::memory_order_relaxed);
+    if(!callback) return;
+    NTRACE_SCOPE("ndict::expand");
+    callback(*block);
+    block->lazyexpand.store(nullptr,std::memory_order_release);
+}
+
+/*!\brief Create members from packed numbers
+ * \param c Child members holding packed numbers
+ *
+ * Numbers are formatted like decoded JSON numbers are, and the packed
+ * buffer is kept for bulk operations.
+ */
+NDICT_INLINE void ndict::unpack(children &c){
+    char buffer[512];
+    c.keys.resize(c.numbers.size());
+    c.items.resize(c.numbers.size());
+    for(unsigned i=0;i<c.numbers.size();i++){
+        c.keys[i]=std::to_string(i);
+        ndict &item=c.items[i];
+        item.type=TNUMBER;
+        if(!c.integers.empty()) item.value.assign(buffer,std::to_chars(buffer,buffer+sizeof(buffer),c.integers[i]).ptr-buffer);
+        else                    item.value.assign(buffer,snprintf(buffer,sizeof(buffer),"%f",c.numbers[i]));
+    }
+}
+
+/*!\brief Create members from a lazily decoded span
+ * \param c Child members holding the unparsed span
+ *
+ * The decoder builds the members on a separate node, which are then moved
+ * into the shared members.
+ */
+NDICT_INLINE void ndict::lazydecode(children &c){
+    std::shared_ptr<const std::string> source;
+    source.swap(c.lazysource);
+    ndict node;
+    c.lazydecoder(node,source,c.lazydata,c.lazysize);
+    if(node.block){
+        c.keys.swap(node.block->keys);
+        c.items.swap(node.block->items);
+    }
+    c.lazydata=nullptr;
+    c.lazysize=0;
+}
+
+/*!\brief Check if members only exist as packed numbers
+ * \return true if no member nodes have been created yet
+ */
+NDICT_INLINE bool ndict::packedonly() const{
+    return block && block->lazyexpand.load(std::memory_order_acquire)==&ndict::unpack;
+}
+
+/*!\brief Append the JSON encoding of packed numbers without creating members
+ * \param out String to append to
+ */
+NDICT_INLINE void ndict::encodepacked(std::string &out) const{
+    char buffer[512];
+    const children &c=*block;
+    NSTATS_COUNT(CENCODEDNODES,c.numbers.size());
+    out+="[";
+    for(unsigned i=0;i<c.numbers.size();i++){
+        if(i) out+=",";
+        if(!c.integers.empty()) out.append(buffer,std::to_chars(buffer,buffer+sizeof(buffer),c.integers[i]).ptr-buffer);
+        else                    out.append(buffer,snprintf(buffer,sizeof(buffer),"%f",c.numbers[i]));
+    }
+    out+="]";
+}
+
+/*!\brief Set a scalar value from its text
+ * \param Type Type of the value, TNULL to clear it
+ * \param data Text of the value, as returned by getstring()
+ * \param size Length of the text
+ *
+ * Members of objects and arrays are dropped, and the storage of the
+ * previous value is reused.
+ */
+NDICT_INLINE void ndict::setvalue(const type_t &Type,const char *data,const size_t &size){
+    block.reset();
+    touch();
+    type=Type;
+    value.assign(data,size);
+}
+
+/*!\brief Start building an object or array in place
+ * \param Type TOBJECT or TARRAY
+ *
+ * Existing members are kept, so setmember() can reuse their storage when
+ * similarly shaped data is loaded again. Members left over once building is
+ * done are dropped with truncate().
+ */
+NDICT_INLINE void ndict::setblock(const type_t &Type){
+    if(packedonly() && block.use_count()==1){
+        // Skip creating members that are about to be replaced
+        block->lazyexpand=nullptr;
+    }
+    wr();
+    touch();
+    markindex(-1);
+    type=Type;
+    value.clear();
+}
+
+/*!\brief Set the key of a member by position
+ * \param index Position of the member, members up to it are created as needed
+ * \param key Characters of the key
+ * \param size Length of the key
+ * \return Reference to the member, still holding its previous value if any
+ *
+ * Keys are not checked against the other members, so callers must look up
+ * duplicates with find() first. Array members are keyed by their index.
+ */
+NDICT_INLINE ndict &ndict::setmember(const unsigned &index,const char *key,const size_t &size){
+    children &c=wr();
+    if(index<c.items.size()){
+        std::string &current=c.keys[index];
+        if(current.size()!=size || memcmp(current.data(),key,size)) current.assign(key,size);
+    }
+    else{
+        const ndict *data=c.items.data();
+        size_t count=c.items.size();
+        c.keys.resize(index);
+        c.items.resize(index);
+        c.keys.emplace_back(key,size);
+        c.items.emplace_back();
+        adopt(c,c.items.data()==data?count:0);
+    }
+    return c.items[index];
+}
+
+/*!\brief Drop members after the first ones
+ * \param count Number of members to keep
+ */
+NDICT_INLINE void ndict::truncate(const unsigned &count){
+    if(!block || count>=rd().items.size()) return;
+    children &c=wr();
+    touch();
+    markindex(-1);
+    c.keys.erase(c.keys.begin()+count,c.keys.end());
+    c.items.erase(c.items.begin()+count,c.items.end());
+}
+
+/*!\brief Make this node an array of packed decimals
+ * \param numbers Numbers of the array, swapped with the previous buffer of this node
+ *
+ * Member nodes are only created when the array is accessed by index, see
+ * packed(). The buffer handed back keeps its capacity for reuse.
+ */
+NDICT_INLINE void ndict::setnumbers(std::vector<double> &numbers){
+    children &c=wr();
+    touch();
+    markindex(-1);
+    type=TARRAY;
+    value.clear();
+    c.keys.clear();
+    c.items.clear();
+    c.numbers.swap(numbers);
+    c.integers.clear();
+    c.lazyexpand=&ndict::unpack;
+}
+
+/*!\brief Make this node an array of packed integers
+ * \param integers Integers of the array, swapped with the previous buffer of this node
+ *
+ * Integers are kept exactly for their members and encoding, and converted
+ * to numbers for bulk operations.
+ */
+NDICT_INLINE void ndict::setnumbers(std::vector<int64_t> &integers){
+    children &c=wr();
+    touch();
+    markindex(-1);
+    type=TARRAY;
+    value.clear();
+    c.keys.clear();
+    c.items.clear();
+    c.numbers.assign(integers.begin(),integers.end());
+    c.integers.swap(integers);
+    c.lazyexpand=&ndict::unpack;
+}
+
+/*!\brief Make this node an object or array decoded when first accessed
+ * \param Type TOBJECT or TARRAY
+ * \param source Buffer holding the text, kept alive until the members are decoded
+ * \param data Text of the members within the buffer
+ * \param size Length of the text
+ * \param decoder Function creating the members from the text
+ *
+ * The decoder runs once, the first time the members are read through any
+ * copy of this node, and builds them on the node it is given.
+ */
+NDICT_INLINE void ndict::setlazy(const type_t &Type,const std::shared_ptr<const std::string> &source,const char *data,const size_t &size,lazydecoder_t decoder){
+    NSTATS_COUNT(CALLOCATIONS,1);
+    block=std::make_shared<children>();
+    touch();
+    type=Type;
+    value.clear();
+    block->lazysource=source;
+    block->lazydata=data;
+    block->lazysize=size;
+    block->lazydecoder=decoder;
+    block->lazyexpand=&ndict::lazydecode;
+}
+
+/*!\brief Invalidate cached state after a mutation
+ *
+ * Mutating operators and subscripts call this, so every node on the access
+ * path from the root is invalidated when a nested member is modified. Writes
+ * through held references also invalidate the members holding them.
+ */
+NDICT_INLINE void ndict::touch(){
+    if(block){
+        block->hashvalid.store(false,std::memory_order_relaxed);
+        block->jsonindent=-1;
+    }
+    touchparents();
+}
+
+/*!\brief Invalidate cached state of the members holding this node
+ *
+ * Walks up from a member handed out by a subscript to the root, marking the
+ * member on the way in the indexes of its holders.
+ */
+NDICT_INLINE void ndict::touchparents(){
+    ndict *node=this;
+    while(node && node->owner){
+        children &c=*node->owner;
+        unsigned item=node-c.items.data();
+        c.hashvalid.store(false,std::memory_order_relaxed);
+        c.jsonindent=-1;
+        node=c.holder;
+        if(node) node->markindex(item);
+    }
 }
 
 /*!\brief Get size of dictionary object
  * \return Number of child members or array size
  */
-unsigned ndict::size() const {
-    return keys.size();
+NDICT_INLINE unsigned ndict::size() const {
+    if(packed()) return block->numbers.size();
+    return rd().keys.size();
+}
+
+/*!\brief Add up numbers
+ * \param data First number
+ * \param size Number of numbers
+ * \return Sum of the numbers
+ */
+NDICT_INLINE double ndict::addnumbers(const double *data,const size_t &size){
+    size_t i=0;
+    double total=0;
+#if defined(__SSE2__)
+    __m128d a=_mm_setzero_pd(),b=_mm_setzero_pd();
+    for(;i+4<=size;i+=4){
+        a=_mm_add_pd(a,_mm_loadu_pd(data+i));
+        b=_mm_add_pd(b,_mm_loadu_pd(data+i+2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes,_mm_add_pd(a,b));
+    total=lanes[0]+lanes[1];
+#endif
+    for(;i<size;i++) total+=data[i];
+    return total;
+}
+
+/*!\brief Find the smallest and largest of some numbers
+ * \param data First number
+ * \param size Number of numbers, at least one
+ * \param low Set to the smallest number
+ * \param high Set to the largest number
+ */
+NDICT_INLINE void ndict::rangenumbers(const double *data,const size_t &size,double &low,double &high){
+    size_t i=0;
+    low=high=data[0];
+#if defined(__SSE2__)
+    if(size>=2){
+        __m128d lows=_mm_loadu_pd(data),highs=lows;
+        for(i=2;i+2<=size;i+=2){
+            __m128d values=_mm_loadu_pd(data+i);
+            lows=_mm_min_pd(lows,values);
+            highs=_mm_max_pd(highs,values);
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes,lows);
+        low=std::min(lanes[0],lanes[1]);
+        _mm_storeu_pd(lanes,highs);
+        high=std::max(lanes[0],lanes[1]);
+    }
+#endif
+    for(;i<size;i++){
+        low=std::min(low,data[i]);
+        high=std::max(high,data[i]);
+    }
+}
+
+/*!\brief Check if members are held as packed numbers
+ * \return true if bulk operations work directly on a contiguous buffer
+ *
+ * Decoded arrays holding only numbers, all integers or all decimals, are
+ * packed. Packing is dropped when the array is modified.
+ */
+NDICT_INLINE bool ndict::packed() const{
+    return type==TARRAY && block && !block->numbers.empty();
+}
+
+/*!\brief Get the numeric members
+ * \return Values of numeric members, other members are skipped
+ */
+NDICT_INLINE std::vector<double> ndict::getnumbers() const{
+    if(packed()) return block->numbers;
+    std::vector<double> numbers;
+    for(const ndict &item : rd().items){
+        if(item.type==TNUMBER) numbers.push_back(atof(item.value.c_str()));
+    }
+    return numbers;
+}
+
+/*!\brief Copy the numeric members to a buffer
+ * \param out Buffer to copy to
+ * \param size Size of the buffer
+ * \return Number of values copied, other members are skipped
+ */
+NDICT_INLINE unsigned ndict::getnumbers(double *out,const unsigned &size) const{
+    if(packed()){
+        unsigned count=std::min<size_t>(size,block->numbers.size());
+        memcpy(out,block->numbers.data(),count*sizeof(double));
+        return count;
+    }
+    unsigned count=0;
+    for(const ndict &item : rd().items){
+        if(count==size) break;
+        if(item.type==TNUMBER) out[count++]=atof(item.value.c_str());
+    }
+    return count;
+}
+
+/*!\brief Add up the numeric members
+ * \return Sum of numeric members, 0 if there are none
+ *
+ * Packed numbers are added in several interleaved partial sums, so the
+ * result may differ from a sequential sum in the last bits.
+ */
+NDICT_INLINE double ndict::sum() const{
+    if(packed()) return addnumbers(block->numbers.data(),block->numbers.size());
+    std::vector<double> numbers=getnumbers();
+    return addnumbers(numbers.data(),numbers.size());
+}
+
+/*!\brief Find the smallest numeric member
+ * \return Smallest value, or NaN if there are no numeric members
+ */
+NDICT_INLINE double ndict::min() const{
+    double low,high;
+    std::vector<double> numbers;
+    const std::vector<double> &values=packed()?block->numbers:(numbers=getnumbers());
+    if(values.empty()) return std::numeric_limits<double>::quiet_NaN();
+    rangenumbers(values.data(),values.size(),low,high);
+    return low;
+}
+
+/*!\brief Find the largest numeric member
+ * \return Largest value, or NaN if there are no numeric members
+ */
+NDICT_INLINE double ndict::max() const{
+    double low,high;
+    std::vector<double> numbers;
+    const std::vector<double> &values=packed()?block->numbers:(numbers=getnumbers());
+    if(values.empty()) return std::numeric_limits<double>::quiet_NaN();
+    rangenumbers(values.data(),values.size(),low,high);
+    return high;
+}
+
+/*!\brief Average the numeric members
+ * \return Mean value, or NaN if there are no numeric members
+ */
+NDICT_INLINE double ndict::mean() const{
+    std::vector<double> numbers;
+    const std::vector<double> &values=packed()?block->numbers:(numbers=getnumbers());
+    if(values.empty()) return std::numeric_limits<double>::quiet_NaN();
+    return addnumbers(values.data(),values.size())/values.size();
 }
 
 /*!\brief Clear all child items
  */
-void ndict::clear(){
-    keys.clear();
-    items.clear();
+NDICT_INLINE void ndict::clear(){
+    block.reset();
+    touch();
     value="";
     type=TNULL;
 }
@@ -123,9 +706,10 @@ void ndict::clear(){
 /*!\brief Check if key is present in this object
  * \return true if key was found with a valid value
  */
-bool ndict::haskey(const std::string &key) const{
-    for(unsigned i=0;i<keys.size();i++){
-        if(keys[i]==key and items[i].type!=TNULL) return true;
+NDICT_INLINE bool ndict::haskey(const std::string &key) const{
+    const children &c=rd();
+    for(unsigned i=0;i<c.keys.size();i++){
+        if(c.keys[i]==key and c.items[i].type!=TNULL) return true;
     }
     return false;
 }
@@ -133,136 +717,965 @@ bool ndict::haskey(const std::string &key) const{
 /*!\brief Get a copy of dictionary keys for external iteration
  * \return Copy of dictionary keys for external iteration
  */
-std::vector<std::string> ndict::getkeys() const{
-    return keys;
+NDICT_INLINE std::vector<std::string> ndict::getkeys() const{
+    return rd().keys;
 }
 
-/*!\brief Get dictionary value as a string
- * \return String representation of value
+/*!\brief Get the members of this object or array for reading
+ * \return Reference to the members in order, empty for scalar values
+ *
+ * The reference is valid until this object is modified.
  */
-std::string ndict::getstring() const{
-#if NDICT_CHECK_EXISTING
-    if(type==TNULL) throw ndict_exception("Value is not set!");
-#endif
-#if NDICT_CHECK_TYPE
-    if(type!=TSTRING) throw ndict_exception("Value is not string!");
-#endif
-    return value;
+NDICT_INLINE const std::vector<ndict> &ndict::getmembers() const{
+    return rd().items;
 }
 
-/*!\brief Get dictionary value as a char array
- * \return String representation of value
+/*!\brief Get the key of a member by position
+ * \param index Position of the member, below size()
+ * \return Reference to the key, valid until this object is modified
  */
-const char *ndict::getchar() const{
-#if NDICT_CHECK_EXISTING
-    if(type==TNULL) throw ndict_exception("Value is not set!");
-#endif
-#if NDICT_CHECK_TYPE
-    if(type!=TSTRING) throw ndict_exception("Value is not string!");
-#endif
-    return value.c_str();
+NDICT_INLINE const std::string &ndict::getkey(const unsigned &index) const{
+    return rd().keys[index];
 }
 
-/*!\brief Get dictionary value as an integer
- * \return Integer representation of value (0 on failure)
+/*!\brief Recursively merge keyed values from another dictionary
+ * \param source Dictionary object to copy values from
+ *
+ * Values unique to the source will be copied verbatim, existing values will
+ * be overwritten or retained depending on their existence in the source.
  */
-int ndict::getint() const{
-#if NDICT_CHECK_EXISTING
-    if(type==TNULL) throw ndict_exception("Value is not set!");
-#endif
-#if NDICT_CHECK_TYPE
-    if(type!=TNUMBER) throw ndict_exception("Value is not numeric!");
-#endif
-    return atoi(value.c_str());
+NDICT_INLINE void ndict::merge(const ndict &source){
+    NSTATS_TIME(HMERGE);
+    NTRACE_SCOPE("ndict::merge");
+    const children &src=source.rd();
+    for(unsigned i=0;i<src.keys.size();i++){
+        if(src.items[i].type==ndict::TOBJECT){
+            member(src.keys[i]).merge(src.items[i]);
+        }
+        else{
+            member(src.keys[i])=src.items[i];
+        }
+    }
+}
+
+/*!\brief Recursively encode dictionary object as a JSON string
+ * \param indent Number of spaces to use for indentation
+ * \param level Number of indents (Increments automatically on recursive calls)
+ * \return A JSON string representing this object and it's children
+ *
+ * Strings, numbers and booleans encode as plain JSON values, e.g. "hi" or 42,
+ * rather than as an empty object.
+ */
+NDICT_INLINE std::string ndict::getjson(const int &indent,const int &level) const{
+    std::string retval;
+    if(jsoncaching && block){
+        encodecached(retval,indent,level);
+        return retval;
+    }
+    if(type==TSTRING || type==TNUMBER || type==TBOOL){
+        // Scalars encode as plain JSON values
+        encodemember(retval,*this,indent,level,false);
+    }
+    else{
+        encode(retval,indent,level,false);
+    }
+    return retval;
 }
 
-/*!\brief Get dictionary value as a float
- * \return Float representation of value (0 on failure)
+/*!\brief Encode dictionary object as JSON in chunks
+ * \param out String to append to, holding the text not yet flushed
+ * \param flush Function called to write out and empty the string when it grows large
+ * \param context Argument passed to the flush function
+ * \param indent Number of spaces to use for indentation
+ *
+ * Large objects are encoded without holding their whole text in memory.
+ * The caller flushes the remainder left in the string.
  */
-double ndict::getdouble() const{
-#if NDICT_CHECK_EXISTING
-    if(type==TNULL) throw ndict_exception("Value is not set!");
-#endif
-#if NDICT_CHECK_TYPE
-    if(type!=TNUMBER) throw ndict_exception("Value is not numeric!");
-#endif
-    return atof(value.c_str());
+NDICT_INLINE void ndict::getjson(std::string &out,void (*flush)(std::string &out,void *context),void *context,const int &indent) const{
+    if(type==TOBJECT || type==TARRAY || type==TNULL){
+        encode(out,indent,0,false,flush,context);
+    }
+    else{
+        out+=getjson(indent);
+    }
 }
 
-/*!\brief Get dictionary value as a boolean
- * \return Boolean representation of value (false on failure)
+/*!\brief Enable or disable memoized JSON encoding for this tree
+ * \param enable true to cache encoded subtrees, false to drop the caches
+ *
+ * When enabled, getjson() keeps the encoded text of every nested object and
+ * array, and reuses it verbatim until the subtree is mutated. Repeated
+ * encoding of a large tree then only re-encodes the paths that changed, at
+ * the cost of keeping the fragments in memory. Fragments are shared with
+ * copies of the tree, which may be encoded from several threads.
+ */
+NDICT_INLINE void ndict::cachejson(const bool &enable){
+    jsoncaching=enable;
+    if(!enable) releasecache();
+}
+
+/*!\brief Recursively drop cached JSON fragments
+ *
+ * Fragments of members shared with copies of this object are retained.
+ */
+NDICT_INLINE void ndict::releasecache(){
+    if(!block || block.use_count()>1) return;
+    block->jsonindent=-1;
+    block->jsonlevel=-1;
+    std::string().swap(block->jsoncache);
+    for(unsigned i=0;i<block->items.size();i++){
+        block->items[i].releasecache();
+    }
+}
+
+/*!\brief Append the cached JSON encoding of this node, encoding it if stale
+ * \param out String to append to
+ * \param indent Number of spaces to use for indentation
+ * \param level Number of indents
+ *
+ * The fragment is filled and copied under a lock, as copies sharing it may be
+ * encoded concurrently. Nested fragments are locked after their parents.
  */
-bool ndict::getbool() const{
-#if NDICT_CHECK_EXISTING
-    if(type==TNULL) throw ndict_exception("Value is not set!");
+NDICT_INLINE void ndict::encodecached(std::string &out,const int &indent,const int &level) const{
+    children &c=*block;
+    std::lock_guard<std::mutex> guard(c.jsonlock);
+    if(c.jsonindent!=indent || c.jsonlevel!=level){
+        c.jsoncache.clear();
+        encode(c.jsoncache,indent,level,true);
+        c.jsonindent=indent;
+        c.jsonlevel=level;
+    }
+    out+=c.jsoncache;
+}
+
+/*!\brief Append a string as a quoted JSON string
+ * \param out String to append to
+ * \param data Characters of the string
+ * \param size Number of characters
+ *
+ * Quotes, backslashes and control characters are escaped, anything else
+ * including UTF-8 sequences is copied as is. Runs without characters to
+ * escape are found 16 bytes at a time with SSE2 and copied in bulk.
+ */
+NDICT_INLINE void ndict::quote(std::string &out,const char *data,const size_t &size){
+    static const char hex[]="0123456789abcdef";
+    out+='"';
+    size_t run=0,i=0;
+#if defined(__SSE2__)
+    const __m128i quotes=_mm_set1_epi8('"');
+    const __m128i backslashes=_mm_set1_epi8('\\');
+    const __m128i controls=_mm_set1_epi8(0x1f);
 #endif
-#if NDICT_CHECK_TYPE
-    if(type!=TBOOL) throw ndict_exception("Value is not boolean!");
+    while(i<size){
+#if defined(__SSE2__)
+        // Skip blocks without quotes, backslashes or bytes up to 0x1f
+        while(i+16<=size){
+            __m128i block=_mm_loadu_si128((const __m128i*)(data+i));
+            __m128i special=_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block,quotes),_mm_cmpeq_epi8(block,backslashes)),
+                                         _mm_cmpeq_epi8(_mm_max_epu8(block,controls),controls));
+            int mask=_mm_movemask_epi8(special);
+            if(mask){
+                i+=__builtin_ctz(mask);
+                break;
+            }
+            i+=16;
+        }
+        if(i==size) break;
 #endif
-    std::string v=value;
-    std::transform(v.begin(),v.end(),v.begin(),::toupper);
-    return v=="TRUE"?true:atoi(value.c_str());
+        unsigned char c=data[i];
+        if(c!='"' && c!='\\' && c>=0x20){
+            i++;
+            continue;
+        }
+        out.append(data+run,i-run);
+        out+='\\';
+        switch(c){
+            case '"':   out+='"';   break;
+            case '\\':  out+='\\';  break;
+            case '\b':  out+='b';   break;
+            case '\f':  out+='f';   break;
+            case '\n':  out+='n';   break;
+            case '\r':  out+='r';   break;
+            case '\t':  out+='t';   break;
+            default:
+                out+="u00";
+                out+=hex[c>>4];
+                out+=hex[c&15];
+                break;
+        }
+        run=++i;
+    }
+    out.append(data+run,size-run);
+    out+='"';
 }
 
-/*!\brief Recursively merge keyed values from another dictionary
- * \param source Dictionary object to copy values from
+/*!\brief Append the JSON encoding of an object or array member
+ * \param out String to append to
+ * \param item Member to encode
+ * \param indent Number of spaces to use for indentation
+ * \param level Number of indents of the member
+ * \param cached Reuse cached fragments of nested objects and arrays
+ */
+NDICT_INLINE void ndict::encodemember(std::string &out,const ndict &item,const int &indent,const int &level,const bool &cached){
+    switch(item.type){
+        case TOBJECT:
+        case TARRAY:
+            if(cached && item.block) item.encodecached(out,indent,level);
+            else        item.encode(out,indent,level,false);
+            break;
+        case TSTRING:   quote(out,item.value.data(),item.value.size());  break;
+        case TNULL:     out+="null";                break;
+        default:        out+=item.value;            break;
+    }
+}
+
+/*!\brief Append the JSON encoding of this node
+ * \param out String to append to
+ * \param indent Number of spaces to use for indentation
+ * \param level Number of indents
+ * \param cached Reuse cached fragments of nested objects and arrays
+ * \param flush Optional function consuming and clearing the output as it grows
+ * \param context Argument passed to the flush function
  *
- * Values unique to the source will be copied verbatim, existing values will
- * be overwritten or retained depending on their existence in the source.
+ * Nested objects and arrays are tracked on an explicit stack rather than by
+ * recursion, so deeply nested dictionaries don't exhaust the call stack.
+ * Cached fragments are encoded per node, one level of recursion each.
  */
-void ndict::merge(ndict &source){
-    for(unsigned i=0;i<source.keys.size();i++){
-        if(source[source.keys[i]].type==ndict::TOBJECT){
-            (*this)[source.keys[i]].merge(source[source.keys[i]]);
+NDICT_INLINE void ndict::encode(std::string &out,const int &indent,const int &level,const bool &cached,void (*flush)(std::string &out,void *context),void *context) const{
+    //! Object or array being encoded
+    struct frame{
+        const ndict *node;
+        unsigned index;
+        int level;
+    };
+    if(packedonly()){
+        encodepacked(out);
+        return;
+    }
+    std::vector<frame> stack;
+    stack.push_back({this,0,level});
+    out+=type==TARRAY?"[":"{\n";
+    while(!stack.empty()){
+        if(flush && out.size()>=65536) flush(out,context);
+        frame &top=stack.back();
+        const children &c=top.node->rd();
+        bool array=top.node->type==TARRAY;
+        if(top.index==c.items.size()){
+            // Close the block
+            if(array){
+                out+="]";
+            }
+            else{
+                if(c.items.size()) out+="\n";
+                out.append(indent*top.level,' ');
+                out+="}";
+            }
+            stack.pop_back();
+            continue;
+        }
+
+        // Format as a json array member or keyed json value
+        unsigned i=top.index++;
+        int member=top.level+1;
+        if(array){
+            if(i) out+=",";
         }
         else{
-            (*this)[source.keys[i]]=source[source.keys[i]];
+            if(i) out+=",\n";
+            out.append(indent*member,' ');
+            quote(out,c.keys[i].data(),c.keys[i].size());
+            out+=" : ";
+        }
+        const ndict &item=c.items[i];
+        NSTATS_COUNT(CENCODEDNODES,1);
+        if(item.packedonly() && !cached){
+            item.encodepacked(out);
+        }
+        else if((item.type==TOBJECT || item.type==TARRAY) && !(cached && item.block)){
+            out+=item.type==TARRAY?"[":"{\n";
+            stack.push_back({&item,0,member});
+        }
+        else{
+            encodemember(out,item,indent,member,cached);
         }
     }
 }
 
-/*!\brief Recursively encode dictionary object as a JSON string
- * \param indent Number of spaces to use for indentation
- * \param level Number of indents (Increments automatically on recursive calls)
- * \return A JSON string representing this object and it's children
+/*!\brief Find the position of a key in this object or array
+ * \param key Key to search for
+ * \return Index of the key, or -1 if it was not found
+ */
+NDICT_INLINE int ndict::find(const std::string &key) const{
+    const children &c=rd();
+    NSTATS_COUNT(CLOOKUPS,1);
+    for(unsigned i=0;i<c.keys.size();i++){
+        if(c.keys[i]==key){
+            NSTATS_COUNT(CPROBES,i+1);
+            return i;
+        }
+    }
+    NSTATS_COUNT(CPROBES,c.keys.size());
+    return -1;
+}
+
+/*!\brief Find the position of a key among the first members
+ * \param key Characters of the key
+ * \param size Length of the key
+ * \param count Number of members to search
+ * \return Index of the key, or -1 if it was not found
+ *
+ * Used while members are built with setmember(), where members past count
+ * are left over from earlier contents.
+ */
+NDICT_INLINE int ndict::find(const char *key,const size_t &size,const unsigned &count) const{
+    const children &c=rd();
+    for(unsigned i=0;i<count && i<c.keys.size();i++){
+        if(c.keys[i].size()==size && !memcmp(c.keys[i].data(),key,size)) return i;
+    }
+    return -1;
+}
+
+/*!\brief Remove a keyed member from this object
+ * \param key Key of the member to remove
+ * \return true if the member was found and removed
+ *
+ * Numeric keys on arrays remove the indexed member.
+ */
+NDICT_INLINE bool ndict::erase(const std::string &key){
+    int index=find(key);
+    if(index<0) return false;
+    if(type==TARRAY) return erase((unsigned)index);
+    children &c=wr();
+    touch();
+    c.keys.erase(c.keys.begin()+index);
+    c.items.erase(c.items.begin()+index);
+    return true;
+}
+
+/*!\brief Remove an indexed member from this array
+ * \param index Index of the member to remove
+ * \return true if the member was found and removed
+ *
+ * Members following the removed one are shifted down one index.
+ */
+NDICT_INLINE bool ndict::erase(const unsigned &index){
+    if(type!=TARRAY || index>=size()) return false;
+    children &c=wr();
+    touch();
+    markindex(-1);
+    c.items.erase(c.items.begin()+index);
+    c.keys.pop_back();
+    return true;
+}
+
+/*!\brief Split a JSON pointer (RFC 6901) into unescaped reference tokens
+ * \param pointer JSON pointer such as "/outer/inner/0"
+ * \return Reference tokens, empty for the whole document
+ */
+NDICT_INLINE std::vector<std::string> ndict::splitpointer(const std::string &pointer){
+    std::vector<std::string> tokens;
+    if(pointer.empty()) return tokens;
+    if(pointer[0]!='/') throw ndict_exception("Invalid JSON pointer: "+pointer);
+    std::string token;
+    for(unsigned i=1;i<=pointer.size();i++){
+        if(i==pointer.size() || pointer[i]=='/'){
+            tokens.push_back(token);
+            token.clear();
+        }
+        else if(pointer[i]=='~' && i+1<pointer.size() && (pointer[i+1]=='0' || pointer[i+1]=='1')){
+            token+=(pointer[++i]=='0')?'~':'/';
+        }
+        else{
+            token+=pointer[i];
+        }
+    }
+    return tokens;
+}
+
+/*!\brief Escape a key for use as a JSON pointer reference token
+ * \param key Key to escape
+ * \return Key with '~' and '/' escaped as "~0" and "~1"
+ */
+NDICT_INLINE std::string ndict::escapepointer(const std::string &key){
+    std::string token;
+    for(unsigned i=0;i<key.size();i++){
+        if(key[i]=='~')         token+="~0";
+        else if(key[i]=='/')    token+="~1";
+        else                    token+=key[i];
+    }
+    return token;
+}
+
+/*!\brief Append a JSON patch operation to a patch array
+ * \param patch Patch array to append to
+ * \param op Name of the operation
+ * \param path JSON pointer the operation applies to
+ * \param value Value of the operation, or nullptr for none
+ */
+NDICT_INLINE void ndict::patchop(ndict &patch,const char *op,const std::string &path,const ndict *value){
+    ndict &entry=patch[patch.size()];
+    entry["op"]=op;
+    entry["path"]=path;
+    if(value) entry["value"]=*value;
+}
+
+/*!\brief Recursively collect the operations transforming one node into another
+ * \param source Node to transform from
+ * \param target Node to transform to
+ * \param path JSON pointer of the nodes
+ * \param patch Patch array to append operations to
+ */
+NDICT_INLINE void ndict::diffnode(const ndict &source,const ndict &target,const std::string &path,ndict &patch){
+    // Skip shared subtrees, and identical subtrees once a matching hash is confirmed
+    if(source.type==target.type && source.block && source.block==target.block) return;
+    if(source.type==target.type && source.hash()==target.hash() && source==target) return;
+
+    // Replace values that changed type or scalar value
+    if(source.type!=target.type){
+        patchop(patch,"replace",path,&target);
+        return;
+    }
+    if(source.type!=TOBJECT && source.type!=TARRAY){
+        if(source.value!=target.value) patchop(patch,"replace",path,&target);
+        return;
+    }
+
+    // Arrays are compared by index, growing or shrinking at the tail
+    const children &src=source.rd();
+    const children &dst=target.rd();
+    if(source.type==TARRAY){
+        unsigned common=std::min(src.items.size(),dst.items.size());
+        for(unsigned i=0;i<common;i++){
+            diffnode(src.items[i],dst.items[i],path+"/"+std::to_string(i),patch);
+        }
+        for(unsigned i=common;i<dst.items.size();i++){
+            patchop(patch,"add",path+"/"+std::to_string(i),&dst.items[i]);
+        }
+        for(unsigned i=src.items.size();i>common;i--){
+            patchop(patch,"remove",path+"/"+std::to_string(i-1),nullptr);
+        }
+        return;
+    }
+
+    // Objects are compared by key, checking the same position first
+    for(unsigned i=0;i<src.keys.size();i++){
+        bool hit=(i<dst.keys.size() && dst.keys[i]==src.keys[i]);
+        if(!hit && target.find(src.keys[i])<0){
+            patchop(patch,"remove",path+"/"+escapepointer(src.keys[i]),nullptr);
+        }
+    }
+    for(unsigned i=0;i<dst.keys.size();i++){
+        bool hit=(i<src.keys.size() && src.keys[i]==dst.keys[i]);
+        int index=hit?i:source.find(dst.keys[i]);
+        std::string subpath=path+"/"+escapepointer(dst.keys[i]);
+        if(index<0){
+            patchop(patch,"add",subpath,&dst.items[i]);
+        }
+        else{
+            diffnode(src.items[index],dst.items[i],subpath,patch);
+        }
+    }
+}
+
+/*!\brief Compute the structural difference to another dictionary
+ * \param target Dictionary object to compare against
+ * \return JSON patch (RFC 6902) array transforming this object into target
+ *
+ * Unchanged subtrees produce no operations. Their cached hashes rule out most
+ * differences in O(1), and matching hashes are confirmed by a deep comparison
+ * before a subtree is skipped, so the patch only references the changed
+ * branches. An identical target yields an empty (null) patch.
+ */
+NDICT_INLINE ndict ndict::diff(const ndict &target) const{
+    NTRACE_SCOPE("ndict::diff");
+    ndict patch;
+    diffnode(*this,target,"",patch);
+    return patch;
+}
+
+/*!\brief Resolve a split JSON pointer to a node for modification
+ * \param path Reference tokens to resolve
+ * \param depth Number of tokens to resolve
+ * \return Pointer to the node, or nullptr if it does not exist
+ *
+ * Ancestors of the node are detached from copies and invalidated, the node
+ * itself is left for the caller to modify.
+ */
+NDICT_INLINE ndict *ndict::resolve(const std::vector<std::string> &path,const unsigned &depth){
+    ndict *node=this;
+    for(unsigned i=0;i<depth;i++){
+        int index=(node->type==TOBJECT || node->type==TARRAY)?node->find(path[i]):-1;
+        if(index<0) return nullptr;
+        children &c=node->wr();
+        node->touch();
+        node->markindex(index);
+        node=&c.items[index];
+    }
+    return node;
+}
+
+/*!\brief Resolve a split JSON pointer to a node for reading
+ * \param path Reference tokens to resolve
+ * \return Pointer to the node, or nullptr if it does not exist
+ */
+NDICT_INLINE const ndict *ndict::lookup(const std::vector<std::string> &path) const{
+    const ndict *node=this;
+    for(unsigned i=0;i<path.size();i++){
+        int index=(node->type==TOBJECT || node->type==TARRAY)?node->find(path[i]):-1;
+        if(index<0) return nullptr;
+        node=&node->rd().items[index];
+    }
+    return node;
+}
+
+/*!\brief Apply a JSON patch add operation
+ * \param path Reference tokens of the node to add
+ * \param value Value to add
+ */
+NDICT_INLINE void ndict::patchadd(const std::vector<std::string> &path,const ndict &value){
+    if(path.empty()){
+        *this=value;
+        return;
+    }
+    ndict *parent=resolve(path,path.size()-1);
+    if(!parent) throw ndict_exception("Patch path not found");
+    const std::string &key=path.back();
+    if(parent->type==TARRAY){
+        // Insert into array, "-" appends to the end
+        unsigned index=parent->size();
+        if(key!="-"){
+            int hit=parent->find(key);
+            if(hit<0 && key!=std::to_string(index)) throw ndict_exception("Array index is out of bound");
+            if(hit>=0) index=hit;
+        }
+        if(index>NDICT_MAX_ARRAY_SIZE) throw ndict_exception("Array index is out of bound");
+        children &c=parent->wr();
+        parent->touch();
+        parent->markindex(-1);
+        const ndict *data=c.items.data();
+        c.items.insert(c.items.begin()+index,value);
+        c.keys.push_back(std::to_string(c.keys.size()));
+        adopt(c,c.items.data()==data?index:0);
+    }
+    else if(parent->type==TOBJECT || parent->type==TNULL){
+        parent->member(key)=value;
+    }
+    else{
+        throw ndict_exception("Patch parent is not an object or array");
+    }
+}
+
+/*!\brief Apply a JSON patch remove operation
+ * \param path Reference tokens of the node to remove
  */
-std::string ndict::getjson(const int &indent,const int &level) const{
-    // Special case: Format as a json array member
+NDICT_INLINE void ndict::patchremove(const std::vector<std::string> &path){
+    if(path.empty()){
+        clear();
+        return;
+    }
+    ndict *parent=resolve(path,path.size()-1);
+    if(!parent || !parent->erase(path.back())) throw ndict_exception("Patch path not found");
+}
+
+/*!\brief Apply a JSON patch (RFC 6902) to this dictionary in place
+ * \param patch Array of patch operations, typically produced by diff()
+ *
+ * Supports the add, remove, replace, move, copy and test operations. Nodes
+ * not referenced by the patch are left untouched. Throws ndict_exception on
+ * invalid operations, in which case preceding operations remain applied.
+ */
+NDICT_INLINE void ndict::apply(const ndict &patch){
+    NTRACE_SCOPE("ndict::apply");
+    if(patch.type==TNULL) return;
+    if(patch.type!=TARRAY) throw ndict_exception("Patch must be an array of operations");
+    const children &ops=patch.rd();
+    for(unsigned i=0;i<ops.items.size();i++){
+        // Extract operation members
+        const ndict &entry=ops.items[i];
+        const children &members=entry.rd();
+        int op=entry.find("op");
+        int path=entry.find("path");
+        int value=entry.find("value");
+        if(entry.type!=TOBJECT || op<0 || path<0){
+            throw ndict_exception("Patch operation is missing op or path");
+        }
+        const std::string &name=members.items[op].value;
+        const ndict &operand=value<0?null():members.items[value];
+        std::vector<std::string> tokens=splitpointer(members.items[path].value);
+
+        // Perform operation
+        if(name=="add"){
+            patchadd(tokens,operand);
+        }
+        else if(name=="remove"){
+            patchremove(tokens);
+        }
+        else if(name=="replace"){
+            ndict *node=resolve(tokens,tokens.size());
+            if(!node) throw ndict_exception("Patch path not found");
+            *node=operand;
+        }
+        else if(name=="move" || name=="copy"){
+            int from=entry.find("from");
+            if(from<0) throw ndict_exception("Patch operation is missing from");
+            std::vector<std::string> source=splitpointer(members.items[from].value);
+            const ndict *node=lookup(source);
+            if(!node) throw ndict_exception("Patch path not found");
+            ndict copy=*node;
+            if(name=="move") patchremove(source);
+            patchadd(tokens,copy);
+        }
+        else if(name=="test"){
+            const ndict *node=lookup(tokens);
+            if(!node || *node!=operand) throw ndict_exception("Patch test failed");
+        }
+        else{
+            throw ndict_exception("Invalid patch operation: "+name);
+        }
+    }
+}
+
+/*!\brief Mix a 64-bit value (splitmix64 finalizer)
+ * \param h Value to mix
+ * \return Mixed value
+ */
+NDICT_INLINE uint64_t ndict::hashmix(uint64_t h){
+    h^=h>>30; h*=0xbf58476d1ce4e5b9ULL;
+    h^=h>>27; h*=0x94d049bb133111ebULL;
+    return h^(h>>31);
+}
+
+/*!\brief Hash a string (FNV-1a)
+ * \param str String to hash
+ * \param h Initial hash value
+ * \return Hash value
+ */
+NDICT_INLINE uint64_t ndict::hashstring(const std::string &str,uint64_t h){
+    for(unsigned i=0;i<str.size();i++){
+        h^=(unsigned char)str[i];
+        h*=0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*!\brief Get a 64-bit structural hash of this node and its children
+ * \return Hash value
+ *
+ * The hash is computed lazily and cached on every object and array until it
+ * is mutated, so checking an unchanged subtree is O(1). Object members are
+ * hashed independently of their order, arrays by position. Copies share the
+ * cache, which concurrent readers may fill.
+ */
+NDICT_INLINE uint64_t ndict::hash() const{
+    if(block && block->hashvalid.load(std::memory_order_acquire)) return block->hashcache.load(std::memory_order_relaxed);
+    const children &c=rd();
+    uint64_t h=hashmix(0xcbf29ce484222325ULL+type);
     if(type==TARRAY){
-        std::string retval;
-        for(unsigned i=0;i<keys.size();i++){
-            for(unsigned j=0;j<keys.size();j++){
-                if(keys[j]==std::to_string(i)){
-                    if(retval.size()) retval+=",";
-                    switch(items[i].type){
-                        case TOBJECT:   retval+=items[i].getjson(indent,level+1);   break;
-                        case TARRAY:    retval+=items[i].getjson(indent,level+1);   break;
-                        case TSTRING:   retval+=QUOTE(items[i].value);              break;
-                        case TNULL:     retval+="null";                             break;
-                        default:        retval+=items[i].value;                     break;
-                    }
-
-                }
+        for(unsigned i=0;i<c.items.size();i++){
+            h=hashmix(h^c.items[i].hash());
+        }
+    }
+    else if(type==TOBJECT){
+        uint64_t sum=0;
+        for(unsigned i=0;i<c.keys.size();i++){
+            sum+=hashmix(hashstring(c.keys[i],0xcbf29ce484222325ULL)^c.items[i].hash());
+        }
+        h=hashmix(h^sum^c.keys.size());
+    }
+    else{
+        h=hashmix(hashstring(value,h));
+    }
+    if(block){
+        block->hashcache.store(h,std::memory_order_relaxed);
+        block->hashvalid.store(true,std::memory_order_release);
+    }
+    return h;
+}
+
+/*!\brief Deep comparison with another dictionary
+ * \param other Dictionary object to compare with
+ * \return true if both nodes hold the same structure and values
+ *
+ * Members shared between copies compare equal and differing cached hashes
+ * reject in O(1). Object members are compared by key regardless of order,
+ * array members by position.
+ */
+NDICT_INLINE bool ndict::operator==(const ndict &other) const{
+    if(this==&other) return true;
+    if(type!=other.type) return false;
+    if(type!=TARRAY && type!=TOBJECT) return value==other.value;
+    if(size()!=other.size() || hash()!=other.hash()) return false;
+    const children &c=rd();
+    const children &o=other.rd();
+    if(type==TARRAY){
+        if(block==other.block) return true;
+        for(unsigned i=0;i<c.items.size();i++){
+            if(c.items[i]!=o.items[i]) return false;
+        }
+        return true;
+    }
+    else{
+        if(block==other.block) return true;
+        for(unsigned i=0;i<c.keys.size();i++){
+            int index=(o.keys[i]==c.keys[i])?i:other.find(c.keys[i]);
+            if(index<0 || c.items[i]!=o.items[index]) return false;
+        }
+    }
+    return true;
+}
+
+/*!\brief Deep comparison with another dictionary
+ * \param other Dictionary object to compare with
+ * \return true if the nodes differ in structure or values
+ */
+NDICT_INLINE bool ndict::operator!=(const ndict &other) const{
+    return !(*this==other);
+}
+
+/*!\brief Order secondary index keys by type, then by value
+ * \param other Key to compare against
+ * \return true if this key sorts before the other
+ */
+NDICT_INLINE bool ndict::indexkey::operator<(const indexkey &other) const{
+    if(type!=other.type) return type<other.type;
+    if(type==TNUMBER) return number<other.number;
+    return text<other.text;
+}
+
+/*!\brief Compare secondary index keys
+ * \param other Key to compare against
+ * \return true if the keys are equal
+ */
+NDICT_INLINE bool ndict::indexkey::operator==(const indexkey &other) const{
+    if(type!=other.type) return false;
+    if(type==TNUMBER) return number==other.number;
+    return text==other.text;
+}
+
+/*!\brief Hash a secondary index key
+ * \param key Key to hash
+ * \return Hash value
+ */
+NDICT_INLINE size_t ndict::indexhash::operator()(const indexkey &key) const{
+    if(key.type==TNUMBER) return std::hash<double>()(key.number);
+    return std::hash<std::string>()(key.text)^key.type;
+}
+
+/*!\brief Build the index key of an array member
+ * \param item Array member, or the value to look up
+ * \param field Field to index, empty to use the value itself
+ * \return Key, with a negative type if the field is not a plain value
+ */
+NDICT_INLINE ndict::indexkey ndict::makekey(const ndict &item,const std::string &field){
+    indexkey key;
+    const ndict *value=&item;
+    if(!field.empty()){
+        int hit=item.type==TOBJECT?item.find(field):-1;
+        if(hit<0) return key;
+        value=&item.rd().items[hit];
+    }
+    if(value->type==TNUMBER) key.number=value->getdouble();
+    else if(value->type==TSTRING || value->type==TBOOL) key.text=value->value;
+    else return key;
+    key.type=value->type;
+    return key;
+}
+
+/*!\brief Add an array member to a secondary index
+ * \param index Index to update
+ * \param item Index of the array member, its key must be in the entries
+ */
+NDICT_INLINE void ndict::indexinsert(fieldindex &index,const unsigned &item){
+    const indexkey &key=index.entries[item];
+    if(key.type<0) return;
+    if(index.sorted) index.ordered.emplace(key,item);
+    else index.hashed.emplace(key,item);
+}
+
+/*!\brief Remove an array member from a secondary index
+ * \param index Index to update
+ * \param item Index of the array member, its key must be in the entries
+ */
+NDICT_INLINE void ndict::indexremove(fieldindex &index,const unsigned &item){
+    const indexkey &key=index.entries[item];
+    if(key.type<0) return;
+    if(index.sorted){
+        auto range=index.ordered.equal_range(key);
+        for(auto it=range.first;it!=range.second;it++){
+            if(it->second==item){
+                index.ordered.erase(it);
+                return;
+            }
+        }
+    }
+    else{
+        auto range=index.hashed.equal_range(key);
+        for(auto it=range.first;it!=range.second;it++){
+            if(it->second==item){
+                index.hashed.erase(it);
+                return;
             }
         }
-        return std::string("[")+retval+std::string("]");
     }
+}
 
-    // Normal case: Format as keyed json value
-    std::string retval="{\n";
-    for(unsigned i=0;i<keys.size();i++){
-        retval+=std::string(indent*(level+1),' ')+QUOTE(keys[i])+" : ";
-        switch(items[i].type){
-            case TOBJECT:   retval+=items[i].getjson(indent,level+1);   break;
-            case TARRAY:    retval+=items[i].getjson(indent,level+1);   break;
-            case TSTRING:   retval+=QUOTE(items[i].value);              break;
-            case TNULL:     retval+="null";                             break;
-            default:        retval+=items[i].value;                     break;
+/*!\brief Mark secondary indexes for update after an array member is accessed
+ * \param item Index of the member that may be modified, -1 if members moved
+ *
+ * Indexes are updated lazily on the next search, so repeated writes to the
+ * same array only cost the update of the members actually touched.
+ */
+NDICT_INLINE void ndict::markindex(const int &item){
+    if(!block || block->indexes.empty() || block->indexstale) return;
+    if(item>=0 && !block->dirty.empty() && block->dirty.back()==(unsigned)item) return;
+    if(item<0 || block->dirty.size()>=block->items.size()){
+        block->dirty.clear();
+        block->indexstale=true;
+        return;
+    }
+    block->dirty.push_back(item);
+}
+
+/*!\brief Get an up to date secondary index
+ * \param field Indexed field
+ * \return Pointer to the index, or nullptr if the field is not indexed
+ *
+ * Applies pending updates to all indexes of this array. The indexes are
+ * shared with copies, which may be searched from several threads, so updates
+ * are applied under a lock. Once applied, the indexes only change when this
+ * array is modified, which detaches it from its copies first.
+ */
+NDICT_INLINE const ndict::fieldindex *ndict::getindex(const std::string &field) const{
+    if(!block) return nullptr;
+    rd();
+    children &c=*block;
+    std::lock_guard<std::mutex> guard(c.indexlock);
+    fieldindex *result=nullptr;
+    for(fieldindex &index : c.indexes){
+        if(index.field==field) result=&index;
+    }
+    if(!result) return nullptr;
+    for(fieldindex &index : c.indexes){
+        if(c.indexstale || index.entries.size()>c.items.size()){
+            index.ordered.clear();
+            index.hashed.clear();
+            index.entries.clear();
+        }
+        for(unsigned item : c.dirty){
+            if(item>=index.entries.size()) continue;
+            indexremove(index,item);
+            index.entries[item]=makekey(c.items[item],index.field);
+            indexinsert(index,item);
+        }
+        while(index.entries.size()<c.items.size()){
+            index.entries.push_back(makekey(c.items[index.entries.size()],index.field));
+            indexinsert(index,index.entries.size()-1);
         }
-        if(i+1<keys.size()) retval+=",";
-        retval+="\n";
     }
-    retval+=std::string(indent*level,' ')+"}";
-    return retval;
+    c.dirty.clear();
+    c.indexstale=false;
+    return result;
+}
+
+/*!\brief Maintain a secondary index on a field of the members of this array
+ * \param field Field of the member objects to index
+ * \param sorted Use a sorted index supporting range searches instead of a hash
+ *
+ * Members are indexed by the plain value of the field, members without it
+ * are left out. The index is kept up to date as members are modified through
+ * this array, and is shared with copies of it.
+ */
+NDICT_INLINE void ndict::addindex(const std::string &field,const bool &sorted){
+    if(type!=TARRAY && type!=TNULL) throw ndict_exception("Indexes require an array");
+    if(type==TNULL) block.reset();
+    type=TARRAY;
+    children &c=wr();
+    for(fieldindex &index : c.indexes){
+        if(index.field==field && index.sorted==sorted) return;
+    }
+    dropindex(field);
+    fieldindex index;
+    index.field=field;
+    index.sorted=sorted;
+    c.indexes.push_back(index);
+    c.indexstale=true;
+}
+
+/*!\brief Remove a secondary index
+ * \param field Indexed field
+ * \return true if the index was found and removed
+ */
+NDICT_INLINE bool ndict::dropindex(const std::string &field){
+    if(!block) return false;
+    for(unsigned i=0;i<block->indexes.size();i++){
+        if(block->indexes[i].field==field){
+            children &c=wr();
+            c.indexes.erase(c.indexes.begin()+i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!\brief Search array members with a field equal to a value
+ * \param field Field of the member objects to compare
+ * \param value Plain value to search for, numbers compare by value
+ * \return Ascending indices of the matching members
+ *
+ * Uses an index on the field if one exists, otherwise scans all members.
+ */
+NDICT_INLINE std::vector<unsigned> ndict::search(const std::string &field,const ndict &value) const{
+    std::vector<unsigned> result;
+    indexkey key=makekey(value,"");
+    if(type!=TARRAY || key.type<0) return result;
+    const fieldindex *index=getindex(field);
+    if(!index){
+        const children &c=rd();
+        for(unsigned i=0;i<c.items.size();i++){
+            if(makekey(c.items[i],field)==key) result.push_back(i);
+        }
+    }
+    else if(index->sorted){
+        auto range=index->ordered.equal_range(key);
+        for(auto it=range.first;it!=range.second;it++) result.push_back(it->second);
+    }
+    else{
+        auto range=index->hashed.equal_range(key);
+        for(auto it=range.first;it!=range.second;it++) result.push_back(it->second);
+    }
+    std::sort(result.begin(),result.end());
+    return result;
+}
+
+/*!\brief Search array members with a field within an inclusive range
+ * \param field Field of the member objects to compare
+ * \param low Lowest plain value to match
+ * \param high Highest plain value to match
+ * \return Ascending indices of the matching members
+ *
+ * Uses a sorted index on the field if one exists, otherwise scans all
+ * members. Values only match bounds of the same type.
+ */
+NDICT_INLINE std::vector<unsigned> ndict::search(const std::string &field,const ndict &low,const ndict &high) const{
+    std::vector<unsigned> result;
+    indexkey lowkey=makekey(low,"");
+    indexkey highkey=makekey(high,"");
+    if(type!=TARRAY || lowkey.type<0 || lowkey.type!=highkey.type || highkey<lowkey) return result;
+    const fieldindex *index=getindex(field);
+    if(index && index->sorted){
+        auto first=index->ordered.lower_bound(lowkey);
+        auto last=index->ordered.upper_bound(highkey);
+        for(auto it=first;it!=last;it++) result.push_back(it->second);
+    }
+    else{
+        const children &c=rd();
+        for(unsigned i=0;i<c.items.size();i++){
+            indexkey key=makekey(c.items[i],field);
+            if(key.type>=0 && !(key<lowkey) && !(highkey<key)) result.push_back(i);
+        }
+    }
+    std::sort(result.begin(),result.end());
+    return result;
 }
 
+#undef SET
@@ -4,8 +4,17 @@
 #ifndef _NDICT_H_
 #define _NDICT_H_
 
+#include <assert.h>
+#include <stdlib.h>
+#include <strings.h>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 //! Declares version number. This is not used internally.
@@ -15,10 +24,26 @@
 #define NDICT_MAX_ARRAY_SIZE    1024
 
 //! Throw an exception when accessing non-existing values
+#ifndef NDICT_CHECK_EXISTING
 #define NDICT_CHECK_EXISTING    true
+#endif
 
 //! Enable strict type-checking when accessing values
+#ifndef NDICT_CHECK_TYPE
 #define NDICT_CHECK_TYPE        true
+#endif
+
+//! Access policy used by getters when none is given
+#ifndef NDICT_POLICY
+#define NDICT_POLICY            ndict_default
+#endif
+
+//! Include the implementation of ndict and njson in their headers
+#ifdef NDICT_HEADER_ONLY
+#define NDICT_INLINE            inline
+#else
+#define NDICT_INLINE
+#endif
 
 /*!\class ndict_exception
  * \brief Exception class for dictionary handling
@@ -31,14 +56,122 @@ class ndict_exception: public std::exception {
         const char *what(){return msg.c_str();}
 };
 
+struct ndict_default;
+
 /*!\class ndict
  * \brief Implements a dictionary object
+ *
+ * Child members are shared between copies and cloned one level at a time
+ * when modified, so copying a dictionary is O(1). Members handed out by the
+ * non-const subscript operators can still be modified through the returned
+ * references, so copies clone those members instead of sharing them. Copies
+ * therefore behave like deep copies, and only share what nobody can modify.
  */
 class ndict {
+    friend class ndict_builder;
+    public:
+        //! Function decoding a span of text into the members of a lazily decoded node
+        typedef void (*lazydecoder_t)(ndict &node,const std::shared_ptr<const std::string> &source,const char *data,const size_t &size);
     private:
-        std::vector<std::string> keys;
-        std::vector<ndict> items;
+        //! Key of a secondary index entry, numbers compare by value
+        struct indexkey{
+            int type=-1;
+            double number=0;
+            std::string text;
+            bool operator<(const indexkey &other) const;
+            bool operator==(const indexkey &other) const;
+        };
+
+        //! Hash function for secondary index keys
+        struct indexhash{
+            size_t operator()(const indexkey &key) const;
+        };
+
+        //! Secondary index on a field of array members
+        struct fieldindex{
+            std::string field;
+            bool sorted=false;
+            std::multimap<indexkey,unsigned> ordered;
+            std::unordered_multimap<indexkey,unsigned,indexhash> hashed;
+            std::vector<indexkey> entries;
+        };
+
+        //! Child members, their cached hash and JSON encoding and secondary indexes
+        struct children{
+            std::vector<std::string> keys;
+            std::vector<ndict> items;
+            std::string jsoncache;
+            int jsonindent=-1;
+            int jsonlevel=-1;
+            std::mutex jsonlock;
+            std::vector<fieldindex> indexes;
+            std::vector<unsigned> dirty;
+            bool indexstale=false;
+            std::mutex indexlock;
+            std::shared_ptr<const std::string> lazysource;
+            const char *lazydata=nullptr;
+            size_t lazysize=0;
+            lazydecoder_t lazydecoder=nullptr;
+            std::atomic<void (*)(children &c)> lazyexpand{nullptr};
+            std::mutex lazylock;
+            std::vector<double> numbers;
+            std::vector<int64_t> integers;
+            bool leaked=false;
+            ndict *holder=nullptr;
+            std::atomic<uint64_t> hashcache{0};
+            std::atomic<bool> hashvalid{false};
+        };
+        std::shared_ptr<children> block;
         std::string value;
+
+        // Copy-on-write access to child members
+        const children &rd() const;
+        children &wr();
+        static std::shared_ptr<children> clone(const children &c);
+        static void adopt(children &c,const size_t &from);
+        ndict &member(const std::string &Key);
+        ndict &member(const unsigned &Index);
+        static const ndict &null();
+        void expand() const;
+        static void unpack(children &c);
+        static void lazydecode(children &c);
+        bool packedonly() const;
+        void encodepacked(std::string &out) const;
+
+        // Cached state, invalidated on mutation up to the members holding this one
+        children *owner=nullptr;
+        bool jsoncaching=false;
+        void touch();
+        void touchparents();
+
+        // Helpers for JSON encoding
+        void encode(std::string &out,const int &indent,const int &level,const bool &cached,void (*flush)(std::string &out,void *context)=nullptr,void *context=nullptr) const;
+        static void encodemember(std::string &out,const ndict &item,const int &indent,const int &level,const bool &cached);
+        void encodecached(std::string &out,const int &indent,const int &level) const;
+        void releasecache();
+
+        // Helpers for structural diff and patching
+        ndict *resolve(const std::vector<std::string> &path,const unsigned &depth);
+        static std::string escapepointer(const std::string &key);
+        static void patchop(ndict &patch,const char *op,const std::string &path,const ndict *value);
+        static void diffnode(const ndict &source,const ndict &target,const std::string &path,ndict &patch);
+        void patchadd(const std::vector<std::string> &path,const ndict &value);
+        void patchremove(const std::vector<std::string> &path);
+
+        // Helpers for secondary indexes
+        void markindex(const int &item);
+        const fieldindex *getindex(const std::string &field) const;
+        static indexkey makekey(const ndict &item,const std::string &field);
+        static void indexinsert(fieldindex &index,const unsigned &item);
+        static void indexremove(fieldindex &index,const unsigned &item);
+
+        // Helpers for bulk operations on numbers
+        static double addnumbers(const double *data,const size_t &size);
+        static void rangenumbers(const double *data,const size_t &size,double &low,double &high);
+
+        // Helpers for structural hashing
+        static uint64_t hashmix(uint64_t h);
+        static uint64_t hashstring(const std::string &str,uint64_t h);
     public:
         //! Enumerate JSON types
         enum type_t{
@@ -50,30 +183,93 @@ class ndict {
             TNULL       //!< Value is not valid
         } type=TNULL;
 
-        // Value accessors
-        std::string getstring() const;
-        const char *getchar() const;
-        double getdouble() const;
-        bool getbool() const;
-        int getint() const;
+        // Construction, copies share members that can't be modified through references
+        ndict() {}
+        ndict(const ndict &other);
+        ndict(ndict &&other) noexcept;
+        ndict& operator=(const ndict &other);
+        ndict& operator=(ndict &&other) noexcept;
+
+        // Value accessors, checked according to an access policy
+        template<typename P=NDICT_POLICY> std::string getstring() const;
+        template<typename P=NDICT_POLICY> const char *getchar() const;
+        template<typename P=NDICT_POLICY> double getdouble() const;
+        template<typename P=NDICT_POLICY> bool getbool() const;
+        template<typename P=NDICT_POLICY> int getint() const;
 
         // Array and object accessors
         unsigned size() const;
         void clear();
 
+        // Bulk operations on arrays of numbers
+        bool packed() const;
+        double sum() const;
+        double min() const;
+        double max() const;
+        double mean() const;
+        std::vector<double> getnumbers() const;
+        unsigned getnumbers(double *out,const unsigned &size) const;
+
         // Key accessors
         bool haskey(const std::string &key) const;
         std::vector<std::string> getkeys() const;
 
+        // Read-only member access and JSON pointer lookup
+        const std::vector<ndict> &getmembers() const;
+        const std::string &getkey(const unsigned &index) const;
+        int find(const std::string &key) const;
+        int find(const char *key,const size_t &size,const unsigned &count) const;
+        const ndict *lookup(const std::vector<std::string> &path) const;
+        static std::vector<std::string> splitpointer(const std::string &pointer);
+
+        // Remove keyed or indexed members
+        bool erase(const std::string &key);
+        bool erase(const unsigned &index);
+
         // Merge contents from a dict into this one
-        void merge(ndict &source);
+        void merge(const ndict &source);
+
+        // Structural hashing and deep comparison
+        uint64_t hash() const;
+        bool operator==(const ndict &other) const;
+        bool operator!=(const ndict &other) const;
+
+        // Structural diff and patching (RFC 6902 JSON Patch)
+        ndict diff(const ndict &target) const;
+        void apply(const ndict &patch);
+
+        // Secondary indexes on arrays of objects
+        void addindex(const std::string &field,const bool &sorted=false);
+        bool dropindex(const std::string &field);
+        std::vector<unsigned> search(const std::string &field,const ndict &value) const;
+        std::vector<unsigned> search(const std::string &field,const ndict &low,const ndict &high) const;
+
+        //! Search for array members with a field equal to a plain value
+        template<typename T> std::vector<unsigned> search(const std::string &field,const T &value) const{
+            ndict key;
+            key=value;
+            return search(field,key);
+        }
+
+        //! Search for array members with a field within an inclusive range of plain values
+        template<typename T> std::vector<unsigned> search(const std::string &field,const T &low,const T &high) const{
+            ndict lowkey,highkey;
+            lowkey=low;
+            highkey=high;
+            return search(field,lowkey,highkey);
+        }
 
         // Export to json string
         std::string getjson(const int &indent=4,const int &level=0) const;
+        void getjson(std::string &out,void (*flush)(std::string &out,void *context),void *context,const int &indent=4) const;
+        void cachejson(const bool &enable);
+        static void quote(std::string &out,const char *data,const size_t &size);
 
         // Operator for recursive blocks
         ndict& operator[](const std::string &Key);
         ndict& operator[](const unsigned &Key);
+        const ndict& operator[](const std::string &Key) const;
+        const ndict& operator[](const unsigned &Key) const;
 
         // Operators to set item value
         ndict& operator=(const std::string &Value);
@@ -86,10 +282,144 @@ class ndict {
         //! Operators to assign vector objects
         template<typename T,typename A> ndict& operator=(std::vector<T,A> const &Vector){
             for(unsigned i=0;i<Vector.size();i++){
-                (*this)[i]=Vector[i];
+                member(i)=Vector[i];
             }
             return *this;
         }
+    private:
+        // Building members in place, see ndict_builder
+        void setvalue(const type_t &Type,const char *data,const size_t &size);
+        void setblock(const type_t &Type);
+        ndict &setmember(const unsigned &index,const char *key,const size_t &size);
+        void truncate(const unsigned &count);
+        void setnumbers(std::vector<double> &numbers);
+        void setnumbers(std::vector<int64_t> &integers);
+        void setlazy(const type_t &Type,const std::shared_ptr<const std::string> &source,const char *data,const size_t &size,lazydecoder_t decoder);
+};
+
+/*!\struct ndict_checked
+ * \brief Access policy throwing ndict_exception on missing values and type mismatches
+ */
+struct ndict_checked{
+    template<typename T> static void check(const T &item,const ndict::type_t &expected,const char *message){
+        if(item.type==ndict::TNULL) throw ndict_exception("Value is not set!");
+        if(item.type!=expected) throw ndict_exception(message);
+    }
+};
+
+/*!\struct ndict_unchecked
+ * \brief Access policy without checks, for hot paths where types are known
+ *
+ * Missing values read as empty strings and zero, mismatching types are
+ * converted from their text the same way as with checks disabled.
+ */
+struct ndict_unchecked{
+    template<typename T> static void check(const T &,const ndict::type_t &,const char *){}
+};
+
+/*!\struct ndict_debug
+ * \brief Access policy asserting types in debug builds, and unchecked when NDEBUG is defined
+ */
+struct ndict_debug{
+    template<typename T> static void check(const T &item,const ndict::type_t &expected,const char *message){
+        assert(item.type!=ndict::TNULL && "Value is not set!");
+        assert(item.type==expected && message);
+        (void)item;
+        (void)expected;
+        (void)message;
+    }
+};
+
+/*!\struct ndict_default
+ * \brief Access policy following NDICT_CHECK_EXISTING and NDICT_CHECK_TYPE
+ */
+struct ndict_default{
+    template<typename T> static void check(const T &item,const ndict::type_t &expected,const char *message){
+#if NDICT_CHECK_EXISTING
+        if(item.type==ndict::TNULL) throw ndict_exception("Value is not set!");
+#endif
+#if NDICT_CHECK_TYPE
+        if(item.type!=expected) throw ndict_exception(message);
+#endif
+        (void)item;
+        (void)expected;
+        (void)message;
+    }
+};
+
+/*!\class ndict_builder
+ * \brief Builds the members of dictionary objects in place, for decoders and bulk loaders
+ *
+ * Keys are not checked for duplicates and array members are not checked to
+ * be keyed by their index, so callers must keep objects and arrays well
+ * formed themselves. Members are looked up with ndict::find() first.
+ */
+class ndict_builder {
+    public:
+        //! Set a scalar value from its text, see ndict::setvalue()
+        static void setvalue(ndict &node,const ndict::type_t &Type,const char *data,const size_t &size){node.setvalue(Type,data,size);}
+
+        //! Start building an object or array, see ndict::setblock()
+        static void setblock(ndict &node,const ndict::type_t &Type){node.setblock(Type);}
+
+        //! Set the key of a member by position, see ndict::setmember()
+        static ndict &setmember(ndict &node,const unsigned &index,const char *key,const size_t &size){return node.setmember(index,key,size);}
+
+        //! Drop members after the first ones, see ndict::truncate()
+        static void truncate(ndict &node,const unsigned &count){node.truncate(count);}
+
+        //! Make a node an array of packed decimals or integers, see ndict::setnumbers()
+        static void setnumbers(ndict &node,std::vector<double> &numbers){node.setnumbers(numbers);}
+        static void setnumbers(ndict &node,std::vector<int64_t> &integers){node.setnumbers(integers);}
+
+        //! Make a node an object or array decoded when first accessed, see ndict::setlazy()
+        static void setlazy(ndict &node,const ndict::type_t &Type,const std::shared_ptr<const std::string> &source,const char *data,const size_t &size,ndict::lazydecoder_t decoder){
+            node.setlazy(Type,source,data,size,decoder);
+        }
 };
 
+/*!\brief Get dictionary value as a string
+ * \return String representation of value
+ */
+template<typename P> std::string ndict::getstring() const{
+    P::check(*this,TSTRING,"Value is not string!");
+    return value;
+}
+
+/*!\brief Get dictionary value as a char array
+ * \return String representation of value
+ */
+template<typename P> const char *ndict::getchar() const{
+    P::check(*this,TSTRING,"Value is not string!");
+    return value.c_str();
+}
+
+/*!\brief Get dictionary value as an integer
+ * \return Integer representation of value (0 on failure)
+ */
+template<typename P> int ndict::getint() const{
+    P::check(*this,TNUMBER,"Value is not numeric!");
+    return atoi(value.c_str());
+}
+
+/*!\brief Get dictionary value as a float
+ * \return Float representation of value (0 on failure)
+ */
+template<typename P> double ndict::getdouble() const{
+    P::check(*this,TNUMBER,"Value is not numeric!");
+    return atof(value.c_str());
+}
+
+/*!\brief Get dictionary value as a boolean
+ * \return Boolean representation of value (false on failure)
+ */
+template<typename P> bool ndict::getbool() const{
+    P::check(*this,TBOOL,"Value is not boolean!");
+    return strcasecmp(value.c_str(),"true")==0?true:atoi(value.c_str());
+}
+
+#ifdef NDICT_HEADER_ONLY
+#include "ndict.cpp"
+#endif
+
 #endif
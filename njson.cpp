@@ -1,309 +1,1575 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include "njson.h"
+#include "nstats.h"
+#include "ntrace.h"
 
-/*!\brief Removes whitespace from input string
- * \param buffer JSON string to trim
- * \return Trimmed JSON string without whitespace
+//! Submit batched reads through io_uring where available
+#ifndef NJSON_IO_URING
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define NJSON_IO_URING          1
+#else
+#define NJSON_IO_URING          0
+#endif
+#endif
+
+//! Read and write gzip compressed files, requires linking with zlib
+#ifndef NJSON_ZLIB
+#define NJSON_ZLIB              0
+#endif
+
+#if NJSON_ZLIB
+#include <zlib.h>
+
+/*!\class njson_inflater
+ * \brief Decompresses gzip data on a background thread
+ *
+ * Compressed input is read from a file or memory buffer and decompressed in
+ * chunks into a small bounded queue, so decompression overlaps with the
+ * consumer parsing the previous chunk.
  */
-std::string njson::trim(std::string buffer){
-    bool quoted=false;
-    bool escaped=false;
-    size_t size=0;
-    for(unsigned i=0;i<buffer.size();i++){
-        // Track quotation and escaped characters
-        if(quoted && escaped){
-            escaped=false;
+class njson_inflater {
+    private:
+        FILE *file;
+        const char *memory;
+        size_t remaining;
+        std::thread worker;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<std::string> chunks;
+        std::string current;
+        size_t offset=0;
+        bool finished=false;
+        bool cancelled=false;
+        std::string error;
+
+        //! Decompress the input into the chunk queue
+        void run(){
+            z_stream stream;
+            memset(&stream,0,sizeof(stream));
+            std::string input(NJSON_CHUNK_SIZE,0);
+            std::string failure;
+            // Accept gzip headers only, members following each other are decoded in turn
+            if(inflateInit2(&stream,15+16)!=Z_OK){
+                failure="Failed to initialize zlib";
+            }
+            int status=Z_OK;
+            while(failure.empty()){
+                // Feed more compressed input
+                if(stream.avail_in==0){
+                    if(file){
+                        stream.next_in=(Bytef*)&input[0];
+                        stream.avail_in=fread(&input[0],1,input.size(),file);
+                        if(stream.avail_in==0 && ferror(file)) failure=std::string("Failed to read input file: ")+strerror(errno);
+                    }
+                    else{
+                        stream.next_in=(Bytef*)memory;
+                        stream.avail_in=std::min<size_t>(remaining,1<<30);
+                        memory+=stream.avail_in;
+                        remaining-=stream.avail_in;
+                    }
+                    if(stream.avail_in==0){
+                        if(status!=Z_STREAM_END && failure.empty()) failure="Truncated gzip input";
+                        break;
+                    }
+                }
+                if(status==Z_STREAM_END){
+                    inflateReset(&stream);
+                }
+
+                // Decompress a chunk and queue it
+                NTRACE_SCOPE("gzip::inflate");
+                std::string chunk(NJSON_CHUNK_SIZE,0);
+                stream.next_out=(Bytef*)&chunk[0];
+                stream.avail_out=chunk.size();
+                status=inflate(&stream,Z_NO_FLUSH);
+                if(status!=Z_OK && status!=Z_STREAM_END && status!=Z_BUF_ERROR){
+                    failure=std::string("Invalid gzip input: ")+(stream.msg?stream.msg:"unknown error");
+                    break;
+                }
+                chunk.resize(chunk.size()-stream.avail_out);
+                if(chunk.empty()) continue;
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard,[&](){return chunks.size()<4 || cancelled;});
+                if(cancelled) break;
+                chunks.push_back(std::move(chunk));
+                changed.notify_all();
+            }
+            inflateEnd(&stream);
+            std::lock_guard<std::mutex> guard(lock);
+            error=failure;
+            finished=true;
+            changed.notify_all();
         }
-        else if(quoted && buffer[i]=='\"'){
-            quoted=false;
+    public:
+        //! Decompress a file from its current position
+        njson_inflater(FILE *file) : file(file), memory(NULL), remaining(0) {
+            worker=std::thread(&njson_inflater::run,this);
         }
-        else if(!quoted && buffer[i]=='\"'){
-            quoted=true;
+
+        //! Decompress a buffer in memory
+        njson_inflater(const char *data,const size_t &size) : file(NULL), memory(data), remaining(size) {
+            worker=std::thread(&njson_inflater::run,this);
         }
 
-        if(!quoted && std::isspace(buffer[i])){
-            // Drop unquoted whitespace
+        //! Stop decompressing
+        ~njson_inflater(){
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                cancelled=true;
+                changed.notify_all();
+            }
+            worker.join();
         }
-        else{
-            // Keep everything else
-            escaped=(buffer[i]=='\\');
-            buffer[size++]=buffer[i];
+
+        //! Copy decompressed data to a buffer, returns 0 at the end
+        size_t read(char *buffer,size_t size){
+            if(offset==current.size()){
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard,[&](){return !chunks.empty() || finished;});
+                if(chunks.empty()){
+                    if(!error.empty()) throw njson_exception(error);
+                    return 0;
+                }
+                current=std::move(chunks.front());
+                chunks.pop_front();
+                offset=0;
+                changed.notify_all();
+            }
+            size=std::min(size,current.size()-offset);
+            memcpy(buffer,current.data()+offset,size);
+            offset+=size;
+            return size;
         }
-    }
-    return buffer.substr(0,size);
-}
+};
+#endif
+
+#if NJSON_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
-/*!\brief Parses a quoted string
- * \param buffer JSON string containing quoted string
- * \param pos Position in buffer to start search
- * \return Found quoted string
+/*!\class njson_uring
+ * \brief Minimal io_uring submission and completion rings for file reads
  *
- * Throws njson_exception upon error
+ * Talks to the kernel through raw system calls, so no library is needed.
+ * If the kernel doesn't support io_uring or its read operation, valid()
+ * returns false and the caller falls back to blocking reads.
  */
-std::string njson::parsequoted(std::string buffer,const int &pos){
-    bool escaped=false;
-    if(buffer[pos]!='\"') throw njson_exception("Expected quoted string");
-    for(unsigned i=pos+1;i<buffer.size();i++){
-        // Track quotation and escaped characters
-        if(escaped){
-            escaped=false;
+class njson_uring {
+    private:
+        int fd=-1;
+        unsigned entries=0;
+        void *sqring=MAP_FAILED,*cqring=MAP_FAILED,*sqes=MAP_FAILED;
+        size_t sqsize=0,cqsize=0,sqesize=0;
+        unsigned *sqtail,*sqmask,*sqarray,*cqhead,*cqtail,*cqmask;
+        io_uring_cqe *cqes;
+    public:
+        //! Set up rings with room for a number of concurrent reads
+        njson_uring(const unsigned &depth){
+            io_uring_params params;
+            memset(&params,0,sizeof(params));
+            fd=syscall(__NR_io_uring_setup,depth,&params);
+            if(fd<0) return;
+            if(!supported()) return;
+            entries=params.sq_entries;
+            sqsize=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+            cqsize=params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+            if(params.features&IORING_FEAT_SINGLE_MMAP) sqsize=cqsize=std::max(sqsize,cqsize);
+            sqring=mmap(0,sqsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+            if(sqring==MAP_FAILED) return;
+            if(params.features&IORING_FEAT_SINGLE_MMAP) cqring=sqring;
+            else cqring=mmap(0,cqsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+            if(cqring==MAP_FAILED) return;
+            sqesize=params.sq_entries*sizeof(io_uring_sqe);
+            sqes=mmap(0,sqesize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+            char *sq=(char*)sqring,*cq=(char*)cqring;
+            sqtail=(unsigned*)(sq+params.sq_off.tail);
+            sqmask=(unsigned*)(sq+params.sq_off.ring_mask);
+            sqarray=(unsigned*)(sq+params.sq_off.array);
+            cqhead=(unsigned*)(cq+params.cq_off.head);
+            cqtail=(unsigned*)(cq+params.cq_off.tail);
+            cqmask=(unsigned*)(cq+params.cq_off.ring_mask);
+            cqes=(io_uring_cqe*)(cq+params.cq_off.cqes);
+        }
+
+        //! Release the rings
+        ~njson_uring(){
+            if(sqes!=MAP_FAILED) munmap(sqes,sqesize);
+            if(cqring!=MAP_FAILED && cqring!=sqring) munmap(cqring,cqsize);
+            if(sqring!=MAP_FAILED) munmap(sqring,sqsize);
+            if(fd>=0) close(fd);
         }
-        else if(buffer[i]=='\"'){
-            return buffer.substr(pos,i-pos+1);
+
+        //! Check if the kernel supports reads, added in Linux 5.6 along with the probe
+        bool supported() const{
+            alignas(io_uring_probe) char buffer[sizeof(io_uring_probe)+IORING_OP_LAST*sizeof(io_uring_probe_op)];
+            memset(buffer,0,sizeof(buffer));
+            io_uring_probe *probe=(io_uring_probe*)buffer;
+            if(syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,IORING_OP_LAST)<0) return false;
+            return probe->last_op>=IORING_OP_READ && (probe->ops[IORING_OP_READ].flags&IO_URING_OP_SUPPORTED);
         }
-        else if(buffer[i]=='\\'){
-            escaped=true;
+
+        //! Check if the rings were set up
+        bool valid() const{
+            return sqes!=MAP_FAILED;
         }
-    }
-    throw njson_exception("String was not unquoted");
+
+        //! Number of reads that can be in flight
+        unsigned depth() const{
+            return entries;
+        }
+
+        //! Queue a read of a whole file, submitted by the next wait()
+        void read(const int &file,char *buffer,const size_t &size,const uint64_t &tag){
+            unsigned tail=*sqtail;
+            unsigned index=tail&*sqmask;
+            io_uring_sqe *sqe=&((io_uring_sqe*)sqes)[index];
+            memset(sqe,0,sizeof(*sqe));
+            sqe->opcode=IORING_OP_READ;
+            sqe->fd=file;
+            sqe->addr=(uint64_t)buffer;
+            sqe->len=size;
+            sqe->off=0;
+            sqe->user_data=tag;
+            sqarray[index]=index;
+            __atomic_store_n(sqtail,tail+1,__ATOMIC_RELEASE);
+        }
+
+        //! Submit queued reads and wait for at least one completion
+        bool wait(const unsigned &submit){
+            // An interrupted call has not consumed the queued reads, so submit them again
+            for(;;){
+                if(syscall(__NR_io_uring_enter,fd,submit,1,IORING_ENTER_GETEVENTS,NULL,0)>=0) return true;
+                if(errno!=EINTR) return false;
+            }
+        }
+
+        //! Take the next completion, returns false if none are ready
+        bool complete(uint64_t &tag,int &result){
+            unsigned head=*cqhead;
+            if(head==__atomic_load_n(cqtail,__ATOMIC_ACQUIRE)) return false;
+            io_uring_cqe *cqe=&cqes[head&*cqmask];
+            tag=cqe->user_data;
+            result=cqe->res;
+            __atomic_store_n(cqhead,head+1,__ATOMIC_RELEASE);
+            return true;
+        }
+};
+#endif
+
+/*!\brief Assign a decoded number to an object
+ * \param object ndict object to assign the number to
+ * \param data Characters of the number, followed by a delimiter
+ * \param size Length of the number
+ *
+ * Numbers with a fraction or an exponent are decimals. Integers are parsed
+ * as 64-bit values, and integers out of that range keep their text.
+ */
+NDICT_INLINE void njson::assignnumber(ndict &object,const char *data,const size_t &size){
+    int64_t integer;
+    std::from_chars_result result=std::from_chars(data,data+size,integer);
+    if(result.ptr!=data+size)       assigndecimal(object,atof(data));
+    else if(result.ec==std::errc()) assigninteger(object,integer);
+    else                            ndict_builder::setvalue(object,ndict::TNUMBER,data,size);
 }
 
-/*!\brief Parses an unquoted string
- * \param buffer JSON string containing string
- * \param pos Position in buffer to start search
- * \return Found string
+/*!\brief Assign a decoded integer to an object
+ * \param object ndict object to assign the integer to
+ * \param integer Value of the integer
  *
- * Throws njson_exception upon error
+ * The storage of the object is reused.
  */
-std::string njson::parseunquoted(std::string buffer,const int &pos){
-    for(unsigned i=pos;i<buffer.size();i++){
-        if(buffer[i]==',' || buffer[i]=='}'){
-            return buffer.substr(pos,i-pos);
+NDICT_INLINE void njson::assigninteger(ndict &object,const int64_t &integer){
+    char buffer[32];
+    ndict_builder::setvalue(object,ndict::TNUMBER,buffer,std::to_chars(buffer,buffer+sizeof(buffer),integer).ptr-buffer);
+}
+
+/*!\brief Assign a decoded decimal to an object
+ * \param object ndict object to assign the decimal to
+ * \param number Value of the decimal
+ *
+ * Decimals are formatted like std::to_string() does, reusing the storage of
+ * the object.
+ */
+NDICT_INLINE void njson::assigndecimal(ndict &object,const double &number){
+    char buffer[512];
+    ndict_builder::setvalue(object,ndict::TNUMBER,buffer,snprintf(buffer,sizeof(buffer),"%f",number));
+}
+
+/*!\brief Decodes the members of an array into a packed buffer while they are numbers
+ * \param scan Scanner positioned after the opening bracket
+ * \param top Array being decoded
+ * \return Member to decode the next value into, or NULL otherwise
+ *
+ * Arrays of only 64-bit integers or only decimals are kept as packed
+ * numbers, and their member nodes are created when first accessed.
+ * Otherwise the numbers read so far become regular members and decoding
+ * continues as usual, either into the returned member or with the next
+ * separator.
+ */
+NDICT_INLINE ndict *njson::parsepacked(njson_scanner &scan,frame &top){
+    numbers.clear();
+    integers.clear();
+    const char *data;
+    size_t size;
+    bool integral=false;
+    while(true){
+        size_t count=integers.size()+numbers.size();
+        char next=scan.peek();
+        if(!std::isdigit(next) && next!='-'){
+            if(!count) return nullptr;
+            if(scan.accept(']')) break;
+
+            // Another value follows the numbers
+            unpacknumbers(scan,top);
+            return parsemember(scan,top);
+        }
+        if(count>NDICT_MAX_ARRAY_SIZE) throw ndict_exception("Array index is out of bound");
+        scan.token(data,size);
+        int64_t integer;
+        std::from_chars_result result=std::from_chars(data,data+size,integer);
+        bool whole=result.ptr==data+size;
+        if(!count) integral=whole;
+        if(whole!=integral || result.ec==std::errc::result_out_of_range){
+            // Mixed integers and decimals, and integers out of range, are decoded as regular members
+            unpacknumbers(scan,top);
+            assignnumber(*parsemember(scan,top),data,size);
+            return nullptr;
         }
+        if(whole)   integers.push_back(integer);
+        else        numbers.push_back(atof(data));
+        if(scan.accept(']')) break;
+        scan.expect(',',"Expected , or ] in JSON array");
     }
-    return buffer.substr(pos);
+
+    // Members left over from a previous decode are replaced
+    NSTATS_COUNT(CDECODEDNODES,integers.size()+numbers.size());
+    if(integral)    ndict_builder::setnumbers(*top.node,integers);
+    else            ndict_builder::setnumbers(*top.node,numbers);
+    top.packed=true;
+    return nullptr;
 }
 
-/*!\brief Parses a json block value
- * \param buffer JSON string containing [] or {} block
- * \param pos Position in buffer to start search
- * \return Found block
+/*!\brief Decodes the numbers read into the packed buffer as regular members
+ * \param scan Scanner positioned after the numbers
+ * \param top Array being decoded
+ */
+NDICT_INLINE void njson::unpacknumbers(njson_scanner &scan,frame &top){
+    for(int64_t integer : integers) assigninteger(*parsemember(scan,top),integer);
+    for(double number : numbers) assigndecimal(*parsemember(scan,top),number);
+}
+
+/*!\brief Decodes a scalar JSON value
+ * \param scan Scanner positioned at the value
+ * \param object ndict object to assign the value to
  *
+ * The value is assigned in place, reusing the storage of the object.
  * Throws njson_exception upon error
  */
-std::string njson::parseblock(std::string buffer,const int &pos){
-    // Check bracket type
-    char end=0,beg=buffer[pos];
-    if(beg=='{') end='}';
-    if(beg=='[') end=']';
-
-    // Parse block
-    bool quoted=false;
-    bool escaped=false;
-    int depth=0;
-    for(unsigned i=pos+1;i<buffer.size();i++){
-        // Track quotation and escaped characters
-        if(quoted && escaped){
-            escaped=false;
+NDICT_INLINE void njson::parsescalar(njson_scanner &scan,ndict &object){
+    const char *data;
+    size_t size;
+    if(scan.peek()=='\"'){
+        scan.string(data,size);
+        ndict_builder::setvalue(object,ndict::TSTRING,data,size);
+    }
+    else{
+        scan.token(data,size);
+        if(std::isdigit(data[0]) || data[0]=='-'){
+            // The token is followed by a delimiter, so it can be converted in place
+            assignnumber(object,data,size);
         }
-        else if(quoted && buffer[i]=='\"'){
-            quoted=false;
+        else if(size==4 && !strncasecmp(data,"true",4)){
+            ndict_builder::setvalue(object,ndict::TBOOL,"true",4);
         }
-        else if(!quoted && buffer[i]=='\"'){
-            quoted=true;
+        else if(size==5 && !strncasecmp(data,"false",5)){
+            ndict_builder::setvalue(object,ndict::TBOOL,"false",5);
+        }
+        else if(size==4 && !strncasecmp(data,"null",4)){
+            ndict_builder::setvalue(object,ndict::TNULL,"",0);
+        }
+        else{
+            scan.error("Invalid JSON value: "+std::string(data,size));
         }
-        if(quoted){
-            escaped=(buffer[i]=='\\');
+    }
+}
+
+/*!\brief Decodes the key of the next member of an object or array
+ * \param scan Scanner positioned after the preceding member
+ * \param top Object or array being decoded
+ * \return Member to decode the value into
+ *
+ * Members left over from a previous decode are reused in order, keeping
+ * their storage when consecutive messages are similarly shaped. Later
+ * duplicate keys replace earlier ones.
+ */
+NDICT_INLINE ndict *njson::parsemember(njson_scanner &scan,frame &top){
+    ndict &node=*top.node;
+    const char *data;
+    size_t size;
+    char index[16];
+    if(top.keyed){
+        // Copy the key, the stream window may move while scanning past the colon
+        scan.string(key);
+        scan.expect(':',"Key and value must be separated by :");
+        data=key.data();
+        size=key.size();
+        int found=node.find(data,size,top.count);
+        if(found>=0) return &ndict_builder::setmember(node,found,data,size);
+    }
+    else{
+        if(top.count>NDICT_MAX_ARRAY_SIZE) throw ndict_exception("Array index is out of bound");
+        data=index;
+        size=snprintf(index,sizeof(index),"%u",top.count);
+    }
+    return &ndict_builder::setmember(node,top.count++,data,size);
+}
+
+/*!\brief Decodes any JSON value
+ * \param scan Scanner positioned at the value
+ * \param object ndict object to populate
+ *
+ * Nested objects and arrays are tracked on an explicit stack rather than by
+ * recursion, so decoding time is independent of nesting depth. Nesting
+ * deeper than the configured maximum depth throws njson_exception. Nodes,
+ * keys and values already held by the object are reused where possible,
+ * unless they are shared with copies of it.
+ */
+NDICT_INLINE void njson::parse(njson_scanner &scan,ndict &object){
+    NTRACE_SCOPE("njson::parse");
+    stack.clear();
+    ndict *target=&object;
+    while(target){
+        // Decode a value, opening a block for objects and arrays
+        NSTATS_COUNT(CDECODEDNODES,1);
+        char c=scan.peek();
+        if(c=='{' || c=='['){
+            scan.accept(c);
+            if(stack.size()>=maxdepth) scan.error("JSON nesting exceeds maximum depth");
+            ndict_builder::setblock(*target,c=='{'?ndict::TOBJECT:ndict::TARRAY);
+            stack.push_back({target,c=='{',0,false});
+            if(c=='['){
+                target=parsepacked(scan,stack.back());
+                if(target) continue;
+                if(stack.back().packed) stack.pop_back();
+            }
         }
         else{
-            // Check for brackets
-            if(buffer[i]==beg){
-                depth++;
+            parsescalar(scan,*target);
+        }
+
+        // Find the next member, closing finished blocks
+        target=nullptr;
+        while(!stack.empty() && !target){
+            frame &top=stack.back();
+            char close=top.keyed?'}':']';
+            if(top.count && !scan.accept(',')){
+                scan.expect(close,top.keyed?"Expected , or } in JSON object":"Expected , or ] in JSON array");
             }
-            else if(buffer[i]==end){
-                if(depth--==0){
-                    return buffer.substr(pos,i-pos+1);
-                }
+            else if(!scan.accept(close)){
+                target=parsemember(scan,top);
+                continue;
             }
+
+            // Drop members left over from a previous decode
+            ndict_builder::truncate(*top.node,top.count);
+            if(top.keyed && top.count==0) top.node->type=ndict::TNULL;
+            stack.pop_back();
         }
     }
-    if(beg=='{')    throw njson_exception("JSON object incorrectly formatted");
-    if(beg=='[')    throw njson_exception("JSON array incorrectly formatted");
-    throw njson_exception("Invalid JSON block formatting");
 }
 
-/*!\brief Parses a json array
- * \param object ndict object to populate with members
- * \param buffer JSON string containing [] block
+//! Schema accepting any value
+NDICT_INLINE const njson_schema njson_any(ndict::TNULL);
+
+//! Names of types in schema errors, in the order of ndict::type_t
+NDICT_INLINE const char *const njson_typenames[]={"number","string","bool","array","object","null"};
+
+/*!\brief Create a schema for a value of a given type
+ * \param type Expected type, TNULL to accept any value
+ */
+NDICT_INLINE njson_schema::njson_schema(const ndict::type_t &type) : type(type) {
+}
+
+/*!\brief Add a required member to an object schema
+ * \param key Key of the member
+ * \param schema Schema of the member, or a plain type
+ * \return Reference to this schema
  *
- * Throws njson_exception upon error
+ * Decoded objects hold their members in the order they were added, and
+ * decoding is fastest when documents list them in that order too.
  */
-void njson::parsearray(ndict &object,std::string buffer){
-    // Remove outer brackets
-    if(buffer[0]!='[' || buffer[buffer.size()-1]!=']'){
-        throw njson_exception("Invalid JSON array formatting");
+NDICT_INLINE njson_schema &njson_schema::member(const std::string &key,const njson_schema &schema){
+    for(unsigned i=0;i<keys.size();i++){
+        if(keys[i]==key){
+            members[i]=schema;
+            return *this;
+        }
     }
-    buffer=buffer.substr(1,buffer.size()-2);
+    keys.push_back(key);
+    members.push_back(schema);
+    return *this;
+}
 
-    // Parse block
-    bool quoted=false;
-    std::vector<std::string> array;
-    std::string value;
-    object=array;
-    for(unsigned i=0;i<buffer.size();i++){
-        // Track quotation and escaped characters
-        if(quoted && buffer[i]=='\"'){
-            quoted=false;
+/*!\brief Set the schema of the members of an array schema
+ * \param schema Schema of every member, or a plain type
+ * \param length Required number of members, 0 for any number
+ * \return Reference to this schema
+ */
+NDICT_INLINE njson_schema &njson_schema::items(const njson_schema &schema,const unsigned &length){
+    item.assign(1,schema);
+    this->length=length;
+    return *this;
+}
+
+/*!\brief Allow members not listed in an object schema
+ * \param allow true to accept and decode other members, false to reject them
+ * \return Reference to this schema
+ *
+ * Other members are decoded without a schema, after the listed ones.
+ */
+NDICT_INLINE njson_schema &njson_schema::allowextra(const bool &allow){
+    extra=allow;
+    return *this;
+}
+
+/*!\brief Get the type of the next JSON value without consuming it
+ * \param c First character of the value
+ * \return Type of the value, TNULL for null or invalid values
+ */
+NDICT_INLINE ndict::type_t njson::peektype(const char &c){
+    switch(c){
+        case '{':   return ndict::TOBJECT;
+        case '[':   return ndict::TARRAY;
+        case '\"':  return ndict::TSTRING;
+        case 't':
+        case 'T':
+        case 'f':
+        case 'F':   return ndict::TBOOL;
+        default:    return std::isdigit(c) || c=='-'?ndict::TNUMBER:ndict::TNULL;
+    }
+}
+
+/*!\brief Get the path of the member being decoded against a schema
+ * \param depth Number of nested objects and arrays to include
+ * \return JSON pointer of the member
+ */
+NDICT_INLINE std::string njson::schemapath(const size_t &depth) const{
+    std::string path;
+    for(size_t i=0;i<depth;i++){
+        const schemaframe &f=schemastack[i];
+        path+="/"+f.node->getkey(f.current);
+    }
+    return path;
+}
+
+/*!\brief Decodes the key of the next member of an object or array against a schema
+ * \param scan Scanner positioned after the preceding member
+ * \param top Object or array being decoded
+ * \param expect Set to the schema of the member
+ * \return Member to decode the value into
+ *
+ * Object members are first matched against the slot following the previous
+ * member, so members listed in schema order are found with one comparison.
+ */
+NDICT_INLINE ndict *njson::parseschemamember(njson_scanner &scan,schemaframe &top,const njson_schema *&expect){
+    ndict &node=*top.node;
+    const njson_schema &schema=*top.schema;
+    const char *data;
+    size_t size;
+    char index[16];
+    unsigned i;
+    if(schema.type==ndict::TOBJECT){
+        scan.string(key);
+        scan.expect(':',"Key and value must be separated by :");
+        data=key.data();
+        size=key.size();
+        unsigned slots=schema.keys.size();
+        unsigned slot=top.next;
+        if(slot>=slots || schema.keys[slot].size()!=size || memcmp(schema.keys[slot].data(),data,size)){
+            for(slot=0;slot<slots;slot++){
+                if(schema.keys[slot].size()==size && !memcmp(schema.keys[slot].data(),data,size)) break;
+            }
         }
-        else if(!quoted && buffer[i]=='\"'){
-            quoted=true;
+        top.count++;
+        if(slot<slots){
+            schemaseen[top.seen+slot]=1;
+            top.next=slot+1;
+            top.current=slot;
+            expect=&schema.members[slot];
+            return &ndict_builder::setmember(node,slot,data,size);
+        }
+        if(!schema.extra){
+            scan.error("Unexpected member "+schemapath(schemastack.size()-1)+"/"+std::string(data,size));
         }
 
-        // Check for separator
-        if(!quoted && buffer[i]==','){
-            array.push_back(value);
-            value.clear();
+        // Other members follow the listed ones, later duplicates replace earlier ones
+        expect=&njson_any;
+        for(i=slots;i<slots+top.extras;i++){
+            const std::string &extra=node.getkey(i);
+            if(extra.size()==size && !memcmp(extra.data(),data,size)) break;
         }
-        else{
-            value+=buffer[i];
+        if(i==slots+top.extras) top.extras++;
+    }
+    else{
+        if(top.count>NDICT_MAX_ARRAY_SIZE) throw ndict_exception("Array index is out of bound");
+        if(schema.length && top.count>=schema.length){
+            scan.error("Expected "+std::to_string(schema.length)+" members in "+schemapath(schemastack.size()-1));
         }
+        expect=schema.item.empty()?&njson_any:&schema.item[0];
+        data=index;
+        size=snprintf(index,sizeof(index),"%u",top.count);
+        i=top.count++;
     }
-    array.push_back(value);
-    for(unsigned i=0;i<array.size();i++){
-        parsevalue(object[i],array[i]);
+    top.current=i;
+    return &ndict_builder::setmember(node,i,data,size);
+}
+
+/*!\brief Finish an object or array decoded against a schema
+ * \param scan Scanner positioned after the closing bracket
+ * \param top Object or array being decoded
+ *
+ * Checks that all required members were found, and drops members left over
+ * from a previous decode. Throws njson_exception if the block does not
+ * conform to the schema.
+ */
+NDICT_INLINE void njson::parseschemaclose(njson_scanner &scan,schemaframe &top){
+    const njson_schema &schema=*top.schema;
+    unsigned used=top.count;
+    if(schema.type==ndict::TOBJECT){
+        for(unsigned i=0;i<schema.keys.size();i++){
+            if(!schemaseen[top.seen+i]) scan.error("Missing member "+schemapath(schemastack.size()-1)+"/"+schema.keys[i]);
+        }
+        used=schema.keys.size()+top.extras;
+        schemaseen.resize(top.seen);
+        if(used==0) top.node->type=ndict::TNULL;
+    }
+    else if(schema.length && top.count!=schema.length){
+        scan.error("Expected "+std::to_string(schema.length)+" members in "+schemapath(schemastack.size()-1));
     }
+    ndict_builder::truncate(*top.node,used);
+    schemastack.pop_back();
 }
 
-/*!\brief Finds type of value by formatting
- * \param buffer String with JSON-formatted value
- * \return ndict enumeration value
+/*!\brief Decodes any JSON value against a schema
+ * \param scan Scanner positioned at the value
+ * \param object ndict object to populate
+ * \param schema Expected shape of the value
+ *
+ * Types are checked as values are scanned, and the members of objects are
+ * laid out from the schema before their values are decoded. Values of
+ * TNULL schemas are decoded as usual. Throws njson_exception with the path
+ * of the first value that does not conform to the schema.
  */
-ndict::type_t njson::valuetype(std::string buffer){
-    if(buffer.size()){
-        if(buffer[0]=='\"'){
-            return ndict::TSTRING;
+NDICT_INLINE void njson::parseschema(njson_scanner &scan,ndict &object,const njson_schema &schema){
+    NTRACE_SCOPE("njson::parseschema");
+    schemastack.clear();
+    schemaseen.clear();
+    ndict *target=&object;
+    const njson_schema *expect=&schema;
+    while(target){
+        char c=scan.peek();
+        ndict::type_t type=peektype(c);
+        if(expect->type==ndict::TNULL && (type==ndict::TOBJECT || type==ndict::TARRAY)){
+            // Nested values without a schema
+            parse(scan,*target);
+        }
+        else if(expect->type==ndict::TNULL){
+            NSTATS_COUNT(CDECODEDNODES,1);
+            parsescalar(scan,*target);
+        }
+        else if(type!=expect->type){
+            scan.error(std::string("Expected ")+njson_typenames[expect->type]+" for "+schemapath(schemastack.size()));
         }
-        else if(std::isdigit(buffer[0]) || buffer[0]=='-'){
-            return ndict::TNUMBER;
+        else if(type==ndict::TOBJECT || type==ndict::TARRAY){
+            NSTATS_COUNT(CDECODEDNODES,1);
+            scan.accept(c);
+            if(schemastack.size()>=maxdepth) scan.error("JSON nesting exceeds maximum depth");
+            ndict_builder::setblock(*target,type);
+            schemastack.push_back({target,expect,0,0,0,0,schemaseen.size()});
+            if(type==ndict::TOBJECT){
+                // Listed members take the first slots, their keys are set as they are found
+                schemaseen.resize(schemaseen.size()+expect->keys.size(),0);
+            }
+            else if(!expect->item.empty() && expect->item[0].type==ndict::TNUMBER){
+                // Arrays of numbers are packed where possible
+                frame packed={target,false,0,false};
+                ndict *next=parsepacked(scan,packed);
+                schemaframe &top=schemastack.back();
+                top.count=packed.count;
+                if(next){
+                    top.current=packed.count-1;
+                    scan.error(std::string("Expected number for ")+schemapath(schemastack.size()));
+                }
+                if(packed.packed){
+                    if(expect->length && target->size()!=expect->length){
+                        scan.error("Expected "+std::to_string(expect->length)+" members in "+schemapath(schemastack.size()-1));
+                    }
+                    schemastack.pop_back();
+                }
+            }
         }
         else{
-            std::string v=buffer;
-            std::transform(v.begin(),v.end(),v.begin(),::toupper);
-            if(v=="TRUE" || v=="FALSE"){
-                return ndict::TBOOL;
+            NSTATS_COUNT(CDECODEDNODES,1);
+            parsescalar(scan,*target);
+        }
+
+        // Find the next member, closing finished blocks
+        target=nullptr;
+        while(!schemastack.empty() && !target){
+            schemaframe &top=schemastack.back();
+            bool keyed=top.schema->type==ndict::TOBJECT;
+            if(top.count && !scan.accept(',')){
+                scan.expect(keyed?'}':']',keyed?"Expected , or } in JSON object":"Expected , or ] in JSON array");
             }
-            if(v=="NULL"){
-                return ndict::TNULL;
+            else if(!scan.accept(keyed?'}':']')){
+                target=parseschemamember(scan,top,expect);
+                continue;
             }
-            throw njson_exception(std::string("Invalid JSON value: ")+buffer);
+            parseschemaclose(scan,top);
         }
     }
-    return ndict::TNULL;
 }
 
-/*!\brief Assigns a value with the correct type
- * \param object ndict object to populate with members
- * \param buffer String with JSON-formatted value
+/*!\brief Set the maximum nesting depth of decoded objects and arrays
+ * \param depth Maximum number of nested objects and arrays
+ */
+NDICT_INLINE void njson::setdepth(const unsigned &depth){
+    maxdepth=depth;
+}
+
+//! Check for the gzip magic number
+#define ISGZIP(DATA,SIZE)       ((SIZE)>=2 && (unsigned char)(DATA)[0]==0x1f && (unsigned char)(DATA)[1]==0x8b)
+
+//! Check for the Zstandard magic number
+#define ISZSTD(DATA,SIZE)       ((SIZE)>=4 && !memcmp(DATA,"\x28\xb5\x2f\xfd",4))
+
+/*!\brief Decodes a compressed JSON document
+ * \param data Compressed text
+ * \param size Size of the compressed text in bytes
+ * \param object ndict object to populate
+ *
+ * Throws njson_exception upon error or unsupported compression
  */
-void njson::parsevalue(ndict &object,std::string buffer){
-    ndict::type_t type=valuetype(buffer);
-    if(type==ndict::TSTRING){
-        object=buffer.substr(1,buffer.size()-2);
+NDICT_INLINE void njson::decompress(const char *data,const size_t &size,ndict &object){
+    NSTATS_TIME(HDECODE);
+    NTRACE_SCOPE("njson::decompress");
+#if NJSON_ZLIB
+    if(ISGZIP(data,size)){
+        njson_inflater inflater(data,size);
+        njson_scanner scan([&](char *buffer,size_t size){return inflater.read(buffer,size);});
+        parsedocument(scan,object);
+        return;
     }
-    if(type==ndict::TNUMBER){
-        if(buffer.find(".")==std::string::npos){
-            object=atoi(buffer.c_str());
+#endif
+    if(ISZSTD(data,size))   throw njson_exception("Zstandard compressed input is not supported");
+    else                    throw njson_exception("Gzip compressed input requires zlib support (NJSON_ZLIB)");
+}
+
+/*!\brief Reads a JSON string from a file and decodes the input to a dictionary object
+ * \param path Path to JSON file to read
+ * \return ndict object of the decoded file
+ *
+ * The file is decoded as it is read, so the whole text is never held in
+ * memory. Gzip compressed files are detected by their magic number and
+ * decompressed on a second thread while decoding. Throws njson_exception
+ * upon error
+ */
+NDICT_INLINE ndict njson::read(const std::string &path){
+    NSTATS_TIME(HREAD);
+    NTRACE_SCOPE("njson::read");
+    FILE *fd=fopen(path.c_str(),"rb");
+    if(!fd){
+        throw njson_exception(std::string("Failed to open input file: ")+strerror(errno));
+    }
+    ndict object;
+    char magic[4];
+    size_t size=fread(magic,1,sizeof(magic),fd);
+    rewind(fd);
+    try{
+        if(ISGZIP(magic,size)){
+#if NJSON_ZLIB
+            njson_inflater inflater(fd);
+            njson_scanner scan([&](char *buffer,size_t size){return inflater.read(buffer,size);});
+            parsedocument(scan,object);
+#else
+            decompress(magic,size,object);
+#endif
+        }
+        else if(ISZSTD(magic,size)){
+            decompress(magic,size,object);
         }
         else{
-            object=atof(buffer.c_str());
+            njson_scanner scan([&](char *buffer,size_t size){
+                NTRACE_SCOPE("njson::read io");
+                size_t result=fread(buffer,1,size,fd);
+                if(result==0 && ferror(fd)) throw njson_exception(std::string("Failed to read input file: ")+strerror(errno));
+                return result;
+            });
+            parsedocument(scan,object);
         }
     }
-    if(type==ndict::TBOOL){
-        std::string v=buffer;
-        std::transform(v.begin(),v.end(),v.begin(),::toupper);
-        object=(v=="TRUE")?true:false;
+    catch(...){
+        fclose(fd);
+        throw;
     }
+    fclose(fd);
+    return object;
 }
 
-/*!\brief Parses a json object
- * \param object ndict object to populate with members
- * \param buffer JSON string containing {} block
+/*!\brief Write a chunk of encoded output to a file
+ * \param out Encoded output, cleared after writing
+ * \param context FILE pointer to write to
+ */
+NDICT_INLINE void njson::writeplain(std::string &out,void *context){
+    NSTATS_COUNT(CENCODEDBYTES,out.size());
+    if(fwrite(out.data(),1,out.size(),(FILE*)context)!=out.size()){
+        throw njson_exception(std::string("Failed to write output file: ")+strerror(errno));
+    }
+    out.clear();
+}
+
+#if NJSON_ZLIB
+/*!\brief Write a chunk of encoded output to a gzip compressed file
+ * \param out Encoded output, cleared after writing
+ * \param context gzFile to write to
+ */
+NDICT_INLINE void njson::writegzip(std::string &out,void *context){
+    NSTATS_COUNT(CENCODEDBYTES,out.size());
+    if(out.size() && gzwrite((gzFile)context,out.data(),out.size())!=(int)out.size()){
+        int code;
+        const char *message=gzerror((gzFile)context,&code);
+        throw njson_exception(std::string("Failed to write compressed output file: ")+(code==Z_ERRNO?strerror(errno):message));
+    }
+    out.clear();
+}
+#endif
+
+/*!\brief Encodes a dictionary object and writes it to a file
+ * \param path Path to JSON file to write, compressed with gzip if it ends with .gz
+ * \param dict Dictionary object to encode
  *
- * Throws njson_exception upon error
+ * The output is written as it is encoded, so the whole text is never held
+ * in memory. Throws njson_exception upon error
  */
-void njson::parseobject(ndict &object,std::string buffer){
-    // Remove outer brackets
-    if(buffer[0]!='{' || buffer[buffer.size()-1]!='}'){
-        throw njson_exception("Invalid JSON object formatting");
+NDICT_INLINE void njson::write(const std::string &path,const ndict &dict){
+    NSTATS_TIME(HENCODE);
+    NTRACE_SCOPE("njson::write");
+    bool compress=path.size()>3 && path.compare(path.size()-3,3,".gz")==0;
+    void (*flush)(std::string &out,void *context)=writeplain;
+    void *context;
+    if(compress){
+#if NJSON_ZLIB
+        flush=writegzip;
+        context=gzopen(path.c_str(),"wb");
+#else
+        throw njson_exception("Gzip compressed output requires zlib support (NJSON_ZLIB)");
+#endif
+    }
+    else{
+        context=fopen(path.c_str(),"wb");
+    }
+    if(!context){
+        throw njson_exception(std::string("Failed to open output file: ")+strerror(errno));
     }
-    buffer=buffer.substr(1,buffer.size()-2);
+    auto finish=[&](){
+#if NJSON_ZLIB
+        if(compress) return gzclose((gzFile)context)==Z_OK;
+#endif
+        return fclose((FILE*)context)==0;
+    };
 
-    // Parse keyed values
-    unsigned pos=0;
-    while(pos<buffer.size()){
-        // Parse key
-        std::string value,key=parsequoted(buffer,pos);
-        pos+=key.size();
-        if(buffer[pos++]!=':'){
-            throw njson_exception("Key and value must be separated by :");
-        }
+    // Close the file before reporting the first error
+    std::string error;
+    try{
+        std::string out;
+        dict.getjson(out,flush,context);
+        flush(out,context);
+    }
+    catch(njson_exception &e){
+        error=e.what();
+    }
+    catch(...){
+        finish();
+        throw;
+    }
+    if(!finish() && error.empty()) error=std::string("Failed to write output file: ")+strerror(errno);
+    if(!error.empty()) throw njson_exception(error);
+}
 
-        // Parse value
-        switch(buffer[pos]){
-            case '\"':  value=parsequoted(buffer,pos);  break;
-            case '{':   value=parseblock(buffer,pos);   break;
-            case '[':   value=parseblock(buffer,pos);   break;
-            default:    value=parseunquoted(buffer,pos);break;
+/*!\brief Read the rest of a file with blocking reads
+ * \param fd File descriptor
+ * \param buffer Buffer sized to the file
+ * \param offset Number of bytes already read
+ * \return false upon read errors
+ */
+NDICT_INLINE bool njson::readremaining(const int &fd,std::string &buffer,size_t offset){
+    while(offset<buffer.size()){
+        ssize_t result=pread(fd,&buffer[offset],buffer.size()-offset,offset);
+        if(result<0 && errno==EINTR) continue;
+        if(result<0) return false;
+        if(result==0){
+            // The file was truncated while reading
+            buffer.resize(offset);
+            break;
         }
-        pos+=value.size();
-        if(buffer[pos]==',') pos++;
+        offset+=result;
+    }
+    return true;
+}
 
-        // Load key:value
-        key=key.substr(1,key.size()-2);
-        if(value[0]=='['){
-            parsearray(object[key],value);
-        }
-        else if(value[0]=='{'){
-            parseobject(object[key],value);
+/*!\brief Reads and decodes several JSON files concurrently
+ * \param paths Paths to JSON files to read
+ * \param threads Number of decoding threads, 0 to use one per core
+ * \return ndict objects of the decoded files, in the order of the paths
+ *
+ * All reads are submitted at once through io_uring where supported, and
+ * each file is decoded on a worker thread as soon as its read completes.
+ * Otherwise the worker threads read the files with blocking reads. Loading
+ * time is then bounded by the slowest file rather than the sum of all.
+ * Throws njson_exception for the first path in order that failed.
+ */
+NDICT_INLINE std::vector<ndict> njson::readall(const std::vector<std::string> &paths,const unsigned &threads){
+    NTRACE_SCOPE("njson::readall");
+    size_t count=paths.size();
+    std::vector<ndict> result(count);
+    std::vector<std::string> buffers(count);
+    std::vector<std::string> errors(count);
+    std::vector<int> files(count,-1);
+    std::vector<char> loaded(count,0);
+    if(count==0) return result;
+
+    // Open all files up front, and size their buffers
+    for(size_t i=0;i<count;i++){
+        NTRACE_SCOPE("readall::open");
+        struct stat info;
+        files[i]=open(paths[i].c_str(),O_RDONLY|O_CLOEXEC);
+        if(files[i]<0 || fstat(files[i],&info)<0){
+            errors[i]=std::string("Failed to open input file: ")+strerror(errno);
         }
         else{
-            parsevalue(object[key],value);
+            buffers[i].resize(info.st_size);
         }
     }
+
+    // Worker threads decode files as they become ready
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<size_t> queue;
+    bool finished=false;
+    unsigned workers=threads?threads:std::max(1u,std::thread::hardware_concurrency());
+    workers=std::min<size_t>(workers,count);
+    auto work=[&](){
+        njson parser;
+        parser.setdepth(maxdepth);
+        while(true){
+            size_t i;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                ready.wait(guard,[&](){return !queue.empty() || finished;});
+                if(queue.empty()) return;
+                i=queue.front();
+                queue.pop_front();
+            }
+            if(errors[i].empty() && !loaded[i]){
+                NTRACE_SCOPE("readall::read");
+                if(!readremaining(files[i],buffers[i],0)) errors[i]=std::string("Failed to read input file: ")+strerror(errno);
+            }
+            if(files[i]>=0) close(files[i]);
+            if(!errors[i].empty()) continue;
+            try{
+                NTRACE_SCOPE("readall::decode");
+                const std::string &buffer=buffers[i];
+                if(ISGZIP(buffer.data(),buffer.size()) || ISZSTD(buffer.data(),buffer.size())){
+                    parser.decompress(buffer.data(),buffer.size(),result[i]);
+                }
+                else{
+                    parser.decode(buffer,result[i]);
+                }
+            }
+            catch(njson_exception &e){
+                errors[i]=e.what();
+            }
+            catch(ndict_exception &e){
+                errors[i]=e.what();
+            }
+            std::string().swap(buffers[i]);
+        }
+    };
+    std::vector<std::thread> pool;
+    for(unsigned i=0;i<workers;i++) pool.emplace_back(work);
+    auto push=[&](const size_t &i){
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(i);
+        ready.notify_one();
+    };
+
+    size_t next=0;
+#if NJSON_IO_URING
+    njson_uring ring(std::min<size_t>(count,256));
+    if(ring.valid()){
+        // Keep the ring full, handing each completed read to the workers
+        std::vector<char> inflight(count,0);
+        size_t pending=0;
+        while(next<count || pending){
+            unsigned submit=0;
+            while(next<count && pending<ring.depth()){
+                if(errors[next].empty()){
+                    ring.read(files[next],&buffers[next][0],buffers[next].size(),next);
+                    inflight[next]=1;
+                    submit++;
+                    pending++;
+                }
+                else{
+                    push(next);
+                }
+                next++;
+            }
+            if(!pending) continue;
+            NTRACE_SCOPE("readall::wait");
+            if(!ring.wait(submit)){
+                // The ring failed, give up on reads in flight
+                for(size_t i=0;i<next;i++){
+                    if(!inflight[i]) continue;
+                    errors[i]=std::string("Failed to read input file: ")+strerror(errno);
+                    push(i);
+                }
+                break;
+            }
+            uint64_t tag;
+            int status;
+            while(ring.complete(tag,status)){
+                pending--;
+                inflight[tag]=0;
+                if(status<0){
+                    errors[tag]=std::string("Failed to read input file: ")+strerror(-status);
+                }
+                else if(!readremaining(files[tag],buffers[tag],status)){
+                    errors[tag]=std::string("Failed to read input file: ")+strerror(errno);
+                }
+                loaded[tag]=1;
+                push(tag);
+            }
+        }
+    }
+#endif
+
+    // Files not read through io_uring are read by the workers
+    for(;next<count;next++) push(next);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        finished=true;
+        ready.notify_all();
+    }
+    for(std::thread &worker : pool) worker.join();
+    for(size_t i=0;i<count;i++){
+        if(!errors[i].empty()) throw njson_exception(paths[i]+": "+errors[i]);
+    }
+    return result;
 }
 
-/*!\brief Reads a JSON string from a file and decodes the input to a dictionary object
- * \param path Path to JSON file to read
- * \return ndict object of the decoded file
+/*!\brief Reads several JSON files concurrently and merges them
+ * \param paths Paths to JSON files to read
+ * \param threads Number of decoding threads, 0 to use one per core
+ * \return ndict object of the decoded files, merged in the order of the paths
+ *
+ * Later files override values of earlier ones, like merge() does.
+ * Throws njson_exception for the first path in order that failed.
+ */
+NDICT_INLINE ndict njson::readmerged(const std::vector<std::string> &paths,const unsigned &threads){
+    NTRACE_SCOPE("njson::readmerged");
+    std::vector<ndict> dicts=readall(paths,threads);
+    ndict result;
+    for(const ndict &dict : dicts) result.merge(dict);
+    return result;
+}
+
+/*!\brief Decodes a JSON string to a dictionary object
+ * \param json String containing JSON text to be decoded
+ * \return ndict object of the decoded string
  *
  * Throws njson_exception upon error
  */
-ndict njson::read(const std::string &path){
-    FILE *fd=fopen(path.c_str(),"r");
-    if(fd){
-        fseek(fd,0,SEEK_END);
-        size_t size=ftell(fd);
-        fseek(fd,0,SEEK_SET);
-        char buffer[size+1];
-        size=fread(buffer,1,size,fd);
-        fclose(fd);
-        buffer[size]=0;
-        return decode(buffer);
+NDICT_INLINE ndict njson::decode(const std::string &json){
+    ndict object;
+    decode(json,object);
+    return object;
+}
+
+/*!\brief Decodes a JSON string into an existing dictionary object
+ * \param json String containing JSON text to be decoded
+ * \param object ndict object to replace with the decoded string
+ *
+ * Reuses the nodes and storage of the object, as well as the decoder state
+ * of this njson instance. Decoding similarly shaped messages into the same
+ * object repeatedly makes no heap allocations once warmed up. Throws
+ * njson_exception upon error, in which case the object is left partially
+ * decoded.
+ */
+NDICT_INLINE void njson::decode(const std::string &json,ndict &object){
+    NSTATS_TIME(HDECODE);
+    NTRACE_SCOPE("njson::decode");
+    njson_scanner scan(json.data(),json.size());
+    parsedocument(scan,object);
+}
+
+/*!\brief Decodes a JSON string against a schema
+ * \param json String containing JSON text to be decoded
+ * \param schema Expected shape of the document
+ * \return ndict object of the decoded string
+ *
+ * Throws njson_exception upon error, or if the document does not conform
+ * to the schema
+ */
+NDICT_INLINE ndict njson::decode(const std::string &json,const njson_schema &schema){
+    ndict object;
+    decode(json,schema,object);
+    return object;
+}
+
+/*!\brief Decodes a JSON string against a schema into an existing dictionary object
+ * \param json String containing JSON text to be decoded
+ * \param schema Expected shape of the document
+ * \param object ndict object to replace with the decoded string
+ *
+ * Nodes and storage of the object are reused like decode() does. Throws
+ * njson_exception upon error, or if the document does not conform to the
+ * schema, leaving the object partially decoded.
+ */
+NDICT_INLINE void njson::decode(const std::string &json,const njson_schema &schema,ndict &object){
+    NSTATS_TIME(HDECODE);
+    NTRACE_SCOPE("njson::decode schema");
+    njson_scanner scan(json.data(),json.size());
+    if(scan.peek()!='{') scan.error("Expected JSON object");
+    parseschema(scan,object,schema);
+    if(!scan.done()) scan.error("Trailing characters after JSON value");
+    NSTATS_COUNT(CDECODEDBYTES,scan.offset());
+}
+
+/*!\brief Decodes a whole JSON document
+ * \param scan Scanner positioned at the start of the document
+ * \param object ndict object to populate
+ *
+ * Throws njson_exception upon error
+ */
+NDICT_INLINE void njson::parsedocument(njson_scanner &scan,ndict &object){
+    if(scan.peek()!='{') scan.error("Expected JSON object");
+    parse(scan,object);
+    if(!scan.done()) scan.error("Trailing characters after JSON value");
+    NSTATS_COUNT(CDECODEDBYTES,scan.offset());
+}
+
+/*!\brief Tree of projected paths
+ *
+ * Members are matched against the raw keys of the scanned text, so lookups
+ * don't allocate.
+ */
+struct njson_projection{
+    std::string key;
+    bool whole=false;
+    std::vector<njson_projection> members;
+};
+
+/*!\brief Find a projected member by its raw key
+ * \param node Projection to search
+ * \param data Key to look up
+ * \param size Length of the key
+ * \return Pointer to the member, or NULL if it is not projected
+ */
+NDICT_INLINE const njson_projection *njson::projectmember(const njson_projection &node,const char *data,const size_t &size){
+    for(const njson_projection &member : node.members){
+        if(member.key.size()==size && !memcmp(member.key.data(),data,size)) return &member;
+    }
+    return NULL;
+}
+
+/*!\brief Decode the projected members of a JSON value
+ * \param scan Scanner positioned at the value
+ * \param object ndict object to populate with members
+ * \param node Projection of the value
+ * \return true if any projected path was found in the value
+ *
+ * Values outside the projection are skipped without being converted.
+ * Members are only added once a projected path has been resolved, so paths
+ * running into scalars or missing keys leave no trace.
+ */
+NDICT_INLINE bool njson::projectvalue(njson_scanner &scan,ndict &object,const njson_projection &node){
+    const char *data;
+    size_t size;
+    bool found=false;
+    if(node.whole){
+        njson_readdict(scan,object);
+        found=true;
+    }
+    else if(scan.accept('{')){
+        while(!scan.accept('}')){
+            scan.string(data,size);
+            const njson_projection *member=projectmember(node,data,size);
+            scan.expect(':',"Key and value must be separated by :");
+            ndict child;
+            if(member && projectvalue(scan,child,*member)){
+                object[member->key]=child;
+                found=true;
+            }
+            else if(!member){
+                scan.skip();
+            }
+            if(!scan.accept(',')){
+                scan.expect('}',"Expected , or } in JSON object");
+                break;
+            }
+        }
+    }
+    else if(scan.accept('[')){
+        char index[16];
+        for(unsigned i=0;!scan.accept(']');i++){
+            const njson_projection *member=projectmember(node,index,snprintf(index,sizeof(index),"%u",i));
+            ndict child;
+            if(member && projectvalue(scan,child,*member)){
+                object[i]=child;
+                found=true;
+            }
+            else if(!member){
+                scan.skip();
+            }
+            if(!scan.accept(',')){
+                scan.expect(']',"Expected , or ] in JSON array");
+                break;
+            }
+        }
     }
     else{
-        throw njson_exception(std::string("Failed to open input file: ")+strerror(errno));
+        scan.skip();
     }
+    return found;
 }
 
-/*!\brief Decodes a JSON string to a dictionary object
+/*!\brief Decodes selected paths of a JSON string to a dictionary object
+ * \param json String containing JSON text to be decoded
+ * \param paths JSON pointers (RFC 6901) of the members to decode, such as "/outer/inner/0"
+ * \return ndict object holding only the selected members
+ *
+ * Members outside the selected paths are skipped without being converted or
+ * copied, so decoding cost scales with the selected data. Paths that don't
+ * exist in the document, including paths continuing below a scalar, are left
+ * out. Array members preceding a selected
+ * index are kept as null values. Throws njson_exception upon error.
+ */
+NDICT_INLINE ndict njson::decode(const std::string &json,const std::vector<std::string> &paths){
+    NSTATS_TIME(HDECODE);
+    NTRACE_SCOPE("njson::decode projection");
+    NSTATS_COUNT(CDECODEDBYTES,json.size());
+    // Build a tree of the selected members
+    njson_projection root;
+    for(const std::string &path : paths){
+        if(!path.empty() && path[0]!='/') throw njson_exception("JSON pointer must start with /: "+path);
+        njson_projection *node=&root;
+        size_t pos=0;
+        while(pos<path.size() && !node->whole){
+            size_t next=path.find('/',pos+1);
+            if(next==std::string::npos) next=path.size();
+            std::string key;
+            for(size_t i=pos+1;i<next;i++){
+                if(path[i]=='~' && i+1<next && (path[i+1]=='0' || path[i+1]=='1')){
+                    key+=path[++i]=='0'?'~':'/';
+                }
+                else{
+                    key+=path[i];
+                }
+            }
+            const njson_projection *member=projectmember(*node,key.data(),key.size());
+            if(!member){
+                node->members.emplace_back();
+                node->members.back().key=key;
+                member=&node->members.back();
+            }
+            node=const_cast<njson_projection*>(member);
+            pos=next;
+        }
+        node->whole=true;
+        node->members.clear();
+    }
+
+    // Decode the top-level object
+    ndict object;
+    njson_scanner scan(json.data(),json.size());
+    if(scan.peek()!='{') scan.error("Expected JSON object");
+    projectvalue(scan,object,root);
+    if(!scan.done()) scan.error("Trailing characters after JSON value");
+    return object;
+}
+
+/*!\brief Decode a JSON value, deferring nested objects and arrays
+ * \param scan Scanner positioned at the value
+ * \param object ndict object to populate
+ * \param source Buffer holding the scanned text
+ *
+ * Objects and arrays keep a span of the source buffer and are decoded when
+ * first accessed. The value must already have been checked.
+ */
+NDICT_INLINE void njson::lazyvalue(njson_scanner &scan,ndict &object,const std::shared_ptr<const std::string> &source){
+    const char *data;
+    size_t size;
+    char c=scan.peek();
+    if(c=='{' || c=='['){
+        // Empty blocks are decoded right away, like decode() does
+        scan.span(data,size);
+        size_t i=1;
+        while(i<size-1 && std::isspace(data[i])) i++;
+        if(i==size-1){
+            njson_scanner block(data,size);
+            parse(block,object);
+            return;
+        }
+        ndict_builder::setlazy(object,c=='{'?ndict::TOBJECT:ndict::TARRAY,source,data,size,&njson::lazymembers);
+    }
+    else{
+        parsescalar(scan,object);
+    }
+}
+
+/*!\brief Decode the members of a lazily decoded object or array
+ * \param node Node to create the members on
+ * \param source Buffer holding the text
+ * \param data Text of the object or array within the buffer
+ * \param size Length of the text
+ */
+NDICT_INLINE void njson::lazymembers(ndict &node,const std::shared_ptr<const std::string> &source,const char *data,const size_t &size){
+    njson_scanner scan(data,size);
+    njson parser;
+    const char *key;
+    size_t length;
+    char index[16];
+    bool keyed=scan.accept('{');
+    if(!keyed) scan.expect('[',"Expected JSON array");
+    char close=keyed?'}':']';
+    ndict_builder::setblock(node,keyed?ndict::TOBJECT:ndict::TARRAY);
+    unsigned count=0;
+    while(!scan.accept(close)){
+        ndict *member;
+        if(keyed){
+            // Later duplicate keys replace earlier ones, like operator[] does
+            scan.string(key,length);
+            scan.expect(':',"Key and value must be separated by :");
+            int found=node.find(key,length,count);
+            member=&ndict_builder::setmember(node,found<0?count++:found,key,length);
+            if(found>=0) *member=ndict();
+        }
+        else{
+            member=&ndict_builder::setmember(node,count,index,snprintf(index,sizeof(index),"%u",count));
+            count++;
+        }
+        parser.lazyvalue(scan,*member,source);
+        if(!scan.accept(',')){
+            scan.expect(close,"Unterminated JSON block");
+            break;
+        }
+    }
+}
+
+/*!\brief Decodes a JSON string lazily to a dictionary object
  * \param json String containing JSON text to be decoded
  * \return ndict object of the decoded string
  *
- * Throws njson_exception upon error
+ * The whole text is checked up front, but nested objects and arrays are
+ * kept as spans of a shared copy of the text and only decoded when first
+ * accessed. This saves time and memory when only a few members are used.
+ * Lazily decoded members are materialized by the first const accessor that
+ * reaches them, so the result can be read by several threads at once like
+ * any other dictionary. Throws njson_exception upon error.
  */
-ndict njson::decode(const std::string &json){
+NDICT_INLINE ndict njson::decodelazy(const std::string &json){
+    NSTATS_TIME(HDECODE);
+    NTRACE_SCOPE("njson::decodelazy");
+    NSTATS_COUNT(CDECODEDBYTES,json.size());
+    std::shared_ptr<const std::string> source=std::make_shared<const std::string>(json);
+    njson_limits limits;
+    limits.depth=maxdepth;
+    njson_status status=validate(*source,limits);
+    if(!status.valid) throw njson_exception(std::string(status.reason)+" at offset "+std::to_string(status.offset));
+
     ndict object;
-    std::string buffer=trim(json);
-    parseobject(object,buffer);
+    njson_scanner scan(source->data(),source->size());
+    lazyvalue(scan,object,source);
     return object;
 }
 
+/*!\brief Check if a token is a valid JSON number
+ * \param data First character of the token
+ * \param size Length of the token
+ * \return true if the token is a number
+ */
+NDICT_INLINE bool njson::isnumber(const char *data,const size_t &size){
+    size_t i=0;
+    auto digits=[&](){
+        size_t start=i;
+        while(i<size && std::isdigit(data[i])) i++;
+        return i>start;
+    };
+    if(i<size && data[i]=='-') i++;
+    if(!digits()) return false;
+    if(i<size && data[i]=='.'){
+        i++;
+        if(!digits()) return false;
+    }
+    if(i<size && (data[i]=='e' || data[i]=='E')){
+        i++;
+        if(i<size && (data[i]=='+' || data[i]=='-')) i++;
+        if(!digits()) return false;
+    }
+    return i==size;
+}
+
+/*!\brief Check if a string token holds raw control characters
+ * \param data First character of the string, without quotes
+ * \param size Length of the string
+ * \return true if a character below U+0020 appears unescaped
+ */
+NDICT_INLINE bool njson::hascontrol(const char *data,const size_t &size){
+    for(size_t i=0;i<size;i++){
+        if((unsigned char)data[i]<0x20) return true;
+    }
+    return false;
+}
+
+/*!\brief Validates JSON text without decoding it
+ * \param data JSON text to validate
+ * \param size Size of the JSON text in bytes
+ * \param limits Limits to enforce on size, nesting depth and string length
+ * \return Status with the offset and reason of the first error, if any
+ *
+ * Accepts the same grammar as decode(), with a top-level object, but
+ * numbers must be well-formed, strings must not hold raw control characters
+ * and a comma must be followed by another member. Runs on the scanner without building a
+ * dictionary, and does not allocate or throw unless objects and arrays are
+ * nested deeper than 1024 levels.
+ */
+NDICT_INLINE njson_status njson::validate(const char *data,const size_t &size,const njson_limits &limits){
+    NTRACE_SCOPE("njson::validate");
+    njson_status status;
+    njson_scanner scan(data,size);
+    auto fail=[&](const char *reason){
+        status.valid=false;
+        status.offset=scan.offset();
+        status.reason=reason;
+        return status;
+    };
+    if(limits.size && size>limits.size) return fail("Input exceeds size limit");
+    if(scan.peek()!='{') return fail("Expected JSON object");
+
+    // Stack of open blocks, one bit per level set for objects
+    uint64_t stack[16];
+    std::vector<uint64_t> overflow;
+    unsigned depth=0;
+    auto keyed=[&](){
+        unsigned level=depth-1;
+        uint64_t word=level<1024?stack[level/64]:overflow[level/64-16];
+        return (word>>(level%64))&1;
+    };
+
+    // Iterate over values, tracking whether the next token starts a member
+    // and whether it is the first one, as blocks may only close before that
+    const char *token;
+    size_t length;
+    bool member=false,first=false;
+    while(true){
+        if(member){
+            // Start of an object member or array element, or end of the block
+            member=false;
+            if(first && scan.accept(keyed()?'}':']')){
+                depth--;
+            }
+            else{
+                if(keyed()){
+                    if(!scan.scanstring(token,length)) return fail("Expected quoted string");
+                    if(limits.string && length>limits.string) return fail("String exceeds length limit");
+                    if(hascontrol(token,length)) return fail("Control character in string");
+                    if(!njson_scanner::unescape(token,length,nullptr)) return fail("Invalid escape sequence");
+                    if(!scan.accept(':')) return fail("Key and value must be separated by :");
+                }
+                continue;
+            }
+        }
+        else{
+            // Any value
+            char c=scan.peek();
+            size_t start=scan.offset();
+            if(c=='{' || c=='['){
+                if(limits.depth && depth>=limits.depth) return fail("Nesting exceeds depth limit");
+                scan.accept(c);
+                unsigned level=depth++;
+                if(level>=1024 && overflow.size()<=level/64-16) overflow.push_back(0);
+                uint64_t &word=level<1024?stack[level/64]:overflow[level/64-16];
+                uint64_t bit=(uint64_t)1<<(level%64);
+                word=c=='{'?word|bit:word&~bit;
+                member=true;
+                first=true;
+                continue;
+            }
+            else if(c=='\"'){
+                if(!scan.scanstring(token,length)) return fail("String was not unquoted");
+                if(limits.string && length>limits.string) return fail("String exceeds length limit");
+                if(hascontrol(token,length)) return fail("Control character in string");
+                if(!njson_scanner::unescape(token,length,nullptr)) return fail("Invalid escape sequence");
+            }
+            else if(!scan.scantoken(token,length)){
+                return fail("Expected JSON value");
+            }
+            else if(std::isdigit(token[0]) || token[0]=='-'){
+                if(!isnumber(token,length)){
+                    fail("Invalid JSON number");
+                    status.offset=start;
+                    return status;
+                }
+            }
+            else if(!(length==4 && (!strncasecmp(token,"true",4) || !strncasecmp(token,"null",4))) &&
+                    !(length==5 && !strncasecmp(token,"false",5))){
+                fail("Invalid JSON value");
+                status.offset=start;
+                return status;
+            }
+        }
+
+        // A value is complete, close finished blocks until the next member
+        while(depth>0 && !scan.accept(',')){
+            if(!scan.accept(keyed()?'}':']')) return fail(keyed()?"Expected , or } in JSON object":"Expected , or ] in JSON array");
+            depth--;
+        }
+        if(depth==0) break;
+        member=true;
+        first=false;
+    }
+    if(!scan.done()) return fail("Trailing characters after JSON value");
+    return status;
+}
+
+/*!\brief Validates JSON text without decoding it
+ * \param json String containing JSON text to validate
+ * \param limits Limits to enforce on size, nesting depth and string length
+ * \return Status with the offset and reason of the first error, if any
+ */
+NDICT_INLINE njson_status njson::validate(const std::string &json,const njson_limits &limits){
+    return validate(json.data(),json.size(),limits);
+}
+
 /*!\brief Encodes a dictionary object as a JSON string
  * \param dict Dictionary object to encode
  * \return JSON string representing the dictionary object
  */
-std::string njson::encode(const ndict &dict){
-    return dict.getjson();
+NDICT_INLINE std::string njson::encode(const ndict &dict){
+    NSTATS_TIME(HENCODE);
+    NTRACE_SCOPE("njson::encode");
+    std::string json=dict.getjson();
+    NSTATS_COUNT(CENCODEDBYTES,json.size());
+    return json;
 }
 
 /*!\brief Merges a JSON string with a dictionary object
@@ -313,10 +1579,362 @@ std::string njson::encode(const ndict &dict){
  *
  * Throws njson_exception upon decoding errors
  */
-ndict njson::merge(const std::string &json,const ndict &dict){
+NDICT_INLINE ndict njson::merge(const std::string &json,const ndict &dict){
     ndict newdict=decode(json);
     ndict mrgdict=dict;
     mrgdict.merge(newdict);
     return mrgdict;
 }
 
+
+/*!\brief Create a scanner over a buffer
+ * \param data JSON text to scan
+ * \param size Size of the JSON text in bytes
+ */
+NDICT_INLINE njson_scanner::njson_scanner(const char *data,const size_t &size) : begin(data), pos(data), end(data+size) {
+}
+
+/*!\brief Create a scanner over a stream of chunks
+ * \param source Function filling a buffer with up to a given number of bytes, returning 0 at the end
+ *
+ * Only the current chunk and any token spanning chunks are held in memory.
+ * Tokens are valid until the next call to the scanner, and span() and
+ * skip() are not supported.
+ */
+NDICT_INLINE njson_scanner::njson_scanner(const std::function<size_t(char *buffer,size_t size)> &source) : source(source) {
+    begin=pos=end=window.data();
+}
+
+/*!\brief Read the next chunk from the stream
+ * \param mark Start of the text to keep, at or before the current position
+ * \return false at the end of the stream
+ *
+ * Moves the kept text to the start of the window before appending the
+ * chunk, and updates the mark and the current position.
+ */
+NDICT_INLINE bool njson_scanner::refill(const char *&mark){
+    if(!source) return false;
+    size_t keep=end-mark;
+    size_t at=pos-mark;
+    base+=mark-begin;
+    memmove(&window[0],mark,keep);
+    window.resize(keep+NJSON_CHUNK_SIZE);
+    size_t size=source(&window[keep],NJSON_CHUNK_SIZE);
+    window.resize(keep+size);
+    begin=mark=window.data();
+    pos=begin+at;
+    end=begin+keep+size;
+    return size>0;
+}
+
+/*!\brief Get the current position
+ * \return Offset from the start of the buffer
+ */
+NDICT_INLINE size_t njson_scanner::offset() const{
+    return base+(pos-begin);
+}
+
+/*!\brief Throw an exception for malformed input at the current position
+ * \param message Description of the error
+ */
+NDICT_INLINE void njson_scanner::error(const std::string &message) const{
+    throw njson_exception(message+" at offset "+std::to_string(offset()));
+}
+
+/*!\brief Skip whitespace and peek at the next character
+ * \return Next character, or 0 at the end of the buffer
+ */
+NDICT_INLINE char njson_scanner::peek(){
+    while(true){
+        while(pos<end && (*pos==' ' || *pos=='\n' || *pos=='\r' || *pos=='\t')) pos++;
+        if(pos<end) return *pos;
+        const char *mark=pos;
+        if(!refill(mark)) return 0;
+    }
+}
+
+/*!\brief Check if only whitespace remains
+ * \return true at the end of the buffer
+ */
+NDICT_INLINE bool njson_scanner::done(){
+    return peek()==0 && pos==end;
+}
+
+/*!\brief Consume a structural character if it is next
+ * \param c Character to consume
+ * \return true if the character was consumed
+ */
+NDICT_INLINE bool njson_scanner::accept(const char &c){
+    if(peek()!=c || pos==end) return false;
+    pos++;
+    return true;
+}
+
+/*!\brief Consume a structural character
+ * \param c Character to consume
+ * \param message Exception message if the character is not next
+ */
+NDICT_INLINE void njson_scanner::expect(const char &c,const char *message){
+    if(!accept(c)) error(message);
+}
+
+/*!\brief Scan a quoted string without throwing
+ * \param data Set to the first character inside the quotes
+ * \param size Set to the length of the string, escape sequences are kept as is
+ * \return false if no string is next or it is not terminated
+ */
+NDICT_INLINE bool njson_scanner::scanstring(const char *&data,size_t &size){
+    if(peek()!='\"') return false;
+    size_t searched=1;
+    while(true){
+        // Find the next quote, and check that it is not escaped
+        const char *search=pos+searched;
+        const char *quote=(const char*)memchr(search,'\"',end-search);
+        if(!quote){
+            const char *mark=pos;
+            searched=end-pos;
+            if(!refill(mark)) return false;
+            continue;
+        }
+        const char *escape=quote;
+        while(escape>pos+1 && escape[-1]=='\\') escape--;
+        if(((quote-escape)&1)==0){
+            data=pos+1;
+            size=quote-data;
+            pos=quote+1;
+            return true;
+        }
+        searched=quote+1-pos;
+    }
+}
+
+/*!\brief Scan an unquoted token without throwing
+ * \param data Set to the first character of the token
+ * \param size Set to the length of the token
+ * \return false if no token is next
+ */
+NDICT_INLINE bool njson_scanner::scantoken(const char *&data,size_t &size){
+    peek();
+    data=pos;
+    while(true){
+        while(pos<end && !strchr(",:{}[]\" \n\r\t",*pos)) pos++;
+        if(pos<end || !refill(data)) break;
+    }
+    size=pos-data;
+    return size!=0;
+}
+
+/*!\brief Scan a quoted string and decode its escape sequences
+ * \param data Set to the first character of the decoded string
+ * \param size Set to the length of the decoded string
+ *
+ * Strings without escape sequences are returned in place. Others are decoded
+ * into a buffer held by the scanner, valid until the next string is scanned.
+ */
+NDICT_INLINE void njson_scanner::string(const char *&data,size_t &size){
+    if(peek()!='\"') error("Expected quoted string");
+    if(!scanstring(data,size)) error("String was not unquoted");
+    if(!memchr(data,'\\',size)) return;
+    if(!unescape(data,size,&unescaped)) error("Invalid escape sequence");
+    data=unescaped.data();
+    size=unescaped.size();
+}
+
+/*!\brief Scan a quoted string and decode it into a string
+ * \param value String to assign the decoded string to
+ *
+ * Decodes escape sequences straight into the value rather than the buffer
+ * held by the scanner.
+ */
+NDICT_INLINE void njson_scanner::string(std::string &value){
+    const char *data;
+    size_t size;
+    if(peek()!='\"') error("Expected quoted string");
+    if(!scanstring(data,size)) error("String was not unquoted");
+    if(!memchr(data,'\\',size))                 value.assign(data,size);
+    else if(!unescape(data,size,&value))        error("Invalid escape sequence");
+}
+
+/*!\brief Parse four hexadecimal digits of a unicode escape
+ * \param data First digit
+ * \param end End of the string
+ * \param code Set to the parsed code unit
+ * \return false if there are not four hexadecimal digits
+ */
+NDICT_INLINE bool njson_scanner::parsehex(const char *data,const char *end,unsigned &code){
+    if(end-data<4) return false;
+    code=0;
+    for(int i=0;i<4;i++){
+        char c=data[i];
+        code<<=4;
+        if(c>='0' && c<='9')        code|=c-'0';
+        else if(c>='a' && c<='f')   code|=c-'a'+10;
+        else if(c>='A' && c<='F')   code|=c-'A'+10;
+        else                        return false;
+    }
+    return true;
+}
+
+/*!\brief Decode the escape sequences of a string
+ * \param data Characters inside the quotes
+ * \param size Number of characters
+ * \param out String to decode into, or nullptr to only check the escape sequences
+ * \return false if an escape sequence is invalid
+ *
+ * Runs between backslashes are found with memchr and copied in bulk. Unicode
+ * escapes are encoded as UTF-8, combining surrogate pairs, and unpaired
+ * surrogates are replaced by U+FFFD.
+ */
+NDICT_INLINE bool njson_scanner::unescape(const char *data,const size_t &size,std::string *out){
+    // Decoded strings are never longer than their escaped form
+    const char *end=data+size;
+    char *write=nullptr;
+    if(out){
+        out->resize(size);
+        write=&(*out)[0];
+    }
+    while(true){
+        const char *escape=(const char*)memchr(data,'\\',end-data);
+        size_t run=(escape?escape:end)-data;
+        if(write){
+            memcpy(write,data,run);
+            write+=run;
+        }
+        if(!escape) break;
+        if(escape+1==end) return false;
+        data=escape+2;
+        char c=escape[1];
+        switch(c){
+            case '\"':
+            case '\\':
+            case '/':   break;
+            case 'b':   c='\b';     break;
+            case 'f':   c='\f';     break;
+            case 'n':   c='\n';     break;
+            case 'r':   c='\r';     break;
+            case 't':   c='\t';     break;
+            case 'u':   c=0;        break;
+            default:    return false;
+        }
+        if(c){
+            if(write) *write++=c;
+            continue;
+        }
+
+        // Combine surrogate pairs into one code point
+        unsigned code,low;
+        if(!parsehex(data,end,code)) return false;
+        data+=4;
+        if(code>=0xd800 && code<0xdc00 && end-data>=6 && data[0]=='\\' && data[1]=='u' &&
+           parsehex(data+2,end,low) && low>=0xdc00 && low<0xe000){
+            code=0x10000+((code-0xd800)<<10)+(low-0xdc00);
+            data+=6;
+        }
+        else if(code>=0xd800 && code<0xe000){
+            code=0xfffd;
+        }
+        if(!write) continue;
+
+        // Encode as UTF-8
+        if(code<0x80){
+            *write++=code;
+        }
+        else if(code<0x800){
+            *write++=0xc0|(code>>6);
+            *write++=0x80|(code&0x3f);
+        }
+        else if(code<0x10000){
+            *write++=0xe0|(code>>12);
+            *write++=0x80|((code>>6)&0x3f);
+            *write++=0x80|(code&0x3f);
+        }
+        else{
+            *write++=0xf0|(code>>18);
+            *write++=0x80|((code>>12)&0x3f);
+            *write++=0x80|((code>>6)&0x3f);
+            *write++=0x80|(code&0x3f);
+        }
+    }
+    if(out) out->resize(write-out->data());
+    return true;
+}
+
+/*!\brief Scan an unquoted token such as a number or keyword
+ * \param data Set to the first character of the token
+ * \param size Set to the length of the token
+ */
+NDICT_INLINE void njson_scanner::token(const char *&data,size_t &size){
+    if(!scantoken(data,size)) error("Expected JSON value");
+}
+
+/*!\brief Scan any JSON value without interpreting it
+ * \param data Set to the first character of the value
+ * \param size Set to the length of the value, including brackets or quotes
+ */
+NDICT_INLINE void njson_scanner::span(const char *&data,size_t &size){
+    char c=peek();
+    const char *start=pos;
+    if(c=='\"'){
+        if(!scanstring(data,size)) error("String was not unquoted");
+    }
+    else if(c=='{' || c=='['){
+        // Track the expected closing brackets, skipping over quoted strings
+        std::string closers;
+        while(pos<end){
+            char next=*pos;
+            if(next=='\"'){
+                if(!scanstring(data,size)) error("String was not unquoted");
+                continue;
+            }
+            pos++;
+            if(next=='{') closers.push_back('}');
+            else if(next=='[') closers.push_back(']');
+            else if(next=='}' || next==']'){
+                if(next!=closers.back()) break;
+                closers.pop_back();
+                if(closers.empty()) break;
+            }
+        }
+        if(!closers.empty()) error(c=='{'?"JSON object incorrectly formatted":"JSON array incorrectly formatted");
+    }
+    else{
+        token(data,size);
+    }
+    data=start;
+    size=pos-start;
+}
+
+/*!\brief Skip any JSON value without interpreting it
+ */
+NDICT_INLINE void njson_scanner::skip(){
+    const char *data;
+    size_t size;
+    span(data,size);
+}
+
+/*!\brief Read a generic JSON value into a dictionary object
+ * \param scan Scanner positioned at the value
+ * \param value Dictionary object to populate
+ *
+ * Allows bound structs to hold free-form members. Throws njson_exception
+ * upon error.
+ */
+NDICT_INLINE void njson_readdict(njson_scanner &scan,ndict &value){
+    njson parser;
+    value.clear();
+    parser.parse(scan,value);
+}
+
+/*!\brief Write a dictionary object member as JSON
+ * \param out String to append to
+ * \param value Dictionary object to encode
+ * \param indent Number of spaces to use for indentation
+ * \param level Number of indents
+ */
+NDICT_INLINE void njson_writedict(std::string &out,const ndict &value,const int &indent,const int &level){
+    if(value.type==ndict::TNULL)    out+="null";
+    else                            out+=value.getjson(indent,level);
+}
+
+#undef ISGZIP
+#undef ISZSTD
@@ -4,10 +4,23 @@
 #ifndef _NJSON_H_
 #define _NJSON_H_
 
+#include <strings.h>
 #include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 #include "ndict.h"
 
+//! Size of chunks read from streams
+#define NJSON_CHUNK_SIZE        65536
+
+//! Default maximum nesting depth of decoded objects and arrays
+#define NJSON_MAX_DEPTH         1024
+
 /*!\class njson_exception
  * \brief Exception class for json parser
  */
@@ -19,26 +32,346 @@ class njson_exception: public std::exception {
         const char *what(){return msg.c_str();}
 };
 
+/*!\class njson_scanner
+ * \brief Scans JSON text in place without copying or allocating
+ *
+ * Tokens are returned as spans of the scanned buffer, and are only valid as
+ * long as the buffer is. Strings holding escape sequences are the exception,
+ * and are decoded into a buffer reused by the scanner. Throws njson_exception
+ * with the offset of the error upon malformed input.
+ */
+class njson_scanner {
+    private:
+        const char *begin;
+        const char *pos;
+        const char *end;
+
+        // Chunked input
+        std::function<size_t(char *buffer,size_t size)> source;
+        std::string window;
+        size_t base=0;
+        bool refill(const char *&mark);
+
+        // Decoded copy of the last string holding escape sequences
+        std::string unescaped;
+        static bool parsehex(const char *data,const char *end,unsigned &code);
+    public:
+        njson_scanner(const char *data,const size_t &size);
+        njson_scanner(const std::function<size_t(char *buffer,size_t size)> &source);
+
+        // Position and error reporting
+        size_t offset() const;
+        bool done();
+        [[noreturn]] void error(const std::string &message) const;
+
+        // Structural characters
+        char peek();
+        bool accept(const char &c);
+        void expect(const char &c,const char *message);
+
+        // Values
+        bool scanstring(const char *&data,size_t &size);
+        bool scantoken(const char *&data,size_t &size);
+        void string(const char *&data,size_t &size);
+        void string(std::string &value);
+        void token(const char *&data,size_t &size);
+        void span(const char *&data,size_t &size);
+        void skip();
+        static bool unescape(const char *data,const size_t &size,std::string *out);
+};
+
+//! Limits enforced when validating JSON text, 0 for no limit
+struct njson_limits{
+    size_t size=0;          //!< Maximum size of the text in bytes
+    unsigned depth=0;       //!< Maximum nesting depth of objects and arrays
+    size_t string=0;        //!< Maximum length of keys and strings in bytes
+};
+
+//! Result of validating JSON text
+struct njson_status{
+    bool valid=true;        //!< true if the text is valid
+    size_t offset=0;        //!< Offset of the first error
+    const char *reason="";  //!< Description of the first error
+};
+
+//! Describes a struct member bound to a JSON key
+template<typename S,typename M> struct njson_field{
+    const char *name;   //!< JSON key
+    size_t length;      //!< Length of the JSON key
+    M S::*member;       //!< Pointer to the struct member
+};
+
+//! Create a field descriptor for a struct member
+template<typename S,typename M> constexpr njson_field<S,M> njson_bind(const char *name,M S::*member){
+    return njson_field<S,M>{name,std::char_traits<char>::length(name),member};
+}
+
+/*!\brief Declares the JSON fields of a struct
+ *
+ * Specialize with a static constexpr tuple of field descriptors named
+ * fields, for example through the NJSON_BINDING macro.
+ */
+template<typename T> struct njson_binding;
+
+//! Describe a struct member with a JSON key equal to its name
+#define NJSON_FIELD(STRUCT,MEMBER)  njson_bind(#MEMBER,&STRUCT::MEMBER)
+
+//! Bind the listed fields of a struct to JSON, e.g. NJSON_BINDING(point,NJSON_FIELD(point,x),NJSON_FIELD(point,y))
+#define NJSON_BINDING(STRUCT,...)   template<> struct njson_binding<STRUCT>{ static constexpr auto fields=std::make_tuple(__VA_ARGS__); };
+
+//! Detects structs with a JSON binding
+template<typename T,typename=void> struct njson_isbound: std::false_type{};
+template<typename T> struct njson_isbound<T,std::void_t<decltype(njson_binding<T>::fields)>>: std::true_type{};
+
+//! Detects vectors
+template<typename T> struct njson_isvector: std::false_type{};
+template<typename T,typename A> struct njson_isvector<std::vector<T,A>>: std::true_type{};
+
+// Generic values inside bound structs
+void njson_readdict(njson_scanner &scan,ndict &value);
+void njson_writedict(std::string &out,const ndict &value,const int &indent,const int &level);
+
+/*!\brief Read a JSON value directly into a typed variable
+ * \param scan Scanner positioned at the value
+ * \param value Variable to populate, left untouched for null values
+ *
+ * Throws njson_exception upon malformed input or type mismatch.
+ */
+template<typename T> void njson_readvalue(njson_scanner &scan,T &value){
+    if constexpr(std::is_same<T,ndict>::value){
+        njson_readdict(scan,value);
+    }
+    else{
+        const char *data;
+        size_t size;
+        char c=scan.peek();
+        if(c=='n' || c=='N'){
+            scan.token(data,size);
+            if(size!=4 || strncasecmp(data,"null",4)) scan.error("Invalid JSON value");
+            return;
+        }
+        if constexpr(std::is_same<T,bool>::value){
+            scan.token(data,size);
+            if(size==4 && !strncasecmp(data,"true",4))          value=true;
+            else if(size==5 && !strncasecmp(data,"false",5))    value=false;
+            else scan.error("Expected boolean value");
+        }
+        else if constexpr(std::is_integral<T>::value){
+            // Decimals and values beyond the range of the field are not converted
+            scan.token(data,size);
+            std::from_chars_result result=std::from_chars(data,data+size,value);
+            if(result.ec==std::errc::result_out_of_range) scan.error("Integer value out of range");
+            if(result.ec!=std::errc() || result.ptr!=data+size) scan.error("Expected integer value");
+        }
+        else if constexpr(std::is_floating_point<T>::value){
+            scan.token(data,size);
+            std::from_chars_result result=std::from_chars(data,data+size,value);
+            if(result.ec!=std::errc() || result.ptr!=data+size) scan.error("Expected numeric value");
+        }
+        else if constexpr(std::is_same<T,std::string>::value){
+            if(c!='\"') scan.error("Expected quoted string");
+            scan.string(value);
+        }
+        else if constexpr(njson_isvector<T>::value){
+            scan.expect('[',"Expected JSON array");
+            value.clear();
+            while(!scan.accept(']')){
+                value.emplace_back();
+                njson_readvalue(scan,value.back());
+                if(!scan.accept(',')){
+                    scan.expect(']',"Expected , or ] in JSON array");
+                    break;
+                }
+            }
+        }
+        else{
+            static_assert(njson_isbound<T>::value,"Type has no njson_binding");
+            scan.expect('{',"Expected JSON object");
+            while(!scan.accept('}')){
+                // Dispatch the key to the matching field, skipping unknown keys
+                if(scan.peek()!='\"') scan.error("Expected quoted string");
+                scan.string(data,size);
+                scan.expect(':',"Key and value must be separated by :");
+                bool hit=std::apply([&](const auto &...field){
+                    return ((field.length==size && !memcmp(field.name,data,size) && (njson_readvalue(scan,value.*(field.member)),true)) || ...);
+                },njson_binding<T>::fields);
+                if(!hit) scan.skip();
+                if(!scan.accept(',')){
+                    scan.expect('}',"Expected , or } in JSON object");
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*!\brief Write a typed variable as JSON
+ * \param out String to append to
+ * \param value Variable to encode
+ * \param indent Number of spaces to use for indentation
+ * \param level Number of indents
+ *
+ * The output is formatted like ndict::getjson().
+ */
+template<typename T> void njson_writevalue(std::string &out,const T &value,const int &indent,const int &level){
+    if constexpr(std::is_same<T,ndict>::value){
+        njson_writedict(out,value,indent,level);
+    }
+    else if constexpr(std::is_same<T,bool>::value){
+        out+=value?"true":"false";
+    }
+    else if constexpr(std::is_integral<T>::value || std::is_floating_point<T>::value){
+        out+=std::to_string(value);
+    }
+    else if constexpr(std::is_same<T,std::string>::value){
+        ndict::quote(out,value.data(),value.size());
+    }
+    else if constexpr(njson_isvector<T>::value){
+        out+="[";
+        for(size_t i=0;i<value.size();i++){
+            if(i) out+=",";
+            njson_writevalue(out,value[i],indent,level+1);
+        }
+        out+="]";
+    }
+    else{
+        static_assert(njson_isbound<T>::value,"Type has no njson_binding");
+        out+="{\n";
+        bool first=true;
+        std::apply([&](const auto &...field){
+            ((out+=first?"":",\n",first=false,
+              out.append(indent*(level+1),' '),
+              out+="\"",out.append(field.name,field.length),out+="\" : ",
+              njson_writevalue(out,value.*(field.member),indent,level+1)),...);
+        },njson_binding<T>::fields);
+        out+=first?"":"\n";
+        out.append(indent*level,' ');
+        out+="}";
+    }
+}
+
+/*!\class njson_schema
+ * \brief Describes the expected shape of a JSON document
+ *
+ * A schema lists the members of objects with their types, and the type and
+ * optionally the length of array members. Members of an object schema are
+ * required, and other members are rejected unless explicitly allowed. A
+ * schema of type TNULL accepts any value.
+ */
+class njson_schema {
+    private:
+        ndict::type_t type;
+        std::vector<std::string> keys;
+        std::vector<njson_schema> members;
+        std::vector<njson_schema> item;
+        unsigned length=0;
+        bool extra=false;
+        friend class njson;
+    public:
+        njson_schema(const ndict::type_t &type=ndict::TOBJECT);
+        njson_schema &member(const std::string &key,const njson_schema &schema);
+        njson_schema &items(const njson_schema &schema,const unsigned &length=0);
+        njson_schema &allowextra(const bool &allow=true);
+};
+
+struct njson_projection;
+
 /*!\class njson
  * \brief Parses JSON strings to a dictionary or vice-versa
  */
 class njson {
     private:
-        std::string trim(std::string buffer);
-        std::string parsequoted(std::string buffer,const int &pos=0);
-        std::string parseunquoted(std::string buffer,const int &pos=0);
-        std::string parseblock(std::string buffer,const int &pos=0);
-        void parsearray(ndict &object,std::string buffer);
-        void parseobject(ndict &object,std::string buffer);
-        void parsevalue(ndict &object,std::string buffer);
-        ndict::type_t valuetype(std::string buffer);
+        //! Object or array being decoded
+        struct frame{
+            ndict *node;
+            bool keyed;
+            unsigned count;
+            bool packed;
+        };
+
+        //! Object or array being decoded against a schema
+        struct schemaframe{
+            ndict *node;
+            const njson_schema *schema;
+            unsigned count;
+            unsigned current;
+            unsigned next;
+            unsigned extras;
+            size_t seen;
+        };
+
+        // Decoder state, kept between calls to avoid reallocation
+        unsigned maxdepth=NJSON_MAX_DEPTH;
+        std::vector<frame> stack;
+        std::vector<schemaframe> schemastack;
+        std::vector<char> schemaseen;
+        std::vector<double> numbers;
+        std::vector<int64_t> integers;
+        std::string key;
+        void parsescalar(njson_scanner &scan,ndict &object);
+        static void assignnumber(ndict &object,const char *data,const size_t &size);
+        static void assigninteger(ndict &object,const int64_t &integer);
+        static void assigndecimal(ndict &object,const double &number);
+        ndict *parsemember(njson_scanner &scan,frame &top);
+        ndict *parsepacked(njson_scanner &scan,frame &top);
+        void unpacknumbers(njson_scanner &scan,frame &top);
+        void parse(njson_scanner &scan,ndict &object);
+        void parsedocument(njson_scanner &scan,ndict &object);
+        void parseschema(njson_scanner &scan,ndict &object,const njson_schema &schema);
+        ndict *parseschemamember(njson_scanner &scan,schemaframe &top,const njson_schema *&expect);
+        void parseschemaclose(njson_scanner &scan,schemaframe &top);
+        std::string schemapath(const size_t &depth) const;
+        void decompress(const char *data,const size_t &size,ndict &object);
+
+        // Lazy decoding
+        void lazyvalue(njson_scanner &scan,ndict &object,const std::shared_ptr<const std::string> &source);
+        static void lazymembers(ndict &node,const std::shared_ptr<const std::string> &source,const char *data,const size_t &size);
+
+        // Helpers for schemas, projections, file I/O and validation
+        static ndict::type_t peektype(const char &c);
+        static const njson_projection *projectmember(const njson_projection &node,const char *data,const size_t &size);
+        static bool projectvalue(njson_scanner &scan,ndict &object,const njson_projection &node);
+        static void writeplain(std::string &out,void *context);
+        static void writegzip(std::string &out,void *context);
+        static bool readremaining(const int &fd,std::string &buffer,size_t offset);
+        static bool isnumber(const char *data,const size_t &size);
+        static bool hascontrol(const char *data,const size_t &size);
     public:
         ndict read(const std::string &path);
+        std::vector<ndict> readall(const std::vector<std::string> &paths,const unsigned &threads=0);
+        ndict readmerged(const std::vector<std::string> &paths,const unsigned &threads=0);
         ndict decode(const std::string &json);
+        void decode(const std::string &json,ndict &object);
+        ndict decode(const std::string &json,const std::vector<std::string> &paths);
+        ndict decode(const std::string &json,const njson_schema &schema);
+        void decode(const std::string &json,const njson_schema &schema,ndict &object);
+        ndict decodelazy(const std::string &json);
+        void setdepth(const unsigned &depth);
+        njson_status validate(const char *data,const size_t &size,const njson_limits &limits=njson_limits());
+        njson_status validate(const std::string &json,const njson_limits &limits=njson_limits());
         std::string encode(const ndict &dict);
+        void write(const std::string &path,const ndict &dict);
         ndict merge(const std::string &json,const ndict &dict);
 
+        //! Decode a JSON string directly into a struct declared with njson_binding
+        template<typename T,typename=std::enable_if_t<njson_isbound<T>::value> > void decode(const std::string &json,T &object){
+            njson_scanner scan(json.data(),json.size());
+            njson_readvalue(scan,object);
+            if(!scan.done()) scan.error("Trailing characters after JSON value");
+        }
+
+        //! Encode a struct or other typed variable directly as a JSON string
+        template<typename T> std::string encode(const T &object){
+            std::string out;
+            njson_writevalue(out,object,4,0);
+            return out;
+        }
+
+    friend void njson_readdict(njson_scanner &scan,ndict &value);
 };
 
+#ifdef NDICT_HEADER_ONLY
+#include "njson.cpp"
 #endif
 
+#endif
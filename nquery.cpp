@@ -0,0 +1,386 @@
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "nquery.h"
+#include "ntrace.h"
+
+//! Skip whitespace in a query expression
+#define SKIP(E,P)       while((P)<(E).size() && (E)[P]==' ') (P)++
+
+/*!\brief Throw a compilation error
+ * \param reason Description of the error
+ * \param offset Offset into the expression
+ */
+static void fail(const std::string &reason,const size_t &offset){
+    throw nquery_exception(reason+" at offset "+std::to_string(offset));
+}
+
+/*!\brief Parse a quoted string in a query expression
+ * \param expression Query expression
+ * \param pos Offset of the opening quote, advanced past the closing quote
+ * \return Contents of the string
+ */
+static std::string parsequoted(const std::string &expression,size_t &pos){
+    char quote=expression[pos];
+    size_t end=expression.find(quote,pos+1);
+    if(end==std::string::npos) fail("Unterminated string",pos);
+    std::string result=expression.substr(pos+1,end-pos-1);
+    pos=end+1;
+    return result;
+}
+
+/*!\brief Parse an integer in a query expression
+ * \param expression Query expression
+ * \param pos Offset of the integer, advanced past it
+ * \return Parsed integer
+ */
+static int parseint(const std::string &expression,size_t &pos){
+    const char *start=expression.c_str()+pos;
+    char *end;
+    long result=strtol(start,&end,10);
+    if(end==start) fail("Expected integer",pos);
+    pos+=end-start;
+    return (int)result;
+}
+
+/*!\brief Parse a member name in a query expression
+ * \param expression Query expression
+ * \param pos Offset of the name, advanced past it
+ * \return Parsed name
+ */
+static std::string parsename(const std::string &expression,size_t &pos){
+    size_t start=pos;
+    while(pos<expression.size() && expression[pos]!='.' && expression[pos]!='[') pos++;
+    if(pos==start) fail("Expected member name",pos);
+    return expression.substr(start,pos-start);
+}
+
+/*!\brief Compile a query
+ * \param expression JSONPath expression
+ */
+nquery::nquery(const std::string &expression) : threads(1), threshold(4096) {
+    parse(expression);
+}
+
+/*!\brief Evaluate large arrays on several threads
+ * \param threads Number of threads to use, 1 to disable
+ * \param threshold Minimum number of array members before splitting
+ *
+ * Each thread evaluates the rest of the query for a contiguous range of
+ * array members. Matches are returned in the same order as when running
+ * on a single thread.
+ */
+void nquery::setparallel(const unsigned &threads,const unsigned &threshold){
+    this->threads=threads?threads:1;
+    this->threshold=threshold;
+}
+
+/*!\brief Compile an expression into query steps
+ * \param expression JSONPath expression
+ */
+void nquery::parse(const std::string &expression){
+    size_t pos=0;
+    SKIP(expression,pos);
+    if(pos>=expression.size() || expression[pos]!='$') fail("Expected $",pos);
+    pos++;
+    while(pos<expression.size()){
+        step s;
+        if(expression.compare(pos,2,"..")==0){
+            s.recursive=true;
+            pos+=2;
+            if(pos>=expression.size()) fail("Expected selector",pos);
+        }
+        else if(expression[pos]=='.'){
+            pos++;
+        }
+        else if(expression[pos]!='['){
+            fail("Expected . or [",pos);
+        }
+        if(pos<expression.size() && expression[pos]=='['){
+            pos++;
+            SKIP(expression,pos);
+            if(pos>=expression.size()) fail("Unterminated selector",pos);
+            if(expression[pos]=='*'){
+                s.kind=SWILDCARD;
+                pos++;
+            }
+            else if(expression.compare(pos,2,"?(")==0){
+                // Filter of the form ?(@.path op literal)
+                s.kind=SFILTER;
+                pos+=2;
+                SKIP(expression,pos);
+                if(pos>=expression.size() || expression[pos]!='@') fail("Expected @",pos);
+                pos++;
+                while(pos<expression.size()){
+                    if(expression[pos]=='.'){
+                        pos++;
+                        size_t start=pos;
+                        while(pos<expression.size() && (isalnum(expression[pos]) || expression[pos]=='_' || expression[pos]=='-')) pos++;
+                        if(pos==start) fail("Expected member name",pos);
+                        s.field.push_back(expression.substr(start,pos-start));
+                    }
+                    else if(expression[pos]=='['){
+                        pos++;
+                        SKIP(expression,pos);
+                        if(pos<expression.size() && (expression[pos]=='\'' || expression[pos]=='"')) s.field.push_back(parsequoted(expression,pos));
+                        else s.field.push_back(std::to_string(parseint(expression,pos)));
+                        SKIP(expression,pos);
+                        if(pos>=expression.size() || expression[pos]!=']') fail("Expected ]",pos);
+                        pos++;
+                    }
+                    else break;
+                }
+                SKIP(expression,pos);
+                static const struct{const char *text; op_t op;} ops[]={
+                    {"==",OEQ},{"!=",ONE},{"<=",OLE},{">=",OGE},{"<",OLT},{">",OGT}
+                };
+                for(const auto &o : ops){
+                    size_t length=strlen(o.text);
+                    if(expression.compare(pos,length,o.text)==0){
+                        s.op=o.op;
+                        pos+=length;
+                        break;
+                    }
+                }
+                if(s.op!=OEXISTS){
+                    SKIP(expression,pos);
+                    if(pos>=expression.size()) fail("Expected value",pos);
+                    if(expression[pos]=='\'' || expression[pos]=='"'){
+                        s.literal=parsequoted(expression,pos);
+                    }
+                    else if(expression.compare(pos,4,"true")==0){
+                        s.literal=true;
+                        pos+=4;
+                    }
+                    else if(expression.compare(pos,5,"false")==0){
+                        s.literal=false;
+                        pos+=5;
+                    }
+                    else if(expression.compare(pos,4,"null")==0){
+                        pos+=4;
+                    }
+                    else{
+                        const char *start=expression.c_str()+pos;
+                        char *end;
+                        double number=strtod(start,&end);
+                        if(end==start) fail("Expected value",pos);
+                        s.literal=number;
+                        pos+=end-start;
+                    }
+                }
+                SKIP(expression,pos);
+                if(pos>=expression.size() || expression[pos]!=')') fail("Expected )",pos);
+                pos++;
+            }
+            else if(expression[pos]=='\'' || expression[pos]=='"'){
+                // Union of member names
+                s.kind=SKEYS;
+                for(;;){
+                    SKIP(expression,pos);
+                    if(pos>=expression.size() || (expression[pos]!='\'' && expression[pos]!='"')) fail("Expected string",pos);
+                    s.keys.push_back(parsequoted(expression,pos));
+                    SKIP(expression,pos);
+                    if(pos>=expression.size() || expression[pos]!=',') break;
+                    pos++;
+                }
+            }
+            else{
+                // Union of indices, or a slice
+                s.kind=SINDICES;
+                if(expression[pos]!=':'){
+                    s.indices.push_back(parseint(expression,pos));
+                    SKIP(expression,pos);
+                }
+                if(pos<expression.size() && expression[pos]==':'){
+                    s.kind=SSLICE;
+                    s.hasstart=!s.indices.empty();
+                    if(s.hasstart) s.start=s.indices[0];
+                    s.indices.clear();
+                    pos++;
+                    SKIP(expression,pos);
+                    if(pos<expression.size() && expression[pos]!=':' && expression[pos]!=']'){
+                        s.stop=parseint(expression,pos);
+                        s.hasstop=true;
+                        SKIP(expression,pos);
+                    }
+                    if(pos<expression.size() && expression[pos]==':'){
+                        pos++;
+                        SKIP(expression,pos);
+                        if(pos<expression.size() && expression[pos]!=']') s.stride=parseint(expression,pos);
+                        if(s.stride<=0) fail("Slice step must be positive",pos);
+                        SKIP(expression,pos);
+                    }
+                }
+                else{
+                    while(pos<expression.size() && expression[pos]==','){
+                        pos++;
+                        SKIP(expression,pos);
+                        s.indices.push_back(parseint(expression,pos));
+                        SKIP(expression,pos);
+                    }
+                }
+            }
+            SKIP(expression,pos);
+            if(pos>=expression.size() || expression[pos]!=']') fail("Expected ]",pos);
+            pos++;
+        }
+        else if(pos<expression.size() && expression[pos]=='*'){
+            s.kind=SWILDCARD;
+            pos++;
+        }
+        else{
+            s.kind=SKEYS;
+            s.keys.push_back(parsename(expression,pos));
+        }
+        steps.push_back(s);
+    }
+}
+
+/*!\brief Run the query
+ * \param dict Dictionary to query
+ * \return Pointers to all matching members, in document order
+ */
+std::vector<const ndict*> nquery::run(const ndict &dict) const{
+    NTRACE_SCOPE("nquery::run");
+    std::vector<const ndict*> out;
+    eval(dict,0,out);
+    return out;
+}
+
+/*!\brief Run the query and return the first match
+ * \param dict Dictionary to query
+ * \return Pointer to the first matching member, or NULL if none match
+ */
+const ndict *nquery::first(const ndict &dict) const{
+    std::vector<const ndict*> out=run(dict);
+    return out.empty()?NULL:out[0];
+}
+
+/*!\brief Evaluate the query from a given step
+ * \param node Node to evaluate
+ * \param index Index of the step to apply
+ * \param out Vector to append matches to
+ */
+void nquery::eval(const ndict &node,const unsigned &index,std::vector<const ndict*> &out) const{
+    if(index==steps.size()){
+        out.push_back(&node);
+        return;
+    }
+    select(node,index,out);
+    if(steps[index].recursive){
+        for(const ndict &child : node.getmembers()) eval(child,index,out);
+    }
+}
+
+/*!\brief Apply a selector to the children of a node
+ * \param node Node whose children to select
+ * \param index Index of the step to apply
+ * \param out Vector to append matches to
+ */
+void nquery::select(const ndict &node,const unsigned &index,std::vector<const ndict*> &out) const{
+    const step &s=steps[index];
+    const std::vector<ndict> &items=node.getmembers();
+    int count=(int)items.size();
+    unsigned next=index+1;
+    if(s.kind==SKEYS){
+        if(node.type!=ndict::TOBJECT) return;
+        for(const std::string &key : s.keys){
+            int i=node.find(key);
+            if(i>=0) eval(items[i],next,out);
+        }
+        return;
+    }
+    if(s.kind==SINDICES){
+        if(node.type!=ndict::TARRAY) return;
+        for(int i : s.indices){
+            if(i<0) i+=count;
+            if(i>=0 && i<count) eval(items[i],next,out);
+        }
+        return;
+    }
+
+    // Wildcards, slices and filters visit a range of children
+    int start=0,stop=count,stride=1;
+    if(s.kind==SSLICE){
+        if(node.type!=ndict::TARRAY) return;
+        if(s.hasstart) start=s.start<0?std::max(count+s.start,0):std::min(s.start,count);
+        if(s.hasstop) stop=s.stop<0?std::max(count+s.stop,0):std::min(s.stop,count);
+        stride=s.stride;
+    }
+    auto visit=[&](int from,int to,std::vector<const ndict*> &result){
+        for(int i=from;i<to;i+=stride){
+            if(s.kind==SFILTER && !match(items[i],s)) continue;
+            eval(items[i],next,result);
+        }
+    };
+    int visits=stop>start?(stop-start+stride-1)/stride:0;
+    if(threads<2 || node.type!=ndict::TARRAY || (unsigned)visits<threshold){
+        visit(start,stop,out);
+        return;
+    }
+
+    // Split large arrays into contiguous ranges, one per thread
+    std::vector<std::vector<const ndict*>> results(threads);
+    std::vector<std::thread> workers;
+    int chunk=(visits+threads-1)/threads;
+    for(unsigned t=0;t<threads;t++){
+        int from=start+(int)t*chunk*stride;
+        int to=std::min(from+chunk*stride,stop);
+        if(from>=stop) break;
+        workers.emplace_back([&,from,to,t](){
+            NTRACE_SCOPE("nquery::worker");
+            visit(from,to,results[t]);
+        });
+    }
+    for(std::thread &worker : workers) worker.join();
+    for(const auto &result : results) out.insert(out.end(),result.begin(),result.end());
+}
+
+/*!\brief Test a node against a filter
+ * \param node Node to test
+ * \param s Step holding the filter
+ * \return True if the node matches
+ */
+bool nquery::match(const ndict &node,const step &s) const{
+    const ndict *value=&node;
+    for(const std::string &key : s.field){
+        if(value->type!=ndict::TOBJECT && value->type!=ndict::TARRAY) return false;
+        int i=value->find(key);
+        if(i<0) return false;
+        value=&value->getmembers()[i];
+    }
+    if(s.op==OEXISTS) return true;
+
+    // Values of different types are never equal nor ordered
+    int cmp;
+    if(value->type!=s.literal.type){
+        return s.op==ONE;
+    }
+    else if(value->type==ndict::TNUMBER){
+        double a=value->getdouble(),b=s.literal.getdouble();
+        cmp=a<b?-1:a>b?1:0;
+    }
+    else if(value->type==ndict::TSTRING){
+        cmp=value->getstring().compare(s.literal.getstring());
+    }
+    else if(value->type==ndict::TBOOL){
+        if(s.op!=OEQ && s.op!=ONE) return false;
+        cmp=value->getbool()!=s.literal.getbool();
+    }
+    else if(value->type==ndict::TNULL){
+        cmp=0;
+    }
+    else{
+        return s.op==ONE;
+    }
+    switch(s.op){
+        case OEQ: return cmp==0;
+        case ONE: return cmp!=0;
+        case OLT: return cmp<0;
+        case OLE: return cmp<=0;
+        case OGT: return cmp>0;
+        case OGE: return cmp>=0;
+        default: return false;
+    }
+}
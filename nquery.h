@@ -0,0 +1,86 @@
+/*!\file nquery.h
+ * \brief Compiled JSONPath queries over dictionary objects
+ */
+#ifndef _NQUERY_H_
+#define _NQUERY_H_
+
+#include <string>
+#include <vector>
+#include "ndict.h"
+
+/*!\class nquery_exception
+ * \brief Exception class for query compilation
+ */
+class nquery_exception: public std::exception {
+    private:
+        std::string msg;
+    public:
+        nquery_exception(const std::string &message) : msg(message) {}
+        const char *what(){return msg.c_str();}
+};
+
+/*!\class nquery
+ * \brief Implements a compiled JSONPath query
+ *
+ * Supports the following subset of JSONPath:
+ * - $ for the root object
+ * - .key and ['key'] for children, ['a','b'] for several
+ * - .* and [*] for all children
+ * - ..key, ..* and ..[] for recursive descent
+ * - [n], [-n] and [a,b] for array indices
+ * - [start:stop:step] for array slices
+ * - [?(@.key)] and [?(@.key op value)] for filters, where op is one of
+ *   == != < <= > >= and value is a number, quoted string, true, false or null
+ *
+ * A query is compiled once and can be run against any number of
+ * dictionaries. Matches are returned as pointers into the queried
+ * dictionary, which remain valid until it is modified.
+ */
+class nquery {
+    private:
+        //! Kinds of selectors
+        enum kind_t{
+            SKEYS,      //!< Named children
+            SWILDCARD,  //!< All children
+            SINDICES,   //!< Indexed array members
+            SSLICE,     //!< Slice of array members
+            SFILTER     //!< Children matching a predicate
+        };
+
+        //! Filter comparison operators
+        enum op_t{
+            OEXISTS,OEQ,ONE,OLT,OLE,OGT,OGE
+        };
+
+        //! One compiled step of the query
+        struct step{
+            kind_t kind=SWILDCARD;
+            bool recursive=false;
+            std::vector<std::string> keys;
+            std::vector<int> indices;
+            int start=0,stop=0,stride=1;
+            bool hasstart=false,hasstop=false;
+            std::vector<std::string> field;
+            op_t op=OEXISTS;
+            ndict literal;
+        };
+
+        std::vector<step> steps;
+        unsigned threads;
+        unsigned threshold;
+
+        // Compilation
+        void parse(const std::string &expression);
+
+        // Evaluation
+        void eval(const ndict &node,const unsigned &index,std::vector<const ndict*> &out) const;
+        void select(const ndict &node,const unsigned &index,std::vector<const ndict*> &out) const;
+        bool match(const ndict &node,const step &s) const;
+    public:
+        nquery(const std::string &expression);
+        void setparallel(const unsigned &threads,const unsigned &threshold=4096);
+        std::vector<const ndict*> run(const ndict &dict) const;
+        const ndict *first(const ndict &dict) const;
+};
+
+#endif
@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstddef>
+#include <new>
+#include "nshm.h"
+
+//! Number of attempts to attach while the loader replaces segments
+#define NSHM_ATTACH_RETRIES     100
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,"Shared version stamps require lock-free atomics");
+
+/*!\brief Header at the start of every data segment
+ */
+struct nshmheader{
+    char magic[8];          //!< Always "NDICTSHM"
+    uint64_t version;       //!< Version stamp of this segment
+    uint64_t size;          //!< Size of this segment in bytes
+    nshm::layout root;      //!< Root node
+};
+
+/*!\brief Get the POSIX name of a control segment
+ * \param name User supplied segment name
+ * \return Segment name with a leading slash
+ */
+static std::string controlname(const std::string &name){
+    return name.size() && name[0]=='/'?name:"/"+name;
+}
+
+/*!\brief Get the POSIX name of a data segment
+ * \param name User supplied segment name
+ * \param version Version stamp of the segment
+ * \return Segment name with a leading slash and version suffix
+ */
+static std::string dataname(const std::string &name,const uint64_t &version){
+    return controlname(name)+"."+std::to_string(version);
+}
+
+/*!\brief Reserve space in a segment
+ * \param used Number of bytes used so far, updated
+ * \param size Number of bytes to reserve
+ * \return Offset of the reserved space, aligned to 8 bytes
+ */
+static uint64_t allocate(uint64_t &used,const uint64_t &size){
+    uint64_t offset=(used+7)&~7ULL;
+    used=offset+size;
+    return offset;
+}
+
+/*!\brief Store a string as a length-prefixed, null-terminated record
+ * \param base Base address of the segment, or nullptr to only measure
+ * \param used Number of bytes used so far, updated
+ * \param str String to store
+ * \return Offset of the string record
+ */
+uint64_t nshm::storestring(char *base,uint64_t &used,const std::string &str){
+    uint64_t offset=allocate(used,sizeof(uint32_t)+str.size()+1);
+    if(base){
+        uint32_t length=str.size();
+        memcpy(base+offset,&length,sizeof(length));
+        memcpy(base+offset+sizeof(length),str.c_str(),str.size()+1);
+    }
+    return offset;
+}
+
+/*!\brief Recursively store a dictionary node
+ * \param base Base address of the segment, or nullptr to only measure
+ * \param used Number of bytes used so far, updated
+ * \param dict Dictionary node to store
+ * \param slot Offset of the layout describing the node
+ */
+void nshm::store(char *base,uint64_t &used,const ndict &dict,const uint64_t &slot){
+    layout entry;
+    entry.type=dict.type;
+    entry.count=0;
+    if(dict.type==ndict::TOBJECT || dict.type==ndict::TARRAY){
+        // Child records followed by an index of records sorted by key
+        bool keyed=(dict.type==ndict::TOBJECT);
+        const std::vector<ndict> &items=dict.getmembers();
+        entry.count=items.size();
+        entry.offset=allocate(used,entry.count*sizeof(record)+(keyed?entry.count*sizeof(uint32_t):0));
+        for(unsigned i=0;i<entry.count;i++){
+            uint64_t key=keyed?storestring(base,used,dict.getkey(i)):0;
+            if(base) memcpy(base+entry.offset+i*sizeof(record),&key,sizeof(key));
+            store(base,used,items[i],entry.offset+i*sizeof(record)+offsetof(record,child));
+        }
+        if(base && keyed){
+            std::vector<uint32_t> order(entry.count);
+            for(unsigned i=0;i<entry.count;i++) order[i]=i;
+            std::sort(order.begin(),order.end(),[&dict](const uint32_t &a,const uint32_t &b){
+                return dict.getkey(a)<dict.getkey(b);
+            });
+            memcpy(base+entry.offset+entry.count*sizeof(record),order.data(),order.size()*sizeof(uint32_t));
+        }
+    }
+    else{
+        entry.offset=storestring(base,used,dict.getstring<ndict_unchecked>());
+    }
+    if(base) memcpy(base+slot,&entry,sizeof(entry));
+}
+
+/*!\brief Publish a dictionary object in a named shared memory segment
+ * \param name Name of the segment
+ * \param dict Dictionary object to publish
+ * \return Version stamp of the published segment
+ *
+ * The dictionary is written to a new data segment, which is then made the
+ * current version. The previous data segment is unlinked, but remains
+ * mapped by readers until they refresh. Only one process may publish to a
+ * segment at a time. Throws nshm_exception upon error.
+ */
+uint64_t nshm::publish(const std::string &name,const ndict &dict){
+    // Map or create the control segment holding the current version
+    std::string path=controlname(name);
+    int fd=shm_open(path.c_str(),O_RDWR|O_CREAT,0644);
+    if(fd<0) throw nshm_exception(std::string("Failed to open shared memory segment: ")+strerror(errno));
+    struct stat info;
+    if(fstat(fd,&info)<0){
+        close(fd);
+        throw nshm_exception(std::string("Failed to stat shared memory segment: ")+strerror(errno));
+    }
+    bool created=(info.st_size==0);
+    if((size_t)info.st_size<sizeof(std::atomic<uint64_t>) && ftruncate(fd,sizeof(std::atomic<uint64_t>))<0){
+        close(fd);
+        throw nshm_exception(std::string("Failed to size shared memory segment: ")+strerror(errno));
+    }
+    void *region=mmap(nullptr,sizeof(std::atomic<uint64_t>),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if(region==MAP_FAILED) throw nshm_exception(std::string("Failed to map shared memory segment: ")+strerror(errno));
+    std::atomic<uint64_t> *current=created?new(region) std::atomic<uint64_t>(0):(std::atomic<uint64_t>*)region;
+    uint64_t previous=current->load(std::memory_order_acquire);
+    uint64_t version=previous+1;
+
+    // Measure the dictionary and write it to a new data segment
+    uint64_t size=sizeof(nshmheader);
+    store(nullptr,size,dict,offsetof(nshmheader,root));
+    std::string data=dataname(name,version);
+    fd=shm_open(data.c_str(),O_RDWR|O_CREAT|O_TRUNC,0644);
+    if(fd<0 || ftruncate(fd,size)<0){
+        std::string error=strerror(errno);
+        if(fd>=0) close(fd);
+        munmap(region,sizeof(std::atomic<uint64_t>));
+        throw nshm_exception("Failed to create shared memory segment: "+error);
+    }
+    char *base=(char*)mmap(nullptr,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if(base==MAP_FAILED){
+        munmap(region,sizeof(std::atomic<uint64_t>));
+        throw nshm_exception(std::string("Failed to map shared memory segment: ")+strerror(errno));
+    }
+    nshmheader header;
+    memcpy(header.magic,"NDICTSHM",sizeof(header.magic));
+    header.version=version;
+    header.size=size;
+    memcpy(base,&header,sizeof(header));
+    uint64_t used=sizeof(nshmheader);
+    store(base,used,dict,offsetof(nshmheader,root));
+    munmap(base,size);
+
+    // Stamp the new version and drop the previous segment
+    current->store(version,std::memory_order_release);
+    if(previous) shm_unlink(dataname(name,previous).c_str());
+    munmap(region,sizeof(std::atomic<uint64_t>));
+    return version;
+}
+
+/*!\brief Remove a published dictionary
+ * \param name Name of the segment
+ *
+ * Attached readers keep their current mapping.
+ */
+void nshm::unlink(const std::string &name){
+    std::string path=controlname(name);
+    int fd=shm_open(path.c_str(),O_RDONLY,0);
+    if(fd<0) return;
+    struct stat info;
+    void *region=MAP_FAILED;
+    if(fstat(fd,&info)==0 && (size_t)info.st_size>=sizeof(std::atomic<uint64_t>)){
+        region=mmap(nullptr,sizeof(std::atomic<uint64_t>),PROT_READ,MAP_SHARED,fd,0);
+    }
+    close(fd);
+    if(region!=MAP_FAILED){
+        uint64_t version=((const std::atomic<uint64_t>*)region)->load(std::memory_order_acquire);
+        if(version) shm_unlink(dataname(name,version).c_str());
+        munmap(region,sizeof(std::atomic<uint64_t>));
+    }
+    shm_unlink(path.c_str());
+}
+
+/*!\brief Attach to a published dictionary
+ * \param name Name of the segment
+ *
+ * Throws nshm_exception if nothing has been published under the name, or
+ * if the control segment is too small to hold a version stamp.
+ */
+nshm::nshm(const std::string &name) : name(name), control(nullptr), base(nullptr), size(0), version(0) {
+    int fd=shm_open(controlname(name).c_str(),O_RDONLY,0);
+    if(fd<0) throw nshm_exception(std::string("Failed to open shared memory segment: ")+strerror(errno));
+    // A control segment that is still being created would fault when read
+    struct stat info;
+    if(fstat(fd,&info)<0 || (size_t)info.st_size<sizeof(std::atomic<uint64_t>)){
+        close(fd);
+        throw nshm_exception("Shared memory segment is truncated");
+    }
+    void *region=mmap(nullptr,sizeof(std::atomic<uint64_t>),PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(region==MAP_FAILED) throw nshm_exception(std::string("Failed to map shared memory segment: ")+strerror(errno));
+    control=(const std::atomic<uint64_t>*)region;
+    try{
+        map();
+    }
+    catch(...){
+        munmap((void*)control,sizeof(std::atomic<uint64_t>));
+        throw;
+    }
+}
+
+/*!\brief Detach from the shared memory segments
+ */
+nshm::~nshm(){
+    unmap();
+    munmap((void*)control,sizeof(std::atomic<uint64_t>));
+}
+
+/*!\brief Map the current data segment, replacing any mapped segment
+ *
+ * Throws nshm_exception upon error.
+ */
+void nshm::map(){
+    for(int attempt=0;attempt<NSHM_ATTACH_RETRIES;attempt++){
+        // The loader may unlink the segment between reading and opening it
+        uint64_t current=control->load(std::memory_order_acquire);
+        if(!current) throw nshm_exception("No dictionary has been published to "+name);
+        int fd=shm_open(dataname(name,current).c_str(),O_RDONLY,0);
+        if(fd<0 && errno==ENOENT) continue;
+        if(fd<0) throw nshm_exception(std::string("Failed to open shared memory segment: ")+strerror(errno));
+        struct stat info;
+        if(fstat(fd,&info)<0 || (size_t)info.st_size<sizeof(nshmheader)){
+            close(fd);
+            throw nshm_exception("Shared memory segment is truncated");
+        }
+        char *region=(char*)mmap(nullptr,info.st_size,PROT_READ,MAP_SHARED,fd,0);
+        close(fd);
+        if(region==MAP_FAILED) throw nshm_exception(std::string("Failed to map shared memory segment: ")+strerror(errno));
+        const nshmheader *header=(const nshmheader*)region;
+        if(memcmp(header->magic,"NDICTSHM",sizeof(header->magic)) || header->version!=current || header->size!=(uint64_t)info.st_size){
+            munmap(region,info.st_size);
+            throw nshm_exception("Shared memory segment is not a dictionary");
+        }
+        unmap();
+        base=region;
+        size=info.st_size;
+        version=current;
+        return;
+    }
+    throw nshm_exception("Shared memory segment changed while attaching");
+}
+
+/*!\brief Unmap the current data segment
+ */
+void nshm::unmap(){
+    if(base) munmap((void*)base,size);
+    base=nullptr;
+    size=0;
+}
+
+/*!\brief Switch to the most recently published version
+ * \return true if a new version was mapped
+ *
+ * Nodes taken from the previous version become invalid.
+ */
+bool nshm::refresh(){
+    if(control->load(std::memory_order_acquire)==version) return false;
+    map();
+    return true;
+}
+
+/*!\brief Get the version stamp of the mapped segment
+ * \return Version stamp, incremented on every publish
+ */
+uint64_t nshm::getversion() const{
+    return version;
+}
+
+/*!\brief Get the root node of the mapped dictionary
+ * \return Read-only view of the root node
+ */
+nshm::node nshm::root() const{
+    return node(base,&((const nshmheader*)base)->root);
+}
+
+/*!\brief Recursively copy a node into a dictionary object
+ * \param base Base address of the segment
+ * \param data Node to copy
+ * \param dict Dictionary object to populate
+ */
+void nshm::extract(const char *base,const layout *data,ndict &dict){
+    ndict::type_t type=(ndict::type_t)data->type;
+    if(type==ndict::TOBJECT || type==ndict::TARRAY){
+        const record *records=(const record*)(base+data->offset);
+        ndict_builder::setblock(dict,type);
+        for(unsigned i=0;i<data->count;i++){
+            if(type==ndict::TOBJECT){
+                uint32_t length;
+                memcpy(&length,base+records[i].key,sizeof(length));
+                extract(base,&records[i].child,ndict_builder::setmember(dict,i,base+records[i].key+sizeof(length),length));
+            }
+            else{
+                std::string key=std::to_string(i);
+                extract(base,&records[i].child,ndict_builder::setmember(dict,i,key.data(),key.size()));
+            }
+        }
+        ndict_builder::truncate(dict,data->count);
+    }
+    else{
+        uint32_t length;
+        memcpy(&length,base+data->offset,sizeof(length));
+        ndict_builder::setvalue(dict,type,base+data->offset+sizeof(length),length);
+    }
+}
+
+/*!\brief Create a view of a node
+ * \param base Base address of the segment
+ * \param data Node layout, or nullptr for a null node
+ */
+nshm::node::node(const char *base,const layout *data) : base(base), data(data) {
+    type=data?(ndict::type_t)data->type:ndict::TNULL;
+}
+
+/*!\brief Get a string stored in the segment
+ * \param offset Offset of the string record
+ * \return Null-terminated string
+ */
+const char *nshm::node::string(const uint64_t &offset) const{
+    return base+offset+sizeof(uint32_t);
+}
+
+/*!\brief Get a string stored in the segment with its full length
+ * \param offset Offset of the string record
+ * \return Copy of the string, including any embedded null characters
+ */
+std::string nshm::node::text(const uint64_t &offset) const{
+    uint32_t length;
+    memcpy(&length,base+offset,sizeof(length));
+    return std::string(string(offset),length);
+}
+
+/*!\brief Get the child records of this node
+ * \return Pointer to the first child record
+ */
+const nshm::record *nshm::node::records() const{
+    return (const record*)(base+data->offset);
+}
+
+/*!\brief Get the raw value of a scalar
+ * \return Null-terminated value string, empty for blocks and null nodes
+ */
+const char *nshm::node::scalar() const{
+    if(!data || type==ndict::TOBJECT || type==ndict::TARRAY) return "";
+    return string(data->offset);
+}
+
+/*!\brief Get size of node
+ * \return Number of child members or array size
+ */
+unsigned nshm::node::size() const{
+    return (type==ndict::TOBJECT || type==ndict::TARRAY)?data->count:0;
+}
+
+/*!\brief Look up a keyed member by binary search of the sorted key index
+ * \param Key Key to return node for
+ * \return View of the keyed node, or a null node if not found
+ */
+nshm::node nshm::node::operator[](const std::string &Key) const{
+    if(type!=ndict::TOBJECT) return node();
+    const record *list=records();
+    const uint32_t *order=(const uint32_t*)(list+data->count);
+    unsigned low=0,high=data->count;
+    while(low<high){
+        unsigned middle=(low+high)/2;
+        uint64_t offset=list[order[middle]].key;
+        uint32_t length;
+        memcpy(&length,base+offset,sizeof(length));
+        int result=memcmp(string(offset),Key.data(),std::min<size_t>(length,Key.size()));
+        if(result==0) result=(length<Key.size())?-1:(length>Key.size());
+        if(result==0) return node(base,&list[order[middle]].child);
+        if(result<0) low=middle+1;
+        else high=middle;
+    }
+    return node();
+}
+
+/*!\brief Look up an indexed member
+ * \param Index Numerical index to return node for
+ * \return View of the indexed node, or a null node if not found
+ */
+nshm::node nshm::node::operator[](const unsigned &Index) const{
+    if(type!=ndict::TARRAY || Index>=data->count) return node();
+    return node(base,&records()[Index].child);
+}
+
+/*!\brief Check if key is present in this object
+ * \return true if key was found with a valid value
+ */
+bool nshm::node::haskey(const std::string &key) const{
+    return (*this)[key].type!=ndict::TNULL;
+}
+
+/*!\brief Get a copy of node keys for external iteration
+ * \return Copy of node keys in their original order
+ */
+std::vector<std::string> nshm::node::getkeys() const{
+    std::vector<std::string> keys;
+    for(unsigned i=0;i<size();i++){
+        keys.push_back(type==ndict::TOBJECT?text(records()[i].key):std::to_string(i));
+    }
+    return keys;
+}
+
+/*!\brief Copy this node into a regular dictionary object
+ * \return Dictionary object holding this node and its children
+ */
+ndict nshm::node::todict() const{
+    ndict dict;
+    if(data) extract(base,data,dict);
+    return dict;
+}
+
+/*!\brief Encode this node as a JSON string
+ * \param indent Number of spaces to use for indentation
+ * \return A JSON string representing this node and it's children
+ */
+std::string nshm::node::getjson(const int &indent) const{
+    return todict().getjson(indent);
+}
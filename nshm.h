@@ -0,0 +1,157 @@
+/*!\file nshm.h
+ * \brief Shares a read-only dictionary between processes through POSIX shared memory
+ */
+#ifndef _NSHM_H_
+#define _NSHM_H_
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "ndict.h"
+
+/*!\class nshm_exception
+ * \brief Exception class for shared memory handling
+ */
+class nshm_exception: public std::exception {
+    private:
+        std::string msg;
+    public:
+        nshm_exception(const std::string &message) : msg(message) {}
+        const char *what(){return msg.c_str();}
+};
+
+/*!\class nshm
+ * \brief Attaches to a dictionary published in a named shared memory segment
+ *
+ * A loader process encodes a dictionary object once with publish(), and any
+ * number of processes attach to it and read it in place. Nodes reference
+ * each other by offsets, so the segment can be mapped at any address.
+ * Publishing again writes a new segment and stamps it with a new version;
+ * attached readers keep their current version until they call refresh().
+ */
+class nshm {
+    public:
+        //! Node layout in the segment
+        struct layout{
+            uint32_t type;      //!< ndict::type_t of the node
+            uint32_t count;     //!< Number of children
+            uint64_t offset;    //!< Offset of value string or child records
+        };
+
+        //! Child record, followed by a key-sorted index after the last record
+        struct record{
+            uint64_t key;       //!< Offset of key string, 0 for array members
+            layout child;       //!< Child node
+        };
+
+        /*!\class node
+         * \brief Read-only view of a dictionary node in a shared memory segment
+         *
+         * Mirrors the const accessors of ndict. A node is only valid while
+         * the segment it was taken from is mapped, i.e. until refresh().
+         */
+        class node {
+            private:
+                const char *base;
+                const layout *data;
+                const char *string(const uint64_t &offset) const;
+                std::string text(const uint64_t &offset) const;
+                const record *records() const;
+                const char *scalar() const;
+            public:
+                node(const char *base=nullptr,const layout *data=nullptr);
+
+                //! JSON type of the node
+                ndict::type_t type;
+
+                // Value accessors, checked by an access policy like those of ndict
+                template<typename P=NDICT_POLICY> std::string getstring() const;
+                template<typename P=NDICT_POLICY> const char *getchar() const;
+                template<typename P=NDICT_POLICY> double getdouble() const;
+                template<typename P=NDICT_POLICY> bool getbool() const;
+                template<typename P=NDICT_POLICY> int getint() const;
+
+                // Array and object accessors
+                unsigned size() const;
+                bool haskey(const std::string &key) const;
+                std::vector<std::string> getkeys() const;
+                node operator[](const std::string &Key) const;
+                node operator[](const unsigned &Index) const;
+
+                // Conversion to regular dictionary objects
+                ndict todict() const;
+                std::string getjson(const int &indent=4) const;
+        };
+
+        nshm(const std::string &name);
+        ~nshm();
+        nshm(const nshm&)=delete;
+        nshm& operator=(const nshm&)=delete;
+
+        // Reader interface
+        bool refresh();
+        uint64_t getversion() const;
+        node root() const;
+
+        // Loader interface
+        static uint64_t publish(const std::string &name,const ndict &dict);
+        static void unlink(const std::string &name);
+
+    private:
+        std::string name;
+        const std::atomic<uint64_t> *control;
+        const char *base;
+        size_t size;
+        uint64_t version;
+        void map();
+        void unmap();
+        static void store(char *base,uint64_t &used,const ndict &dict,const uint64_t &slot);
+        static uint64_t storestring(char *base,uint64_t &used,const std::string &str);
+        static void extract(const char *base,const layout *data,ndict &dict);
+};
+
+/*!\brief Get node value as a string
+ * \return String representation of value, including any embedded null characters
+ */
+template<typename P> std::string nshm::node::getstring() const{
+    P::check(*this,ndict::TSTRING,"Value is not string!");
+    return type==ndict::TOBJECT || type==ndict::TARRAY || !data?std::string():text(data->offset);
+}
+
+/*!\brief Get node value as a char array
+ * \return String representation of value, valid while the segment is mapped
+ *
+ * The value ends at the first embedded null character, use getstring() for
+ * strings that may contain them.
+ */
+template<typename P> const char *nshm::node::getchar() const{
+    P::check(*this,ndict::TSTRING,"Value is not string!");
+    return scalar();
+}
+
+/*!\brief Get node value as a float
+ * \return Float representation of value (0 on failure)
+ */
+template<typename P> double nshm::node::getdouble() const{
+    P::check(*this,ndict::TNUMBER,"Value is not numeric!");
+    return atof(scalar());
+}
+
+/*!\brief Get node value as an integer
+ * \return Integer representation of value (0 on failure)
+ */
+template<typename P> int nshm::node::getint() const{
+    P::check(*this,ndict::TNUMBER,"Value is not numeric!");
+    return atoi(scalar());
+}
+
+/*!\brief Get node value as a boolean
+ * \return Boolean representation of value (false on failure)
+ */
+template<typename P> bool nshm::node::getbool() const{
+    P::check(*this,ndict::TBOOL,"Value is not boolean!");
+    const char *value=scalar();
+    return strcasecmp(value,"TRUE")==0?true:atoi(value);
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include "nsnapshot.h"
+
+/*!\brief Create a snapshot holder with an empty dictionary
+ */
+nsnapshot::nsnapshot() : current(std::make_shared<const ndict>()), version(0) {
+}
+
+/*!\brief Create a snapshot holder with an initial dictionary
+ * \param dict Dictionary object to publish as the first version
+ */
+nsnapshot::nsnapshot(const ndict &dict) : version(0) {
+    publish(dict);
+}
+
+/*!\brief Publish a new version of the dictionary
+ * \param dict Dictionary object to publish
+ *
+ * The dictionary is copied, which shares its members until the caller
+ * modifies its own copy. Structural hashes are computed before publishing,
+ * so readers may compare snapshots without writing to shared state.
+ */
+void nsnapshot::publish(const ndict &dict){
+    std::shared_ptr<const ndict> next=std::make_shared<const ndict>(dict);
+    next->hash();
+    std::atomic_store_explicit(&current,next,std::memory_order_release);
+    version.fetch_add(1,std::memory_order_release);
+}
+
+/*!\brief Get the current snapshot
+ * \return Shared pointer keeping the snapshot alive while it is held
+ */
+std::shared_ptr<const ndict> nsnapshot::get() const{
+    return std::atomic_load_explicit(&current,std::memory_order_acquire);
+}
+
+/*!\brief Get the number of published versions
+ * \return Version number, incremented on every publish
+ */
+uint64_t nsnapshot::getversion() const{
+    return version.load(std::memory_order_acquire);
+}
+
+/*!\brief Create a reader for a snapshot holder
+ * \param source Snapshot holder to read from
+ */
+nsnapshot::reader::reader(const nsnapshot &source) : source(source), version(0) {
+    version=source.getversion();
+    cached=source.get();
+}
+
+/*!\brief Get the current snapshot, refreshing it if a new version was published
+ * \return Reference to the snapshot, valid until the next call
+ */
+const ndict &nsnapshot::reader::get(){
+    uint64_t latest=source.getversion();
+    if(latest!=version){
+        version=latest;
+        cached=source.get();
+    }
+    return *cached;
+}
+
+/*!\brief Get the version of the snapshot held by this reader
+ * \return Version number of the held snapshot
+ */
+uint64_t nsnapshot::reader::getversion() const{
+    return version;
+}
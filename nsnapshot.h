@@ -0,0 +1,51 @@
+/*!\file nsnapshot.h
+ * \brief Publishes immutable dictionary snapshots to concurrent readers
+ */
+#ifndef _NSNAPSHOT_H_
+#define _NSNAPSHOT_H_
+
+#include <atomic>
+#include <memory>
+#include "ndict.h"
+
+/*!\class nsnapshot
+ * \brief Holds the current version of a shared dictionary
+ *
+ * A writer publishes new versions of a dictionary, for example after
+ * reloading a configuration file, while any number of reader threads look up
+ * values in the version they hold. Published snapshots are never modified,
+ * and are released when the last reader lets go of them.
+ */
+class nsnapshot {
+    private:
+        std::shared_ptr<const ndict> current;
+        std::atomic<uint64_t> version;
+    public:
+        nsnapshot();
+        nsnapshot(const ndict &dict);
+
+        // Publish and retrieve snapshots
+        void publish(const ndict &dict);
+        std::shared_ptr<const ndict> get() const;
+        uint64_t getversion() const;
+
+        /*!\class reader
+         * \brief Per-thread handle caching the current snapshot
+         *
+         * Checking for a new version is a single atomic load, so looking up
+         * values through a reader is wait-free until a new version has been
+         * published. A reader must only be used by one thread.
+         */
+        class reader {
+            private:
+                const nsnapshot &source;
+                std::shared_ptr<const ndict> cached;
+                uint64_t version;
+            public:
+                reader(const nsnapshot &source);
+                const ndict &get();
+                uint64_t getversion() const;
+        };
+};
+
+#endif
@@ -0,0 +1,71 @@
+/*!\file nstats.cpp
+ * \brief Optional performance counters and latency histograms for ndict and njson
+ */
+#include "nstats.h"
+
+//! Names of the counters in snapshots
+static const char *counternames[nstats::CCOUNTERS]={
+    "allocations","lookups","probes","decoded_bytes","decoded_nodes","encoded_bytes","encoded_nodes"
+};
+
+//! Names of the histograms in snapshots
+static const char *histogramnames[nstats::HHISTOGRAMS]={
+    "decode","encode","read","merge"
+};
+
+/*!\brief Check if the library was built with instrumentation
+ * \return true if counters and histograms are being updated
+ */
+bool nstats::enabled(){
+    return NDICT_STATS;
+}
+
+/*!\brief Take a snapshot of all counters and histograms
+ * \return Dictionary object suitable for encoding or exporting
+ *
+ * Counters are stored by name under "counters". Each histogram under
+ * "histograms" holds its number of samples, total time in nanoseconds and
+ * a "buckets" array of non-empty buckets, each with an exclusive upper
+ * bound "lt_ns", or -1 for the last bucket, and a sample count. Values are read individually, so a
+ * snapshot taken while other threads are running is not atomic as a whole.
+ */
+ndict nstats::snapshot(){
+    // Read everything first, as building the snapshot updates the counters
+    uint64_t counts[CCOUNTERS],histogram[HHISTOGRAMS][NSTATS_BUCKETS],sum[HHISTOGRAMS];
+    for(unsigned i=0;i<CCOUNTERS;i++) counts[i]=counters[i].load(std::memory_order_relaxed);
+    for(unsigned i=0;i<HHISTOGRAMS;i++){
+        for(unsigned j=0;j<NSTATS_BUCKETS;j++) histogram[i][j]=buckets[i][j].load(std::memory_order_relaxed);
+        sum[i]=sums[i].load(std::memory_order_relaxed);
+    }
+
+    ndict result;
+    result["enabled"]=enabled();
+    for(unsigned i=0;i<CCOUNTERS;i++){
+        result["counters"][counternames[i]]=(double)counts[i];
+    }
+    for(unsigned i=0;i<HHISTOGRAMS;i++){
+        ndict &object=result["histograms"][histogramnames[i]];
+        uint64_t total=0;
+        object["count"]=0;
+        object["sum_ns"]=(double)sum[i];
+        for(unsigned j=0,nonempty=0;j<NSTATS_BUCKETS;j++){
+            if(!histogram[i][j]) continue;
+            ndict &bucket=object["buckets"][nonempty++];
+            bucket["lt_ns"]=j==NSTATS_BUCKETS-1?-1.0:(double)(2ull<<j);
+            bucket["count"]=(double)histogram[i][j];
+            total+=histogram[i][j];
+        }
+        object["count"]=(double)total;
+    }
+    return result;
+}
+
+/*!\brief Reset all counters and histograms to zero
+ */
+void nstats::reset(){
+    for(unsigned i=0;i<CCOUNTERS;i++) counters[i].store(0,std::memory_order_relaxed);
+    for(unsigned i=0;i<HHISTOGRAMS;i++){
+        for(unsigned j=0;j<NSTATS_BUCKETS;j++) buckets[i][j].store(0,std::memory_order_relaxed);
+        sums[i].store(0,std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,105 @@
+/*!\file nstats.h
+ * \brief Optional performance counters and latency histograms for ndict and njson
+ */
+#ifndef _NSTATS_H_
+#define _NSTATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include "ndict.h"
+
+//! Collect performance counters and latency histograms, compiled out when 0
+#ifndef NDICT_STATS
+#define NDICT_STATS             0
+#endif
+
+//! Number of power of two latency buckets, the last one collects anything slower
+#define NSTATS_BUCKETS          40
+
+/*!\class nstats
+ * \brief Process wide performance counters and latency histograms
+ *
+ * Counters are updated with relaxed atomic increments, and latencies are
+ * recorded in buckets doubling in width, so instrumented code stays cheap
+ * even when used from many threads. The instrumentation points in ndict and
+ * njson only exist when the library is built with NDICT_STATS=1, otherwise
+ * every counter stays at zero.
+ */
+class nstats {
+    public:
+        //! Enumerate counters
+        enum counter_t{
+            CALLOCATIONS,       //!< Child member blocks allocated
+            CLOOKUPS,           //!< Keyed member lookups
+            CPROBES,            //!< Keys compared during lookups
+            CDECODEDBYTES,      //!< Bytes of JSON text decoded
+            CDECODEDNODES,      //!< Values decoded
+            CENCODEDBYTES,      //!< Bytes of JSON text encoded
+            CENCODEDNODES,      //!< Values encoded
+            CCOUNTERS           //!< Number of counters
+        };
+
+        //! Enumerate latency histograms
+        enum histogram_t{
+            HDECODE,            //!< njson::decode()
+            HENCODE,            //!< njson::encode() and njson::write()
+            HREAD,              //!< njson::read()
+            HMERGE,             //!< ndict::merge()
+            HHISTOGRAMS         //!< Number of histograms
+        };
+
+        //! Add to a counter
+        static void count(const counter_t &counter,const uint64_t &value){
+            counters[counter].fetch_add(value,std::memory_order_relaxed);
+        }
+
+        //! Record a latency in nanoseconds
+        static void record(const histogram_t &histogram,const uint64_t &ns){
+            unsigned bucket=63-__builtin_clzll(ns|1);
+            if(bucket>=NSTATS_BUCKETS) bucket=NSTATS_BUCKETS-1;
+            buckets[histogram][bucket].fetch_add(1,std::memory_order_relaxed);
+            sums[histogram].fetch_add(ns,std::memory_order_relaxed);
+        }
+
+        static bool enabled();
+        static ndict snapshot();
+        static void reset();
+    private:
+        inline static std::atomic<uint64_t> counters[CCOUNTERS];
+        inline static std::atomic<uint64_t> buckets[HHISTOGRAMS][NSTATS_BUCKETS];
+        inline static std::atomic<uint64_t> sums[HHISTOGRAMS];
+        inline static thread_local unsigned nesting[HHISTOGRAMS];
+        friend class nstats_timer;
+};
+
+/*!\class nstats_timer
+ * \brief Records the lifetime of a scope in a latency histogram
+ *
+ * Only the outermost timer of each histogram on a thread is recorded, so
+ * recursive and nested calls are measured once.
+ */
+class nstats_timer {
+    private:
+        nstats::histogram_t histogram;
+        std::chrono::steady_clock::time_point start;
+    public:
+        nstats_timer(const nstats::histogram_t &histogram) : histogram(histogram) {
+            if(nstats::nesting[histogram]++==0) start=std::chrono::steady_clock::now();
+        }
+        ~nstats_timer(){
+            if(--nstats::nesting[histogram]) return;
+            auto elapsed=std::chrono::steady_clock::now()-start;
+            nstats::record(histogram,std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+};
+
+#if NDICT_STATS
+#define NSTATS_COUNT(COUNTER,VALUE)     nstats::count(nstats::COUNTER,VALUE)
+#define NSTATS_TIME(HISTOGRAM)          nstats_timer nstats_timer_##HISTOGRAM(nstats::HISTOGRAM)
+#else
+#define NSTATS_COUNT(COUNTER,VALUE)     ((void)sizeof(VALUE))
+#define NSTATS_TIME(HISTOGRAM)          ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,120 @@
+/*!\file ntrace.cpp
+ * \brief Optional scoped trace events for ndict and njson, exported in Chrome trace format
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ntrace.h"
+#include "njson.h"
+
+/*!\brief Check if the library was built with trace points
+ * \return true if ndict and njson record events while tracing
+ */
+bool ntrace::enabled(){
+    return NDICT_TRACE;
+}
+
+/*!\brief Start recording events
+ */
+void ntrace::start(){
+    active.store(true,std::memory_order_relaxed);
+}
+
+/*!\brief Stop recording events
+ *
+ * Events already recorded are kept until they are cleared.
+ */
+void ntrace::stop(){
+    active.store(false,std::memory_order_relaxed);
+}
+
+/*!\brief Discard all events recorded so far
+ *
+ * The ring buffers are left in place for threads that are still running,
+ * and only events starting after this call are dumped.
+ */
+void ntrace::clear(){
+    since.store(now(),std::memory_order_relaxed);
+}
+
+/*!\brief Dump recorded events in Chrome trace_event JSON format
+ * \return JSON text, with timestamps in microseconds relative to the first event
+ *
+ * Can be called while other threads are recording. Events that are being
+ * overwritten at the same time are skipped.
+ */
+std::string ntrace::dump(){
+    //! Event copied out of a ring buffer
+    struct entry{
+        unsigned tid;
+        const char *name;
+        uint64_t start;
+        uint64_t duration;
+    };
+
+    // Copy consistent events out of all rings
+    std::vector<entry> entries;
+    std::vector<unsigned> tids;
+    uint64_t cleared=since.load(std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for(const std::shared_ptr<ring> &r : rings){
+            uint64_t head=r->head.load(std::memory_order_acquire);
+            uint64_t first=head>NTRACE_RING_SIZE?head-NTRACE_RING_SIZE:0;
+            bool any=false;
+            for(uint64_t i=first;i<head;i++){
+                const event &e=r->events[i%NTRACE_RING_SIZE];
+                uint64_t sequence=e.sequence.load(std::memory_order_acquire);
+                entry copy={r->tid,e.name.load(std::memory_order_relaxed),e.start.load(std::memory_order_relaxed),e.duration.load(std::memory_order_relaxed)};
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(sequence!=2*i+2 || e.sequence.load(std::memory_order_relaxed)!=sequence) continue;
+                if(copy.start<cleared) continue;
+                entries.push_back(copy);
+                any=true;
+            }
+            if(any) tids.push_back(r->tid);
+        }
+    }
+    uint64_t origin=UINT64_MAX;
+    for(const entry &e : entries) origin=std::min(origin,e.start);
+
+    // Format as complete events, with a name for each thread
+    std::string json="{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char buffer[256];
+    int pid=getpid();
+    bool first=true;
+    for(unsigned tid : tids){
+        snprintf(buffer,sizeof(buffer),"%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                 first?"":",",pid,tid,tid);
+        json+=buffer;
+        first=false;
+    }
+    for(const entry &e : entries){
+        json+=first?"\n{\"name\":\"":",\n{\"name\":\"";
+        json+=e.name;
+        snprintf(buffer,sizeof(buffer),"\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                 pid,e.tid,(e.start-origin)/1000.0,e.duration/1000.0);
+        json+=buffer;
+        first=false;
+    }
+    json+="\n]}\n";
+    return json;
+}
+
+/*!\brief Write recorded events to a file in Chrome trace_event JSON format
+ * \param path Path of the trace file to write
+ *
+ * Throws njson_exception upon error
+ */
+void ntrace::save(const std::string &path){
+    std::string json=dump();
+    FILE *fd=fopen(path.c_str(),"w");
+    if(!fd){
+        throw njson_exception(std::string("Failed to open output file: ")+strerror(errno));
+    }
+    bool written=fwrite(json.data(),1,json.size(),fd)==json.size();
+    if(fclose(fd)!=0 || !written){
+        throw njson_exception("Failed to write output file: "+path);
+    }
+}
@@ -0,0 +1,151 @@
+/*!\file ntrace.h
+ * \brief Optional scoped trace events for ndict and njson, exported in Chrome trace format
+ */
+#ifndef _NTRACE_H_
+#define _NTRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//! Compile trace points into ndict and njson, compiled out when 0
+#ifndef NDICT_TRACE
+#define NDICT_TRACE             0
+#endif
+
+//! Number of events kept per thread, older events are overwritten
+#define NTRACE_RING_SIZE        16384
+
+/*!\class ntrace
+ * \brief Collects timed scopes from all threads into per-thread ring buffers
+ *
+ * Each thread records into its own ring buffer without locking, and only
+ * takes a lock the first time it records an event. Rings of exited threads
+ * are reused by new threads, so memory stays bounded by the number of
+ * threads running at once, and their events share a track in the trace. When tracing is stopped
+ * a trace point costs a single relaxed atomic load. Recorded events can be
+ * dumped at any time as Chrome trace_event JSON, which can be opened in
+ * Perfetto or chrome://tracing.
+ */
+class ntrace {
+    private:
+        //! Recorded scope, guarded by a sequence number so it can be read while being overwritten
+        struct event{
+            std::atomic<uint64_t> sequence{0};
+            std::atomic<const char*> name{nullptr};
+            std::atomic<uint64_t> start{0};
+            std::atomic<uint64_t> duration{0};
+        };
+
+        //! Events recorded by one thread
+        struct ring{
+            unsigned tid;
+            std::atomic<uint64_t> head{0};
+            event events[NTRACE_RING_SIZE];
+        };
+
+        //! Ring buffer of the calling thread, handed back for reuse when the thread exits
+        struct holder{
+            ring *r;
+            holder() : r(nullptr) {}
+            ~holder(){
+                if(!r) return;
+                std::lock_guard<std::mutex> guard(lock);
+                spare.push_back(r);
+            }
+        };
+
+        inline static std::atomic<bool> active{false};
+        inline static std::atomic<uint64_t> since{0};
+        inline static std::mutex lock;
+        inline static std::vector<std::shared_ptr<ring> > rings;
+        inline static std::vector<ring*> spare;
+        inline static thread_local holder local;
+        inline static thread_local const char *open=nullptr;
+
+        //! Register a ring buffer for the calling thread, reusing one left by an exited thread
+        static ring *attach(){
+            std::lock_guard<std::mutex> guard(lock);
+            if(spare.size()){
+                local.r=spare.back();
+                spare.pop_back();
+                return local.r;
+            }
+            rings.push_back(std::make_shared<ring>());
+            rings.back()->tid=rings.size();
+            return local.r=rings.back().get();
+        }
+    public:
+        //! Check if events are being recorded
+        static bool tracing(){
+            return active.load(std::memory_order_relaxed);
+        }
+
+        //! Get a monotonic timestamp in nanoseconds
+        static uint64_t now(){
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        //! Record a finished scope for the calling thread
+        static void record(const char *name,const uint64_t &start,const uint64_t &duration){
+            ring *r=local.r?local.r:attach();
+            uint64_t head=r->head.load(std::memory_order_relaxed);
+            event &e=r->events[head%NTRACE_RING_SIZE];
+            e.sequence.store(2*head+1,std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            e.name.store(name,std::memory_order_relaxed);
+            e.start.store(start,std::memory_order_relaxed);
+            e.duration.store(duration,std::memory_order_relaxed);
+            e.sequence.store(2*head+2,std::memory_order_release);
+            r->head.store(head+1,std::memory_order_release);
+        }
+
+        static bool enabled();
+        static void start();
+        static void stop();
+        static void clear();
+        static std::string dump();
+        static void save(const std::string &path);
+        friend class ntrace_scope;
+};
+
+/*!\class ntrace_scope
+ * \brief Records the lifetime of a scope as a trace event
+ *
+ * Names must be string literals without characters that need escaping in
+ * JSON, as only the pointer is stored. Recursive scopes directly nested in
+ * a scope of the same name are recorded once.
+ */
+class ntrace_scope {
+    private:
+        const char *name=nullptr;
+        const char *parent;
+        uint64_t start;
+    public:
+        ntrace_scope(const char *name){
+            if(!ntrace::tracing()) return;
+            parent=ntrace::open;
+            if(parent==name) return;
+            this->name=ntrace::open=name;
+            start=ntrace::now();
+        }
+        ~ntrace_scope(){
+            if(!name) return;
+            ntrace::record(name,start,ntrace::now()-start);
+            ntrace::open=parent;
+        }
+};
+
+#if NDICT_TRACE
+#define NTRACE_JOIN(A,B)        A##B
+#define NTRACE_NAME(LINE)       NTRACE_JOIN(ntrace_scope_,LINE)
+#define NTRACE_SCOPE(NAME)      ntrace_scope NTRACE_NAME(__LINE__)(NAME)
+#else
+#define NTRACE_SCOPE(NAME)      ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "nwatch.h"
+#include "ntrace.h"
+
+//! Events signalling that the watched file has a new version
+#define NWATCH_EVENTS           (IN_CLOSE_WRITE|IN_MOVED_TO)
+
+/*!\brief Read a JSON file and start watching it for changes
+ * \param path Path of the JSON file
+ *
+ * The directory holding the file is watched rather than the file itself, so
+ * changes are also seen when editors replace the file by renaming another
+ * one over it. Throws nwatch_exception if the watch cannot be set up, and
+ * njson_exception if the file cannot be read.
+ */
+nwatch::nwatch(const std::string &path) : path(path), fd(-1), wd(-1), next(1) {
+    size_t slash=path.rfind('/');
+    std::string directory=slash==std::string::npos?".":slash==0?"/":path.substr(0,slash);
+    name=slash==std::string::npos?path:path.substr(slash+1);
+    fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if(fd<0) throw nwatch_exception(std::string("Failed to initialize inotify: ")+strerror(errno));
+    wd=inotify_add_watch(fd,directory.c_str(),NWATCH_EVENTS);
+    if(wd<0){
+        std::string error=strerror(errno);
+        close(fd);
+        throw nwatch_exception("Failed to watch "+directory+": "+error);
+    }
+    try{
+        live=json.read(path);
+    }
+    catch(...){
+        close(fd);
+        throw;
+    }
+}
+
+/*!\brief Stop watching the file
+ */
+nwatch::~nwatch(){
+    close(fd);
+}
+
+/*!\brief Get the live dictionary
+ * \return Reference to the dictionary, updated in place by poll() and reload()
+ */
+const ndict &nwatch::get() const{
+    return live;
+}
+
+/*!\brief Get the inotify descriptor
+ * \return Descriptor becoming readable when the directory of the file changes
+ */
+int nwatch::getfd() const{
+    return fd;
+}
+
+/*!\brief Register a callback for changes below a path
+ * \param pointer JSON pointer to watch, an empty string for the whole document
+ * \param callback Function called with the pointer and its new value
+ * \return Subscription id for unsubscribe()
+ *
+ * The callback is called when a reload changes the node at the pointer, one
+ * of its descendants, or one of its ancestors.
+ */
+unsigned nwatch::subscribe(const std::string &pointer,const callback_t &callback){
+    subscribers.push_back({next,pointer,ndict::splitpointer(pointer),callback});
+    return next++;
+}
+
+/*!\brief Remove a change callback
+ * \param id Subscription id returned by subscribe()
+ * \return true if the subscription existed
+ */
+bool nwatch::unsubscribe(const unsigned &id){
+    for(unsigned i=0;i<subscribers.size();i++){
+        if(subscribers[i].id==id){
+            subscribers.erase(subscribers.begin()+i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!\brief Drain queued inotify events
+ * \return true if any of them concerns the watched file
+ */
+bool nwatch::pending(){
+    alignas(struct inotify_event) char buffer[4096];
+    bool changed=false;
+    for(;;){
+        ssize_t size=read(fd,buffer,sizeof(buffer));
+        if(size<=0) break;
+        for(char *ptr=buffer;ptr<buffer+size;){
+            const struct inotify_event *event=(const struct inotify_event*)ptr;
+            if(event->mask&IN_Q_OVERFLOW) changed=true;
+            if(event->len && name==event->name) changed=true;
+            ptr+=sizeof(struct inotify_event)+event->len;
+        }
+    }
+    return changed;
+}
+
+/*!\brief Wait for the file to change and apply the changes
+ * \param timeout Milliseconds to wait, 0 to only check, -1 to wait forever
+ * \return true if the live dictionary was changed
+ *
+ * Events arriving together are coalesced into a single reload. Throws
+ * njson_exception if the new version cannot be parsed, in which case the
+ * live dictionary is left as it was and the next change is picked up again.
+ */
+bool nwatch::poll(const int &timeout){
+    struct pollfd request={fd,POLLIN,0};
+    int ready=::poll(&request,1,timeout);
+    if(ready<0 && errno!=EINTR) throw nwatch_exception(std::string("Failed to wait for changes: ")+strerror(errno));
+    if(ready<=0 || !pending()) return false;
+    return reload();
+}
+
+/*!\brief Read the file again and apply the differences to the live dictionary
+ * \return true if the live dictionary was changed
+ *
+ * Throws njson_exception if the file cannot be read or parsed.
+ */
+bool nwatch::reload(){
+    NTRACE_SCOPE("nwatch::reload");
+    ndict patch=live.diff(json.read(path));
+    if(patch.type==ndict::TNULL) return false;
+    live.apply(patch);
+    notify(patch);
+    return true;
+}
+
+/*!\brief Call the subscribers whose paths are touched by a patch
+ * \param patch Patch applied to the live dictionary
+ */
+void nwatch::notify(const ndict &patch){
+    // Collect matching subscribers first, callbacks may unsubscribe
+    std::vector<std::vector<std::string> > changes;
+    for(unsigned i=0;i<patch.size();i++){
+        changes.push_back(ndict::splitpointer(patch[i]["path"].getstring()));
+    }
+    std::vector<subscriber> matched;
+    for(const subscriber &s : subscribers){
+        for(const std::vector<std::string> &change : changes){
+            size_t common=std::min(change.size(),s.path.size());
+            if(std::equal(change.begin(),change.begin()+common,s.path.begin())){
+                matched.push_back(s);
+                break;
+            }
+        }
+    }
+
+    // Pass the new value, or null if the path no longer exists
+    const ndict removed;
+    for(const subscriber &s : matched){
+        const ndict *node=live.lookup(s.path);
+        s.callback(s.pointer,node?*node:removed);
+    }
+}
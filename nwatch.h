@@ -0,0 +1,79 @@
+/*!\file nwatch.h
+ * \brief Watches a JSON file and applies changes to a live dictionary in place
+ */
+#ifndef _NWATCH_H_
+#define _NWATCH_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "ndict.h"
+#include "njson.h"
+
+/*!\class nwatch_exception
+ * \brief Exception class for file watching
+ */
+class nwatch_exception: public std::exception {
+    private:
+        std::string msg;
+    public:
+        nwatch_exception(const std::string &message) : msg(message) {}
+        const char *what(){return msg.c_str();}
+};
+
+/*!\class nwatch
+ * \brief Keeps a dictionary in sync with a JSON file using inotify
+ *
+ * When the file is written or replaced, it is read again and compared with
+ * the live dictionary, and only the subtrees that differ are patched. Nodes
+ * outside the changed branches are left in place, so references into them
+ * stay valid as long as the live dictionary is not copied and no members are
+ * added to their parent. Subscribers registered on a JSON pointer are called
+ * once per reload touching their path.
+ *
+ * Changes are picked up by the thread calling poll(), which is also the
+ * thread running the callbacks. The watch descriptor can be added to an
+ * existing event loop with getfd().
+ */
+class nwatch {
+    public:
+        //! Callback receiving the subscribed pointer and its new value, null if removed
+        typedef std::function<void(const std::string &pointer,const ndict &value)> callback_t;
+    private:
+        //! Registered change callback
+        struct subscriber{
+            unsigned id;
+            std::string pointer;
+            std::vector<std::string> path;
+            callback_t callback;
+        };
+        std::string path;
+        std::string name;
+        int fd;
+        int wd;
+        njson json;
+        ndict live;
+        std::vector<subscriber> subscribers;
+        unsigned next;
+        bool pending();
+        void notify(const ndict &patch);
+    public:
+        nwatch(const std::string &path);
+        ~nwatch();
+        nwatch(const nwatch&)=delete;
+        nwatch &operator=(const nwatch&)=delete;
+
+        // Live dictionary and watch descriptor
+        const ndict &get() const;
+        int getfd() const;
+
+        // Change notifications
+        unsigned subscribe(const std::string &pointer,const callback_t &callback);
+        bool unsubscribe(const unsigned &id);
+
+        // Pick up changes
+        bool poll(const int &timeout=0);
+        bool reload();
+};
+
+#endif
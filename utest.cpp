@@ -1,17 +1,53 @@
 /*!\file utest.cpp
  * \brief Unit tests for ndict
  */
+#include <signal.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <string>
+#include <cmath>
 #include <cstring>
+#include <thread>
 #include <vector>
 #include "ndict.h"
 #include "njson.h"
+#include "nsnapshot.h"
+#include "nconcurrent.h"
+#include "nshm.h"
+#include "nquery.h"
+#include "nstats.h"
+#include "ntrace.h"
+#include "nwatch.h"
 
 int upassed=0;
 int ufailed=0;
 
+//! Nested struct for binding tests
+struct upoint{
+    int x=0;
+    int y=0;
+};
+NJSON_BINDING(upoint,NJSON_FIELD(upoint,x),NJSON_FIELD(upoint,y))
+
+//! Struct for binding tests
+struct umessage{
+    std::string name;
+    unsigned id=0;
+    double ratio=0;
+    bool enabled=false;
+    upoint origin;
+    std::vector<upoint> path;
+    std::vector<std::string> tags;
+    ndict extra;
+};
+NJSON_BINDING(umessage,NJSON_FIELD(umessage,name),NJSON_FIELD(umessage,id),NJSON_FIELD(umessage,ratio),
+    NJSON_FIELD(umessage,enabled),NJSON_FIELD(umessage,origin),NJSON_FIELD(umessage,path),
+    NJSON_FIELD(umessage,tags),njson_bind("meta",&umessage::extra))
+
 /*!\brief Simplistic unittest
  * \param Name Name of the test
  * \param Result True if the test passed
@@ -152,7 +188,7 @@ void test_json_string(){
     test("Parsed bool item",object["bool"].getbool()==true);
     test("Parsed vanilla string item",object["string"].getstring()=="string");
     test("Parsed string item with space",object["sstring"].getstring()=="st ring");
-    test("Parsed string item with escape",object["qstring"].getstring()=="st\\\"ring");
+    test("Parsed string item with escape",object["qstring"].getstring()=="st\"ring");
     test("Parsed integer item",object["int"].getint()==123);
     test("Parsed float item",object["float"].getdouble()==123.456);
     test("Parsed integer array of N items",object["intarray"].size()==5);
@@ -227,7 +263,7 @@ void test_json_file(){
     test("Parsed bool item",object["bool"].getbool()==true);
     test("Parsed vanilla string item",object["string"].getstring()=="string");
     test("Parsed string item with space",object["sstring"].getstring()=="st ring");
-    test("Parsed string item with escape",object["qstring"].getstring()=="st\\\"ring");
+    test("Parsed string item with escape",object["qstring"].getstring()=="st\"ring");
     test("Parsed integer item",object["int"].getint()==123);
     test("Parsed float item",object["float"].getdouble()==123.456);
     test("Parsed integer array of N items",object["intarray"].size()==5);
@@ -299,6 +335,13 @@ void test_encode_decode(){
     test("Reencoded nested sub object second value",object["outer"]["inner"]["value2"].getstring()=="value2");
     test("Reencoded nested sub object third value",object["outer"]["inner"]["value3"].getstring()=="value3");
     test("Reencoded nested sub object has null-object",object["outer"]["inner"].size()==4);
+
+    // Encode scalars on their own
+    ndict scalars=json.decode("{\"text\" : \"say \\\"hi\\\"\", \"number\" : 123, \"flag\" : true}");
+    std::string chunked;
+    scalars["text"].getjson(chunked,nullptr,nullptr);
+    test("Scalar string encodes as JSON string",scalars["text"].getjson()=="\"say \\\"hi\\\"\"" && chunked==scalars["text"].getjson());
+    test("Scalar number and bool encode as JSON values",scalars["number"].getjson()=="123" && scalars["flag"].getjson()=="true");
 }
 
 /*!\brief Test json-dictionary merging
@@ -405,6 +448,8 @@ void test_error(){
             "}\n";
         object=json.decode(text);
         test("Can decode json with trailing comma",object.size()==5);
+        object=json.decode("{\"numbers\" : [1,2,], \"strings\" : [\"a\",]}");
+        test("Can decode arrays with trailing comma",object["numbers"].size()==2 && object["strings"].size()==1);
     }
 
     // Test encoding with trailing trailing junk
@@ -463,8 +508,1601 @@ void test_error(){
     }
 }
 
+/*!\brief Test structural diff and patching
+ */
+void test_diff(){
+    // Stage two revisions of a dictionary
+    printf("\nRunning diff and patch test:\n");
+    ndict source;
+    source["string"]="string";
+    source["int"]=123;
+    source["removed"]=true;
+    source["outer"]["inner"]["value1"]="value1";
+    source["outer"]["inner"]["value2"]="value2";
+    source["shrink"][0]=0;
+    source["shrink"][1]=1;
+    source["shrink"][2]=2;
+    source["grow"][0]="a";
+    ndict target=source;
+    target["int"]=456;
+    target.erase("removed");
+    target["added"]["value"]=1.5;
+    target["outer"]["inner"]["value2"]="changed";
+    target["outer"]["inner"]["sl/sh"]="escaped";
+    target["shrink"].erase(2u);
+    target["grow"][1]="b";
+    target["grow"][2]="c";
+
+    // Test diff
+    ndict same=source.diff(source);
+    test("Diff of identical dictionaries is empty",same.size()==0);
+    ndict patch=source.diff(target);
+    test("Diff has N operations",patch.size()==8);
+    test("Diff removes deleted keys",patch[0]["op"].getstring()=="remove" && patch[0]["path"].getstring()=="/removed");
+    test("Diff replaces changed values",patch[1]["op"].getstring()=="replace" && patch[1]["path"].getstring()=="/int");
+    test("Diff carries replaced value",patch[1]["value"].getint()==456);
+    test("Diff recurses into changed objects",patch[2]["path"].getstring()=="/outer/inner/value2");
+    test("Diff escapes keys in paths",patch[3]["path"].getstring()=="/outer/inner/sl~1sh");
+    test("Diff removes array tail",patch[4]["op"].getstring()=="remove" && patch[4]["path"].getstring()=="/shrink/2");
+    test("Diff appends array members",patch[6]["op"].getstring()=="add" && patch[6]["path"].getstring()=="/grow/2");
+    test("Diff adds new subtrees",patch[7]["value"]["value"].getdouble()==1.5);
+    {
+        // A reference held across hashing leaves the parent hashes stale
+        ndict before,after;
+        before["outer"]["value"]=1;
+        after["outer"]["value"]=1;
+        ndict &value=after["outer"]["value"];
+        test("Stale hashes match before the change",before.hash()==after.hash());
+        value=2;
+        ndict stale=before.diff(after);
+        test("Diff confirms matching hashes by comparison",stale.size()==1 && stale[0]["path"].getstring()=="/outer/value");
+    }
+
+    // Test patching
+    ndict patched=source;
+    patched.apply(patch);
+    test("Patched dictionary matches target",patched.getjson()==target.getjson());
+    test("Patched dictionary has no further diff",patched.diff(target).size()==0);
+    {
+        ndict ops;
+        ops[0]["op"]="add";
+        ops[0]["path"]="/grow/0";
+        ops[0]["value"]="z";
+        ops[1]["op"]="move";
+        ops[1]["from"]="/string";
+        ops[1]["path"]="/moved";
+        ops[2]["op"]="copy";
+        ops[2]["from"]="/int";
+        ops[2]["path"]="/copied";
+        ops[3]["op"]="test";
+        ops[3]["path"]="/copied";
+        ops[3]["value"]=456;
+        patched.apply(ops);
+        test("Patch inserts into arrays",patched["grow"].size()==4 && patched["grow"][0].getstring()=="z" && patched["grow"][3].getstring()=="c");
+        test("Patch moves values",patched["moved"].getstring()=="string" && !patched.haskey("string"));
+        test("Patch copies values",patched["copied"].getint()==456);
+    }
+    {
+        bool result=false;
+        ndict ops;
+        ops[0]["op"]="test";
+        ops[0]["path"]="/int";
+        ops[0]["value"]=0;
+        try{
+            patched.apply(ops);
+        }
+        catch(ndict_exception &e){
+            result=true;
+        }
+        test("Failing patch test throws exception",result);
+    }
+}
+
+/*!\brief Test structural hashing and deep comparison
+ */
+void test_hash(){
+    // Stage two equal dictionaries built in different order
+    printf("\nRunning hashing and comparison test:\n");
+    ndict first,second;
+    first["string"]="string";
+    first["int"]=123;
+    first["outer"]["inner"]["value1"]="value1";
+    first["array"][0]=1;
+    first["array"][1]=2;
+    second["outer"]["inner"]["value1"]="value1";
+    second["array"][0]=1;
+    second["array"][1]=2;
+    second["int"]=123;
+    second["string"]="string";
+
+    // Test hashing and comparison
+    test("Equal dictionaries have equal hashes",first.hash()==second.hash());
+    test("Equal dictionaries compare equal",first==second);
+    test("Dictionary copy compares equal",ndict(first)==first);
+    uint64_t hash=first.hash();
+    test("Cached hash is stable",first.hash()==hash);
+    first["outer"]["inner"]["value1"]="changed";
+    test("Nested assignment invalidates hash",first.hash()!=hash);
+    test("Changed dictionaries compare unequal",first!=second);
+    first["outer"]["inner"]["value1"]="value1";
+    test("Restored dictionary has original hash",first.hash()==hash && first==second);
+    second["array"][0]=2;
+    second["array"][1]=1;
+    test("Array members are compared by position",first.hash()!=second.hash() && first!=second);
+    second["array"].clear();
+    test("Clear invalidates hash",second["array"].hash()==ndict().hash());
+    ndict number,text;
+    number=1;
+    text="1";
+    test("Values of different types compare unequal",number!=text);
+
+    // Test writes through held references to nested members
+    ndict held,expected;
+    ndict &member=held["k"];
+    member["v"]=1;
+    held.hash();
+    member["v"]=2;
+    expected["k"]["v"]=2;
+    test("Writes through held references invalidate parent hashes",held.hash()==expected.hash() && held==expected);
+    ndict &leaf=held["outer"]["inner"];
+    for(unsigned i=0;i<16;i++) held["key"+std::to_string(i)]=i;
+    leaf=3;
+    expected=held;
+    expected["outer"]["inner"]=4;
+    held.hash();
+    leaf=4;
+    test("Held references invalidate parents after these are moved",held.hash()==expected.hash() && held==expected);
+}
+
+/*!\brief Test memoized json encoding
+ */
+void test_json_cache(){
+    // Stage a dictionary with json caching enabled
+    printf("\nRunning json caching test:\n");
+    ndict object;
+    object["string"]="string";
+    object["status"]["cpu"]["load"]=0.5;
+    object["status"]["cpu"]["cores"]=4;
+    object["status"]["disk"]["free"]=100;
+    object["array"][0]["value"]=1;
+    object["array"][1]["value"]=2;
+    ndict reference=object;
+    object.cachejson(true);
+
+    // Test cached encoding against uncached encoding
+    njson json;
+    test("Cached encoding matches uncached encoding",json.encode(object)==reference.getjson());
+    test("Repeated cached encoding is stable",json.encode(object)==reference.getjson());
+    object["status"]["cpu"]["load"]=0.75;
+    reference["status"]["cpu"]["load"]=0.75;
+    test("Cached encoding reflects nested assignment",json.encode(object)==reference.getjson());
+    object["array"][1]["value"]=3;
+    reference["array"][1]["value"]=3;
+    test("Cached encoding reflects array member assignment",json.encode(object)==reference.getjson());
+    object["status"]["disk"].clear();
+    reference["status"]["disk"].clear();
+    test("Cached encoding reflects cleared members",object.getjson()==reference.getjson());
+    test("Cached encoding honours indentation",object.getjson(2)==reference.getjson(2));
+    ndict &load=object["status"]["cpu"]["load"];
+    object.getjson();
+    load=1;
+    reference["status"]["cpu"]["load"]=1;
+    test("Cached encoding reflects writes through held references",object.getjson()==reference.getjson());
+
+    // Test concurrent encoding of copies sharing cached fragments
+    ndict shared=object;
+    std::vector<std::string> encoded(4);
+    std::vector<std::thread> threads;
+    for(unsigned i=0;i<encoded.size();i++){
+        threads.push_back(std::thread([&,i](){
+            ndict copy=shared;
+            for(unsigned j=0;j<100;j++) encoded[i]=copy.getjson(i%2?2:0);
+        }));
+    }
+    for(std::thread &thread : threads) thread.join();
+    bool same=true;
+    for(unsigned i=0;i<encoded.size();i++) same&=encoded[i]==reference.getjson(i%2?2:0);
+    test("Copies are encoded concurrently from shared fragments",same);
+    object.cachejson(false);
+    test("Disabled caching matches uncached encoding",object.getjson()==reference.getjson());
+}
+
+/*!\brief Test copy-on-write sharing between copies
+ */
+void test_cow(){
+    // Stage a dictionary and a few copies of it
+    printf("\nRunning copy-on-write test:\n");
+    ndict object;
+    object["string"]="string";
+    object["outer"]["inner"]["value1"]="value1";
+    object["outer"]["inner"]["value2"]="value2";
+    object["outer"]["sibling"]["value"]=1;
+    object["array"][0]=0;
+    object["array"][1]=1;
+    ndict copy=object;
+    ndict second=copy;
+
+    // Test that modifications do not leak between copies
+    test("Copy compares equal to original",copy==object && second==object);
+    copy["outer"]["inner"]["value1"]="changed";
+    test("Modified copy has new value",copy["outer"]["inner"]["value1"].getstring()=="changed");
+    test("Original retains value after copy is modified",object["outer"]["inner"]["value1"].getstring()=="value1");
+    test("Second copy retains value after copy is modified",second["outer"]["inner"]["value1"].getstring()=="value1");
+    object["array"][1]=5;
+    test("Copies retain array values after original is modified",copy["array"][1].getint()==1 && second["array"][1].getint()==1);
+    object["outer"]["sibling"].clear();
+    test("Copies retain nested objects after original is cleared",copy["outer"]["sibling"]["value"].getint()==1);
+    second.erase("string");
+    test("Original retains keys erased from copy",object.haskey("string") && !second.haskey("string"));
+    copy.merge(object);
+    test("Merging into a copy leaves the source intact",copy["array"][1].getint()==5 && object["outer"]["inner"]["value1"].getstring()=="value1");
+    ndict patched=second;
+    patched.apply(second.diff(object));
+    test("Patching a copy leaves the source intact",patched==object && !second.haskey("string"));
+    ndict &held=object["outer"]["inner"]["value2"];
+    ndict detached=object;
+    held="through reference";
+    test("Copies are unaffected by references held into the original",detached["outer"]["inner"]["value2"].getstring()=="value2" && object["outer"]["inner"]["value2"].getstring()=="through reference");
+    ndict &array=detached["array"];
+    ndict reassigned;
+    reassigned=detached;
+    array[0]=7;
+    test("Assigned copies are unaffected by references held into the original",reassigned["array"][0].getint()==0 && detached["array"][0].getint()==7);
+    held="value2";
+
+    // Read members without copying, and build them in place
+    const ndict &outer=object["outer"];
+    test("Read-only member access",outer.getmembers().size()==2 && outer.getkey(1)=="sibling" && outer.find("inner")==0);
+    const ndict *found=object.lookup(ndict::splitpointer("/outer/inner/value2"));
+    test("JSON pointer lookup",found && found->getstring()=="value2" && !object.lookup(ndict::splitpointer("/outer/missing")));
+    ndict built=object;
+    ndict_builder::setblock(built,ndict::TOBJECT);
+    ndict_builder::setvalue(ndict_builder::setmember(built,0,"first",5),ndict::TNUMBER,"1",1);
+    ndict_builder::setmember(built,1,"second",6)=object["outer"];
+    ndict_builder::truncate(built,2);
+    test("Members built in place",built.size()==2 && built["first"].getint()==1 && built["second"]["inner"]["value2"].getstring()=="value2");
+    test("Building in place leaves copies intact",object.size()==3 && object.haskey("string") && !object.haskey("first"));
+}
+
+/*!\brief Test snapshot publishing
+ */
+void test_snapshot(){
+    // Stage a snapshot holder and a reader
+    printf("\nRunning snapshot publishing test:\n");
+    ndict config;
+    config["version"]=1;
+    config["outer"]["value"]="first";
+    nsnapshot snapshot(config);
+    nsnapshot::reader reader(snapshot);
+
+    // Test publishing
+    test("Reader sees initial snapshot",reader.get()["version"].getint()==1);
+    const ndict &held=reader.get();
+    std::shared_ptr<const ndict> pinned=snapshot.get();
+    config["version"]=2;
+    config["outer"]["value"]="second";
+    test("Modifying the source does not affect the snapshot",held["outer"]["value"].getstring()=="first");
+    snapshot.publish(config);
+    test("Publishing increments version",snapshot.getversion()==2);
+    test("Reader sees published snapshot",reader.get()["version"].getint()==2 && reader.getversion()==2);
+    test("Pinned snapshot outlives publishing",(*pinned)["outer"]["value"].getstring()=="first");
+    test("Read-only lookup of missing keys yields null",reader.get()["missing"]["value"].type==ndict::TNULL);
+    ndict &source=config["outer"]["value"];
+    snapshot.publish(config);
+    source="changed";
+    test("Published snapshot is unaffected by references into the source",reader.get()["outer"]["value"].getstring()=="second");
+
+    // Test concurrent readers during reloads
+    config["outer"]["value"]="2";
+    snapshot.publish(config);
+    std::atomic<bool> consistent(true);
+    std::vector<std::thread> threads;
+    for(int i=0;i<4;i++){
+        threads.push_back(std::thread([&](){
+            nsnapshot::reader local(snapshot);
+            for(int j=0;j<20000;j++){
+                const ndict &cfg=local.get();
+                if(cfg["outer"]["value"].getstring()!=std::to_string(cfg["version"].getint())) consistent=false;
+            }
+        }));
+    }
+    for(int i=3;i<200;i++){
+        ndict next;
+        next["version"]=i;
+        next["outer"]["value"]=std::to_string(i);
+        snapshot.publish(next);
+    }
+    for(unsigned i=0;i<threads.size();i++) threads[i].join();
+    test("Concurrent readers see consistent snapshots",consistent);
+}
+
+/*!\brief Test concurrent object
+ */
+void test_concurrent(){
+    // Stage a concurrent object
+    printf("\nRunning concurrent object test:\n");
+    nconcurrent object(8);
+    ndict value;
+    value["name"]="session";
+    object.set("string","string");
+    object.set("object",value);
+
+    // Test single-key operations
+    test("Concurrent object has N keys",object.size()==2);
+    test("Concurrent object string value",object.get("string").getstring()=="string");
+    test("Concurrent object nested value",object.get("object")["name"].getstring()=="session");
+    test("Concurrent object missing value is null",object.get("missing").type==ndict::TNULL && !object.haskey("missing"));
+    test("Exchange returns previous value",object.exchange("string","other").getstring()=="string");
+    test("Compare-exchange fails on mismatch",!object.compareexchange("string",ndict(),ndict()) && object.get("string").getstring()=="other");
+    ndict expected,desired;
+    expected="other";
+    desired="third";
+    test("Compare-exchange succeeds on match",object.compareexchange("string",expected,desired) && object.get("string").getstring()=="third");
+    test("Compare-exchange inserts unset keys",object.compareexchange("new",ndict(),desired) && object.haskey("new"));
+    object.update("object",[](ndict &value){value["count"]=5;});
+    test("Update modifies value in place",object.get("object")["count"].getint()==5);
+    test("Erase removes keys",object.erase("new") && !object.haskey("new"));
+
+    // Test concurrent counters and snapshots
+    std::vector<std::thread> threads;
+    for(int i=0;i<4;i++){
+        threads.push_back(std::thread([&](){
+            for(int j=0;j<10000;j++){
+                object.increment("counter"+std::to_string(j%10));
+            }
+        }));
+    }
+    for(unsigned i=0;i<threads.size();i++) threads[i].join();
+    ndict snapshot=object.snapshot();
+    int total=0;
+    for(int i=0;i<10;i++) total+=snapshot["counter"+std::to_string(i)].getint();
+    test("Concurrent increments are atomic",total==40000);
+    test("Snapshot holds every key",snapshot.size()==12);
+    test("Snapshot keys are sorted",snapshot.getkeys()[0]=="counter0" && snapshot.getkeys()[11]=="string");
+    test("Snapshot encodes as json",object.getjson()==snapshot.getjson());
+
+    // Readers compare and encode shared values while writers replace them
+    ndict document;
+    document["revision"]=0;
+    for(unsigned i=0;i<100;i++){
+        document["items"][i]["id"]=(int)i;
+        document["items"][i]["name"]="item"+std::to_string(i);
+    }
+    object.set("document",document);
+    const ndict &items=document["items"];
+    std::string encoded=items.getjson();
+    std::atomic<int> swaps{0};
+    std::atomic<bool> consistent{true};
+    threads.clear();
+    for(int i=0;i<4;i++){
+        threads.push_back(std::thread([&,i](){
+            for(int j=0;j<200;j++){
+                const ndict current=object.get("document");
+                if(!(current["items"]==items) || current["items"].getjson()!=encoded) consistent=false;
+                if(i%2){
+                    ndict desired=current;
+                    desired["revision"]=current["revision"].getint()+1;
+                    if(object.compareexchange("document",current,desired)) swaps++;
+                }
+            }
+        }));
+    }
+    for(unsigned i=0;i<threads.size();i++) threads[i].join();
+    test("Shared values are read and replaced consistently",consistent && object.get("document")["revision"].getint()==swaps);
+}
+
+/*!\brief Test shared memory publishing
+ */
+void test_shm(){
+    // Stage a dictionary and publish it
+    printf("\nRunning shared memory test:\n");
+    std::string name="/ndict_utest_"+std::to_string(getpid());
+    ndict object;
+    object["string"]="string";
+    object["int"]=123;
+    object["float"]=123.456;
+    object["bool"]=true;
+    object["array"][0]="a";
+    object["array"][1]="b";
+    object["outer"]["zulu"]="last";
+    object["outer"]["alpha"]="first";
+    object["outer"]["inner"]["value"]="nested";
+    object["null"];
+    nshm::unlink(name);
+    uint64_t version=nshm::publish(name,object);
+
+    // Test reading from the segment
+    nshm segment(name);
+    nshm::node root=segment.root();
+    test("Attached segment has published version",segment.getversion()==version);
+    test("Shared dictionary has N root items",root.size()==7);
+    test("Shared string value",root["string"].getstring()=="string");
+    test("Shared int value",root["int"].getint()==123);
+    test("Shared float value",root["float"].getdouble()==123.456);
+    test("Shared bool value",root["bool"].getbool()==true);
+    test("Shared array values",root["array"].size()==2 && root["array"][1].getstring()=="b");
+    test("Shared object keys retain order",root["outer"].getkeys()[0]=="zulu" && root["outer"].getkeys()[1]=="alpha");
+    test("Shared object lookup by key",root["outer"]["alpha"].getstring()=="first" && root["outer"]["zulu"].getstring()=="last");
+    test("Shared nested value",root["outer"]["inner"]["value"].getstring()=="nested");
+    test("Shared null and missing values",root["null"].type==ndict::TNULL && !root.haskey("null") && !root.haskey("missing"));
+    test("Shared dictionary converts back",root.todict()==object && root.getjson()==object.getjson());
+#if NDICT_CHECK_TYPE
+    {
+        bool result=false;
+        try{
+            root["string"].getint();
+        }
+        catch(ndict_exception &e){
+            result=true;
+        }
+        test("Shared dictionary throws exception when accessing invalid type",result);
+    }
+#endif
+    test("Shared unchecked access converts the value",root["int"].getstring<ndict_unchecked>()=="123" && root["missing"].getint<ndict_unchecked>()==0);
+    {
+        bool result=false;
+        try{
+            root["string"].getint<ndict_checked>();
+        }
+        catch(ndict_exception &e){
+            result=true;
+        }
+        test("Shared checked access throws exception when accessing invalid type",result);
+    }
+
+    // Test reading from another process
+    pid_t pid=fork();
+    if(pid==0){
+        nshm child(name);
+        _exit(child.root()["outer"]["inner"]["value"].getstring()=="nested"?0:1);
+    }
+    int status=-1;
+    waitpid(pid,&status,0);
+    test("Shared dictionary is readable from another process",WIFEXITED(status) && WEXITSTATUS(status)==0);
+
+    // Test version-stamped updates
+    object["int"]=456;
+    nshm::publish(name,object);
+    test("Attached reader keeps its version until refresh",segment.root()["int"].getint()==123);
+    test("Refresh maps the new version",segment.refresh() && segment.getversion()==version+1);
+    test("Refreshed reader sees new values",segment.root()["int"].getint()==456);
+    test("Refresh without a new version is a no-op",!segment.refresh());
+
+    // Test strings and keys with embedded null characters
+    ndict binary;
+    binary["value"]=std::string("a\0b",3);
+    binary[std::string("k\0ey",4)]="key";
+    nshm::publish(name,binary);
+    segment.refresh();
+    test("Shared string keeps embedded null characters",segment.root()["value"].getstring()==std::string("a\0b",3));
+    test("Shared key keeps embedded null characters",segment.root().getkeys()[1]==std::string("k\0ey",4) && segment.root()[std::string("k\0ey",4)].getstring()=="key");
+    test("Shared dictionary with null characters converts back",segment.root().todict()==binary);
+    nshm::unlink(name);
+    {
+        bool result=false;
+        try{
+            nshm missing(name);
+        }
+        catch(nshm_exception &e){
+            result=true;
+        }
+        test("Attaching to an unlinked segment throws exception",result);
+    }
+    {
+        // Control segment created by a loader that has not sized it yet
+        int fd=shm_open(name.c_str(),O_RDWR|O_CREAT,0644);
+        close(fd);
+        bool result=false;
+        try{
+            nshm truncated(name);
+        }
+        catch(nshm_exception &e){
+            result=true;
+        }
+        test("Attaching to a truncated segment throws exception",result);
+        test("Publishing to a truncated segment sizes it",nshm::publish(name,object)==1 && nshm(name).root()["int"].getint()==456);
+        nshm::unlink(name);
+    }
+}
+
+/*!\brief Test direct struct decoding and encoding
+ */
+void test_binding(){
+    // Decode a message directly into a struct
+    printf("\nRunning struct binding test:\n");
+    std::string text=""
+        "{\n"
+        "   \"name\" : \"message\",\n"
+        "   \"unknown\" : {\"skipped\" : [\"]\", {\"}\" : 1}]},\n"
+        "   \"id\" : 42,\n"
+        "   \"ratio\" : 0.25,\n"
+        "   \"enabled\" : true,\n"
+        "   \"origin\" : {\"x\" : 1, \"y\" : -2},\n"
+        "   \"path\" : [{\"x\" : 3, \"y\" : 4}, {\"y\" : 6, \"x\" : 5}],\n"
+        "   \"tags\" : [\"a\", \"b\"],\n"
+        "   \"meta\" : {\"value\" : \"free\"},\n"
+        "}\n";
+    njson json;
+    umessage message;
+    json.decode(text,message);
+    test("Bound string field",message.name=="message");
+    test("Bound unsigned field",message.id==42);
+    test("Bound double field",message.ratio==0.25);
+    test("Bound bool field",message.enabled==true);
+    test("Bound nested struct field",message.origin.x==1 && message.origin.y==-2);
+    test("Bound vector of structs field",message.path.size()==2 && message.path[1].x==5 && message.path[1].y==6);
+    test("Bound vector of strings field",message.tags.size()==2 && message.tags[1]=="b");
+    test("Bound dictionary field",message.extra["value"].getstring()=="free");
+
+    // Encode the struct and compare against the dictionary encoding
+    umessage copy;
+    json.decode(json.encode(message),copy);
+    test("Struct survives encode-decode",copy.name==message.name && copy.path.size()==2 && copy.path[0].y==4 && copy.ratio==0.25);
+    message.path.clear();
+    ndict object=json.decode(json.encode(message));
+    test("Encoded struct decodes to N root items",object.size()==8);
+    test("Encoded struct string value",object["name"].getstring()=="message");
+    test("Encoded struct nested value",object["origin"]["y"].getint()==-2);
+    test("Encoded struct array value",object["tags"][0].getstring()=="a");
+    test("Encoded struct dictionary value",object["meta"]["value"].getstring()=="free");
+    upoint point;
+    point.x=7;
+    point.y=8;
+    ndict reference;
+    reference["x"]=7;
+    reference["y"]=8;
+    test("Encoded struct is formatted like a dictionary",json.encode(point)==reference.getjson());
+
+    // Test error handling
+    {
+        bool result=false;
+        try{
+            json.decode("{\"id\" : \"string\"}",message);
+        }
+        catch(njson_exception &e){
+            result=std::string(e.what()).find("offset")!=std::string::npos;
+        }
+        test("Bound field type mismatch throws exception with offset",result);
+    }
+    {
+        bool result=false;
+        try{
+            json.decode("{\"x\" : 1}xx",point);
+        }
+        catch(njson_exception &e){
+            result=true;
+        }
+        test("Decoding struct with trailing junk throws exception",result);
+    }
+    {
+        std::vector<std::string> invalid={"{\"x\" : 2147483648}","{\"x\" : 1.5}","{\"x\" : 1e3}"};
+        bool result=true;
+        for(const std::string &input : invalid){
+            bool thrown=false;
+            try{
+                json.decode(input,point);
+            }
+            catch(njson_exception &e){
+                thrown=true;
+            }
+            result=result && thrown;
+        }
+        bool negative=false;
+        try{
+            json.decode("{\"id\" : -1}",message);
+        }
+        catch(njson_exception &e){
+            negative=true;
+        }
+        test("Integer fields reject decimals and values out of range",result && negative);
+    }
+}
+
+void test_query(){
+    // Build a small store
+    printf("\nRunning query test:\n");
+    ndict store;
+    const char *titles[]={"Sayings","Moby Dick","Sword","Lord"};
+    const double prices[]={8.95,8.99,12.99,22.99};
+    for(unsigned i=0;i<4;i++){
+        store["store"]["book"][i]["title"]=titles[i];
+        store["store"]["book"][i]["price"]=prices[i];
+    }
+    store["store"]["book"][2]["isbn"]="0-553-21311-3";
+    store["store"]["bicycle"]["color"]="red";
+    store["store"]["bicycle"]["price"]=19.95;
+
+    // Test selectors
+    nquery titlequery("$.store.book[*].title");
+    std::vector<const ndict*> result=titlequery.run(store);
+    test("Wildcard query matches all members",result.size()==4 && result[3]->getstring()=="Lord");
+    result=nquery("$..price").run(store);
+    test("Recursive query matches in document order",result.size()==5 && result[4]->getdouble()==19.95);
+    result=nquery("$['store']['bicycle','book'][0].title").run(store);
+    test("Bracketed keys and indices",result.size()==1 && result[0]->getstring()=="Sayings");
+    result=nquery("$.store.book[-1:].title").run(store);
+    test("Negative slice",result.size()==1 && result[0]->getstring()=="Lord");
+    result=nquery("$.store.book[0:4:2].title").run(store);
+    test("Slice with step",result.size()==2 && result[1]->getstring()=="Sword");
+    result=nquery("$.store.book[?(@.isbn)].title").run(store);
+    test("Existence filter",result.size()==1 && result[0]->getstring()=="Sword");
+    result=nquery("$.store.book[?(@.price < 10)].title").run(store);
+    test("Numeric filter",result.size()==2 && result[1]->getstring()=="Moby Dick");
+    result=nquery("$..book[?(@.title == 'Lord')].price").run(store);
+    test("String filter",result.size()==1 && result[0]->getdouble()==22.99);
+    test("Query without matches",nquery("$.store.car").first(store)==NULL);
+    test("Compiled query can be reused",titlequery.run(store).size()==4);
+
+    // Evaluate a large array on several threads
+    ndict large;
+    for(unsigned i=0;i<1000;i++) large["items"][i]["value"]=(int)i;
+    nquery filter("$.items[?(@.value >= 500)].value");
+    std::vector<const ndict*> serial=filter.run(large);
+    filter.setparallel(4,100);
+    std::vector<const ndict*> parallel=filter.run(large);
+    test("Parallel query matches serial query",serial.size()==500 && parallel==serial);
+
+    // Test error handling
+    const char *invalid[]={"store","$.store[","$[?(@.a == )]","$[0:1:0]","$['a"};
+    bool result_invalid=true;
+    for(const char *expression : invalid){
+        bool thrown=false;
+        try{
+            nquery query(expression);
+        }
+        catch(nquery_exception &e){
+            thrown=std::string(e.what()).find("offset")!=std::string::npos;
+        }
+        result_invalid=result_invalid && thrown;
+    }
+    test("Invalid queries throw exception with offset",result_invalid);
+}
+
+void test_index(){
+    // Build an indexed array of records
+    printf("\nRunning secondary index test:\n");
+    ndict users;
+    users.addindex("id");
+    users.addindex("age",true);
+    const char *names[]={"ada","bob","cyd","dan","eve"};
+    for(unsigned i=0;i<5;i++){
+        users[i]["id"]=(int)(100+i);
+        users[i]["name"]=names[i];
+        users[i]["age"]=(int)(20+i*10);
+    }
+    std::vector<unsigned> result=users.search("id",102);
+    test("Hash index finds member",result.size()==1 && result[0]==2);
+    test("Hash index compares numbers by value",users.search("id",102.0).size()==1);
+    test("Hash index misses unknown value",users.search("id",999).empty());
+    result=users.search("age",30,50);
+    test("Sorted index finds range",result.size()==3 && result[0]==1 && result[2]==3);
+    test("Range of other type does not match",users.search("age","a","z").empty());
+    result=users.search("name","cyd");
+    test("Unindexed field falls back to scan",result.size()==1 && result[0]==2);
+
+    // Modify members and check that the indexes follow
+    users[2]["id"]=200;
+    test("Index follows modified member",users.search("id",102).empty() && users.search("id",200).size()==1);
+    users[1].clear();
+    test("Index drops cleared member",users.search("id",101).empty() && users.search("age",0,100).size()==4);
+    users.erase(0u);
+    result=users.search("id",104);
+    test("Index follows shifted members",result.size()==1 && result[0]==3);
+    users[4]["id"]=104;
+    test("Index includes appended members",users.search("id",104).size()==2);
+
+    // Indexes are copied with the array, and the copies are independent
+    ndict copy=users;
+    copy[3]["id"]=300;
+    test("Copied index follows copy",copy.search("id",300).size()==1 && copy.search("id",104).size()==1);
+    test("Original index is unchanged",users.search("id",300).empty() && users.search("id",104).size()==2);
+    test("Dropped index falls back to scan",users.dropindex("id") && users.search("id",104).size()==2);
+    ndict &held=users[0];
+    users.search("age",0,100);
+    held["age"]=99;
+    test("Index follows writes through held references",users.search("age",99,99).size()==1 && users.search("age",99,99)[0]==0);
+
+    // Compare against a linear scan on a larger array
+    ndict large,plain;
+    large.addindex("key",true);
+    for(unsigned i=0;i<1000;i++){
+        large[i]["key"]=(int)((i*7919)%500);
+        plain[i]["key"]=(int)((i*7919)%500);
+    }
+    large[10]["key"]=1000;
+    plain[10]["key"]=1000;
+    test("Sorted index matches scan",large.search("key",100,200)==plain.search("key",100,200) && large.search("key",1000).size()==1);
+
+    // Copies sharing pending index updates are searched concurrently
+    large[20]["key"]=2000;
+    plain[20]["key"]=2000;
+    ndict shared=large;
+    std::vector<std::thread> threads;
+    std::atomic<bool> matching{true};
+    for(unsigned i=0;i<4;i++){
+        threads.push_back(std::thread([&](){
+            ndict copy=shared;
+            if(copy.search("key",100,200)!=plain.search("key",100,200) || copy.search("key",2000).size()!=1) matching=false;
+        }));
+    }
+    for(std::thread &thread : threads) thread.join();
+    test("Copies are searched concurrently",matching);
+}
+
+void test_projection(){
+    // Decode a few paths from a wide document
+    printf("\nRunning projection decode test:\n");
+    std::string text=""
+        "{\n"
+        "   \"skipped\" : {\"deep\" : [\"}\", {\"]\" : 1}], \"more\" : \"\\\"\"},\n"
+        "   \"server\" : {\"host\" : \"localhost\", \"port\" : 8080, \"tls\" : {\"enabled\" : true}},\n"
+        "   \"routes\" : [\"a\", \"b\", \"c\"],\n"
+        "   \"a/b\" : 1,\n"
+        "   \"limits\" : {\"rate\" : 10, \"burst\" : 20},\n"
+        "}\n";
+    njson json;
+    ndict object=json.decode(text,{"/server/port","/server/tls","/routes/1","/a~1b","/limits","/missing/path"});
+    test("Projection decodes N root items",object.size()==4);
+    test("Projected nested value",object["server"]["port"].getint()==8080);
+    test("Projected subtree",object["server"]["tls"]["enabled"].getbool()==true);
+    test("Unprojected sibling is skipped",!object["server"].haskey("host"));
+    test("Unprojected member is skipped",!object.haskey("skipped"));
+    test("Projected array member",object["routes"].size()==2 && object["routes"][1].getstring()=="b");
+    test("Projected escaped key",object["a/b"].getint()==1);
+    test("Projected object",object["limits"]["burst"].getint()==20);
+    test("Projected parent overrides child",json.decode(text,{"/server/port","/server"})["server"].size()==3);
+    std::vector<std::string> paths={"/server/port","/routes/0"};
+    ndict listed=json.decode(text,paths);
+    test("Projection from a modifiable list of paths",listed["server"]["port"].getint()==8080 && listed["routes"][0u].getstring()=="a");
+    std::string simple="{\"a\" : {\"b\" : [1, 2]}, \"c\" : \"d\"}";
+    test("Projection of whole document",json.decode(simple,{""})==json.decode(simple));
+    ndict unresolved=json.decode(simple,{"/c/d","/a/b/5","/a/x"});
+    test("Projection omits paths that don't resolve",unresolved.type==ndict::TNULL && unresolved.size()==0);
+    test("Projection keeps resolved siblings of unresolved paths",json.decode(simple,{"/c/d","/a/b/1"}).getjson()==json.decode("{\"a\" : {\"b\" : [null, 2]}}").getjson());
+
+    // Test error handling
+    {
+        bool result=false;
+        try{
+            json.decode("{\"a\" : 1, \"b\" : [1, 2}",{"/a"});
+        }
+        catch(njson_exception &e){
+            result=std::string(e.what()).find("offset")!=std::string::npos;
+        }
+        test("Malformed skipped member throws exception with offset",result);
+    }
+    {
+        bool result=false;
+        try{
+            json.decode("{\"a\" : 1, \"b\" : [{\"c\" : 2]}}",{"/a"});
+        }
+        catch(njson_exception &e){
+            result=true;
+        }
+        test("Skipped member with mismatched brackets throws exception",result);
+    }
+    {
+        bool result=false;
+        try{
+            json.decode(text,{"server"});
+        }
+        catch(njson_exception &e){
+            result=true;
+        }
+        test("Invalid JSON pointer throws exception",result);
+    }
+}
+
+void test_lazy(){
+    // Compare a lazily decoded document against an eagerly decoded one
+    printf("\nRunning lazy decode test:\n");
+    std::string text=""
+        "{\n"
+        "   \"server\" : {\"host\" : \"localhost\", \"port\" : 8080, \"tls\" : {\"enabled\" : TRUE}},\n"
+        "   \"routes\" : [\"a\", \"b\", 3.5],\n"
+        "   \"empty\" : {},\n"
+        "   \"nothing\" : null,\n"
+        "   \"quoted\" : \"st\\\"ring\"\n"
+        "}\n";
+    njson json;
+    ndict eager=json.decode(text);
+    ndict lazy=json.decodelazy(text);
+    test("Lazy nested value",lazy["server"]["tls"]["enabled"].getbool()==true);
+    test("Lazy array value",lazy["routes"].size()==3 && lazy["routes"][2].getdouble()==3.5);
+    test("Lazy decode equals eager decode",lazy==eager && lazy.hash()==eager.hash());
+    test("Lazy decode encodes like eager decode",json.decodelazy(text).getjson()==eager.getjson());
+
+    // Copies share the unparsed members until they are modified
+    ndict original=json.decodelazy(text);
+    ndict copy=original;
+    copy["server"]["port"]=9090;
+    test("Modified lazy copy",copy["server"]["port"].getint()==9090 && copy["server"]["host"].getstring()=="localhost");
+    test("Original lazy object is unchanged",original["server"]["port"].getint()==8080);
+    const ndict &constant=json.decodelazy(text);
+    test("Lazy members materialize through const access",constant["server"]["tls"]["enabled"].getbool());
+
+    // Arrays of objects are decoded as well
+    ndict records=json.decodelazy("{\"list\" : [{\"id\" : 1}, {\"id\" : 2, \"tags\" : [\"x\", \"]\"]}]}");
+    test("Lazy array of objects",records["list"].size()==2 && records["list"][1]["tags"][1].getstring()=="]");
+
+    // Several threads may read a document before it is materialized
+    {
+        const ndict shared=json.decodelazy(text);
+        std::vector<std::thread> readers;
+        std::vector<int> matches(4,0);
+        for(unsigned i=0;i<matches.size();i++){
+            readers.emplace_back([&shared,&matches,i](){
+                matches[i]=shared["server"]["tls"]["enabled"].getbool() && shared["routes"][2].getdouble()==3.5 && shared["server"]["host"].getstring()=="localhost";
+            });
+        }
+        for(std::thread &reader : readers) reader.join();
+        test("Lazy document is readable from several threads",std::count(matches.begin(),matches.end(),1)==(int)matches.size());
+    }
+
+    // Syntax errors are reported up front
+    {
+        bool result=false;
+        try{
+            json.decodelazy("{\"a\" : {\"b\" : [1, rue]}}");
+        }
+        catch(njson_exception &e){
+            result=std::string(e.what()).find("offset")!=std::string::npos;
+        }
+        test("Lazy decode of invalid nested value throws exception with offset",result);
+    }
+    {
+        bool result=false;
+        try{
+            json.decodelazy("{\"a\" : {\"b\" : 1}");
+        }
+        catch(njson_exception &e){
+            result=true;
+        }
+        test("Lazy decode of unterminated object throws exception",result);
+    }
+}
+
+void test_validate(){
+    // Validate well-formed input
+    printf("\nRunning validation test:\n");
+    njson json;
+    std::string text=""
+        "{\n"
+        "   \"list\" : [{\"id\" : 1}, {\"id\" : -2.5e3, \"tags\" : [\"x\", \"]\"]}, [], {}],\n"
+        "   \"flags\" : [TRUE, false, null],\n"
+        "   \"quoted\" : \"st\\\"ring\"\n"
+        "}\n";
+    test("Valid JSON passes",json.validate(text).valid);
+    test("Decoder input passes",json.validate(json.decode("{\"a\" : {\"b\" : 1}}").getjson()).valid);
+
+    // Check error reasons and offsets
+    njson_status status=json.validate("{\"a\" : [1, 2}");
+    test("Mismatched bracket fails",!status.valid && status.offset==12 && !strcmp(status.reason,"Expected , or ] in JSON array"));
+    status=json.validate("{\"a\" : rue}");
+    test("Invalid keyword fails",!status.valid && status.offset==7);
+    status=json.validate("{\"a\" : 1.}");
+    test("Invalid number fails",!status.valid && status.offset==7 && !strcmp(status.reason,"Invalid JSON number"));
+    test("Missing colon fails",!json.validate("{\"a\" 1}").valid);
+    test("Unquoted key fails",!json.validate("{a : 1}").valid);
+    test("Unterminated string fails",!json.validate("{\"a\" : \"b}").valid);
+    test("Unterminated object fails",!json.validate("{\"a\" : {\"b\" : 1}").valid);
+    test("Trailing junk fails",!json.validate("{\"a\" : 1}x").valid);
+    test("Top-level array fails",!json.validate("[1, 2]").valid);
+    test("Trailing comma in array fails",!json.validate("{\"a\" : [1,]}").valid);
+    test("Trailing comma in object fails",!json.validate("{\"a\" : 1,}").valid && !json.validate("{\"a\" : {\"b\" : 1,}}").valid);
+    test("Lone comma fails",!json.validate("{,}").valid && !json.validate("{\"a\" : [,]}").valid);
+    test("Empty blocks pass",json.validate("{\"a\" : [], \"b\" : {}}").valid);
+    status=json.validate(std::string("{\"a\" : \"x\ty\", \"b\" : \"\0\"}",24));
+    test("Raw control characters in strings fail",!status.valid && !strcmp(status.reason,"Control character in string") &&
+         !json.validate("{\"a\nb\" : 1}").valid && !json.validate(std::string("{\"a\" : [\"\0\"]}",13)).valid);
+    test("Escaped control characters pass",json.validate("{\"a\\nb\" : \"x\\ty\\u0000\"}").valid);
+
+    // Enforce limits
+    njson_limits limits;
+    limits.depth=3;
+    test("Depth within limit passes",json.validate("{\"a\" : [{\"b\" : 1}]}",limits).valid);
+    status=json.validate("{\"a\" : [{\"b\" : [1]}]}",limits);
+    test("Depth beyond limit fails",!status.valid && status.offset==15);
+    limits=njson_limits();
+    limits.string=3;
+    test("String within limit passes",json.validate("{\"abc\" : \"def\"}",limits).valid);
+    test("String beyond limit fails",!json.validate("{\"abc\" : \"defg\"}",limits).valid);
+    limits=njson_limits();
+    limits.size=8;
+    test("Size beyond limit fails",!json.validate("{\"a\" : 10}",limits).valid);
+
+    // Deep nesting beyond the inline stack
+    std::string deep="{\"a\" : ";
+    deep+=std::string(2000,'[')+"1"+std::string(2000,']')+"}";
+    test("Deep nesting passes",json.validate(deep).valid);
+    deep[deep.size()-2]='}';
+    test("Deep mismatched bracket fails",!json.validate(deep).valid);
+}
+
+void test_nesting(){
+    // Decode and encode deeply nested documents
+    printf("\nRunning deep nesting test:\n");
+    njson json;
+    std::string text="{\"a\" : "+std::string(1000,'[')+"1"+std::string(1000,']')+"}";
+    ndict object=json.decode(text);
+    const ndict *node=&object["a"];
+    unsigned depth=0;
+    while(node->type==ndict::TARRAY){
+        node=&(*node)[0u];
+        depth++;
+    }
+    test("Decode nesting within default depth",depth==1000 && node->getint()==1);
+    test("Encode deep nesting",object.getjson(0)=="{\n\"a\" : "+std::string(1000,'[')+"1"+std::string(1000,']')+"\n}");
+
+    // Hostile nesting fails cleanly
+    {
+        bool result=false;
+        try{
+            json.decode("{\"a\" : "+std::string(100000,'[')+"1"+std::string(100000,']')+"}");
+        }
+        catch(njson_exception &e){
+            result=std::string(e.what()).find("depth")!=std::string::npos;
+        }
+        test("Decoding beyond maximum depth throws exception",result);
+    }
+    {
+        bool result=false;
+        json.setdepth(4);
+        try{
+            json.decodelazy("{\"a\" : {\"b\" : [[[1]]]}}");
+        }
+        catch(njson_exception &e){
+            result=true;
+        }
+        test("Lazy decoding beyond maximum depth throws exception",result);
+    }
+    json.setdepth(20000);
+    object=json.decode("{\"a\" : "+std::string(10000,'[')+std::string(10000,']')+"}");
+    test("Decode nesting within raised depth",object.size()==1);
+
+    // Empty blocks and arrays of objects
+    object=json.decode("{\"empty\" : [], \"list\" : [{\"id\" : 1}, {\"id\" : [2, {}]}], \"none\" : {}}");
+    test("Empty array decodes as array",object["empty"].type==ndict::TARRAY && object["empty"].size()==0);
+    test("Empty object decodes as null",object["none"].type==ndict::TNULL);
+    test("Array of objects decodes",object["list"][1]["id"][0].getint()==2);
+    test("Empty array round trip",json.decode(object.getjson())==object);
+}
+
+void test_reuse(){
+    // Decode differently shaped messages into the same object
+    printf("\nRunning decoder reuse test:\n");
+    njson json;
+    ndict object;
+    std::string first="{\"a\" : {\"b\" : [1, 2, 3], \"c\" : \"long string value beyond small buffers\"}, \"d\" : true, \"e\" : 1.5}";
+    std::string second="{\"a\" : [{\"x\" : 1}], \"f\" : null, \"d\" : \"yes\"}";
+    json.decode(first,object);
+    test("Decode into object",object==json.decode(first) && object["a"]["b"][2].getint()==3);
+    ndict copy=object;
+    json.decode(second,object);
+    test("Decode other shape into same object",object==json.decode(second) && object.getjson()==json.decode(second).getjson());
+    test("Reused object drops left over members",object.size()==3 && !object.haskey("e") && object["a"].size()==1);
+    test("Copy of reused object is unchanged",copy==json.decode(first) && copy["a"]["c"].getstring()=="long string value beyond small buffers");
+    json.decode(first,object);
+    test("Decode first shape again",object==copy && object.hash()==copy.hash());
+    json.decode("{\"a\" : {}, \"b\" : []}",object);
+    test("Decode empty blocks into reused object",object["a"].type==ndict::TNULL && object["b"].type==ndict::TARRAY && object["b"].size()==0);
+
+    // Duplicate keys replace earlier values
+    json.decode("{\"a\" : {\"x\" : 1, \"y\" : 2}, \"a\" : {\"z\" : 3}}",object);
+    test("Duplicate key replaces earlier value",object.size()==1 && object["a"].size()==1 && object["a"]["z"].getint()==3);
+
+    // Indexes follow decoded arrays
+    ndict records;
+    records["list"].addindex("id");
+    json.decode("{\"list\" : [{\"id\" : 1}, {\"id\" : 2}]}",records);
+    test("Index of reused array follows decode",records["list"].search("id",2).size()==1);
+}
+
+void test_readall(){
+    // Write a batch of json fragments to temporary files
+    printf("\nRunning batch file loading test:\n");
+    njson json;
+    std::vector<std::string> paths;
+    for(unsigned i=0;i<20;i++){
+        ndict fragment;
+        fragment["shared"]["value"]=(int)i;
+        fragment["unique"+std::to_string(i)]=std::string(i*100,'x');
+        char fnbuffer[32];
+        strcpy(fnbuffer,"/tmp/ndict_utest_XXXXXX");
+        int fd=mkstemp(fnbuffer);
+        std::string text=fragment.getjson();
+        if(fd<0 || write(fd,text.data(),text.size())!=(ssize_t)text.size()){
+            printf("Failed to write %s\n",fnbuffer);
+            ufailed++;
+            return;
+        }
+        close(fd);
+        paths.push_back(fnbuffer);
+    }
+
+    // Read them back
+    std::vector<ndict> dicts=json.readall(paths);
+    bool result=dicts.size()==paths.size();
+    for(unsigned i=0;i<dicts.size() && result;i++){
+        result=dicts[i]==json.read(paths[i]);
+    }
+    test("Batch read matches single reads",result);
+    test("Batch read with one thread",json.readall(paths,1)==dicts);
+    ndict merged=json.readmerged(paths);
+    test("Merged batch holds all fragments",merged.size()==21 && merged["unique19"].getstring().size()==1900);
+    test("Merged batch is merged in order",merged["shared"]["value"].getint()==19);
+
+    // Interrupting signals do not fail the batch
+    {
+        struct sigaction action,previous;
+        memset(&action,0,sizeof(action));
+        action.sa_handler=[](int){};
+        sigaction(SIGALRM,&action,&previous);
+        struct itimerval timer={{0,100},{0,100}};
+        setitimer(ITIMER_REAL,&timer,NULL);
+        bool result=true;
+        try{
+            for(unsigned i=0;i<50 && result;i++) result=json.readall(paths)==dicts;
+        }
+        catch(njson_exception &e){
+            result=false;
+        }
+        timer={{0,0},{0,0}};
+        setitimer(ITIMER_REAL,&timer,NULL);
+        sigaction(SIGALRM,&previous,NULL);
+        test("Batch read survives interrupting signals",result);
+    }
+
+    // Missing and malformed files fail with their path
+    {
+        bool result=false;
+        std::vector<std::string> missing=paths;
+        missing.push_back("/tmp/ndict_utest_missing");
+        try{
+            json.readall(missing);
+        }
+        catch(njson_exception &e){
+            result=std::string(e.what()).find("ndict_utest_missing")!=std::string::npos;
+        }
+        test("Batch read of missing file throws exception with path",result);
+    }
+    {
+        bool result=false;
+        FILE *fd=fopen(paths[5].c_str(),"w");
+        fputs("{\"a\" : rue}",fd);
+        fclose(fd);
+        try{
+            json.readall(paths);
+        }
+        catch(njson_exception &e){
+            result=std::string(e.what()).find(paths[5])==0;
+        }
+        test("Batch read of malformed file throws exception with path",result);
+    }
+    for(const std::string &path : paths) unlink(path.c_str());
+}
+
 /*!\brief Run baby! RUN!
  */
+void test_compressed(){
+    // Build a document large enough to span many read chunks
+    printf("\nRunning streaming file test:\n");
+    njson json;
+    ndict dict;
+    for(unsigned i=0;i<1000;i++){
+        dict["items"][i]["name"]="item"+std::to_string(i);
+        dict["items"][i]["value"]=(int)i;
+    }
+    dict["text"]=std::string(3*NJSON_CHUNK_SIZE,'x')+"\\\"end";
+    dict["nested"]["empty"]["list"][0]=true;
+
+    // Plain round trip
+    std::string plain="/tmp/ndict_utest_stream.json";
+    json.write(plain,dict);
+    ndict result=json.read(plain);
+    test("Streamed file round trip",result==dict);
+    test("Streamed file matches in-memory encoding",result==json.decode(json.encode(dict)));
+    test("Streamed string spanning chunks",result["text"].getstring().size()==3*NJSON_CHUNK_SIZE+5);
+
+    // Errors report offsets within the whole stream
+    {
+        FILE *fd=fopen(plain.c_str(),"w");
+        fputs("{\"a\" : \"",fd);
+        for(int i=0;i<NJSON_CHUNK_SIZE;i++) fputc('y',fd);
+        fputs("\", \"b\" : rue}",fd);
+        fclose(fd);
+        bool thrown=false;
+        try{
+            json.read(plain);
+        }
+        catch(njson_exception &e){
+            thrown=std::string(e.what()).find("offset "+std::to_string(NJSON_CHUNK_SIZE+20))!=std::string::npos;
+        }
+        test("Streamed file error reports stream offset",thrown);
+    }
+
+    // Keys ending at a chunk boundary survive the next chunk being read
+    {
+        FILE *fd=fopen(plain.c_str(),"w");
+        fputs("{\"pad\" : \"",fd);
+        for(int i=0;i<NJSON_CHUNK_SIZE-22;i++) fputc('y',fd);
+        fputs("\", \"keyname\" : \"",fd);
+        for(int i=0;i<NJSON_CHUNK_SIZE;i++) fputc('z',fd);
+        fputs("\"}",fd);
+        fclose(fd);
+        ndict boundary=json.read(plain);
+        std::vector<std::string> keys=boundary.getkeys();
+        test("Streamed key across chunk boundary",keys.size()==2 && keys[1]=="keyname" && boundary["keyname"].getstring().size()==NJSON_CHUNK_SIZE);
+    }
+
+    // Zstandard input is detected and rejected
+    {
+        FILE *fd=fopen(plain.c_str(),"wb");
+        fwrite("\x28\xb5\x2f\xfd\x00\x00",1,6,fd);
+        fclose(fd);
+        bool thrown=false;
+        try{
+            json.read(plain);
+        }
+        catch(njson_exception &e){
+            thrown=std::string(e.what()).find("Zstandard")!=std::string::npos;
+        }
+        test("Zstandard input is rejected",thrown);
+    }
+
+    // Write errors keep the cause reported by the system
+    {
+        bool thrown=false;
+        try{
+            json.write("/dev/full",dict);
+        }
+        catch(njson_exception &e){
+            thrown=std::string(e.what()).find(strerror(ENOSPC))!=std::string::npos;
+        }
+        test("Streamed write error reports its cause",thrown);
+    }
+    unlink(plain.c_str());
+
+#if NJSON_ZLIB
+    // Compressed round trip, single and batch
+    std::string compressed="/tmp/ndict_utest_stream.json.gz";
+    json.write(compressed,dict);
+    FILE *fd=fopen(compressed.c_str(),"rb");
+    unsigned char magic[2]={0,0};
+    test("Compressed file has gzip header",fd && fread(magic,1,2,fd)==2 && magic[0]==0x1f && magic[1]==0x8b);
+    if(fd) fclose(fd);
+    test("Compressed file round trip",json.read(compressed)==dict);
+    std::vector<ndict> batch=json.readall({compressed,compressed});
+    test("Compressed batch read",batch.size()==2 && batch[0]==dict && batch[1]==dict);
+
+    // Truncated input fails
+    {
+        fd=fopen(compressed.c_str(),"r+b");
+        fseek(fd,0,SEEK_END);
+        long size=ftell(fd);
+        fclose(fd);
+        if(truncate(compressed.c_str(),size/2)!=0) ufailed++;
+        bool thrown=false;
+        try{
+            json.read(compressed);
+        }
+        catch(njson_exception &e){
+            thrown=true;
+        }
+        test("Truncated compressed file throws exception",thrown);
+    }
+    unlink(compressed.c_str());
+#endif
+}
+
+void test_stats(){
+    // Start from zero
+    printf("\nRunning performance counter test:\n");
+    nstats::reset();
+    ndict snapshot=nstats::snapshot();
+    test("Instrumentation is enabled",nstats::enabled() && snapshot["enabled"].getbool());
+    test("Counters start at zero",snapshot["counters"]["lookups"].getint()==0 && snapshot["histograms"]["decode"]["count"].getint()==0);
+
+    // Decode, look up, merge and encode
+    njson json;
+    std::string text="{\"a\" : 1, \"b\" : {\"c\" : [1, 2, 3]}}";
+    ndict dict=json.decode(text);
+    const ndict &constdict=dict;
+    constdict["b"]["c"];
+    constdict["missing"];
+    ndict target;
+    target.merge(dict);
+    std::string encoded=json.encode(dict);
+    snapshot=nstats::snapshot();
+    ndict &counters=snapshot["counters"];
+    test("Decoded bytes are counted",counters["decoded_bytes"].getint()==(int)text.size());
+    test("Decoded nodes are counted",counters["decoded_nodes"].getint()==7);
+    test("Encoded bytes are counted",counters["encoded_bytes"].getint()==(int)encoded.size());
+    test("Encoded nodes are counted",counters["encoded_nodes"].getint()==6);
+    test("Lookups and probes are counted",counters["lookups"].getint()>=3 && counters["probes"].getint()>=counters["lookups"].getint());
+    test("Allocations are counted",counters["allocations"].getint()>=3);
+
+    // Histograms record each outermost call once
+    ndict &histograms=snapshot["histograms"];
+    test("Decode latency is recorded",histograms["decode"]["count"].getint()==1 && histograms["decode"]["buckets"].size()==1);
+    test("Nested merges are recorded once",histograms["merge"]["count"].getint()==1);
+    test("Encode latency is recorded",histograms["encode"]["count"].getint()==1 && histograms["encode"]["sum_ns"].getdouble()>0);
+    test("Read latency is not recorded",histograms["read"]["count"].getint()==0 && !histograms["read"].haskey("buckets"));
+    ndict bucket=histograms["decode"]["buckets"][0];
+    test("Latency bucket bounds the recorded time",bucket["count"].getint()==1 && bucket["lt_ns"].getdouble()>histograms["decode"]["sum_ns"].getdouble());
+
+    // Snapshots encode for export, and reset clears everything
+    test("Snapshot encodes as JSON",json.decode(json.encode(snapshot))==snapshot);
+    nstats::reset();
+    snapshot=nstats::snapshot();
+    test("Reset clears counters and histograms",snapshot["counters"]["decoded_bytes"].getint()==0 && snapshot["histograms"]["merge"]["count"].getint()==0);
+}
+
+void test_trace(){
+    // Nothing is recorded until tracing starts
+    printf("\nRunning trace event test:\n");
+    njson json;
+    ntrace::clear();
+    json.decode("{\"a\" : 1}");
+    test("Trace points are compiled in",ntrace::enabled());
+    test("Nothing is recorded while stopped",ntrace::dump().find("\"ph\":\"X\"")==std::string::npos);
+
+    // Record decoding, recursive merges and a batch read on worker threads
+    std::vector<std::string> paths;
+    for(unsigned i=0;i<2;i++){
+        paths.push_back("/tmp/ndict_utest_trace"+std::to_string(i)+".json");
+        FILE *fd=fopen(paths.back().c_str(),"w");
+        fprintf(fd,"{\"file\" : %u, \"nested\" : {\"deeper\" : {\"value\" : %u}}}",i,i);
+        fclose(fd);
+    }
+    ntrace::start();
+    ndict merged=json.readmerged(paths,2);
+    json.decode("{\"a\" : 1}");
+    ntrace::stop();
+    json.encode(merged);
+    std::string trace=ntrace::dump();
+    for(const std::string &path : paths) unlink(path.c_str());
+
+    // Check the Chrome trace format
+    test("Trace is valid JSON",json.validate(trace).valid);
+    test("Trace holds complete events",trace.find("\"ph\":\"X\"")!=std::string::npos && trace.find("\"traceEvents\":[")!=std::string::npos);
+    test("Batch read is traced",trace.find("\"njson::readall\"")!=std::string::npos && trace.find("\"readall::decode\"")!=std::string::npos);
+    test("Decoding is traced",trace.find("\"njson::decode\"")!=std::string::npos && trace.find("\"njson::parse\"")!=std::string::npos);
+    size_t merges=0;
+    for(size_t pos=trace.find("\"ndict::merge\"");pos!=std::string::npos;pos=trace.find("\"ndict::merge\"",pos+1)) merges++;
+    test("Recursive merges are traced once per call",merges==2);
+    test("Nothing is recorded after stopping",trace.find("\"njson::encode\"")==std::string::npos);
+    test("Worker threads are named",trace.find("\"thread_name\"")!=std::string::npos);
+
+    // Threads started one after another share the ring of the previous one
+    ntrace::clear();
+    ntrace::start();
+    for(unsigned i=0;i<8;i++){
+        std::thread worker([](){njson local; local.decode("{\"a\" : 1}");});
+        worker.join();
+    }
+    ntrace::stop();
+    trace=ntrace::dump();
+    size_t names=0;
+    for(size_t pos=trace.find("\"thread_name\"");pos!=std::string::npos;pos=trace.find("\"thread_name\"",pos+1)) names++;
+    test("Rings of exited threads are reused",names==1 && trace.find("\"njson::decode\"")!=std::string::npos);
+
+    // Cleared events are left out of later dumps
+    ntrace::clear();
+    test("Cleared events are not dumped",ntrace::dump().find("\"ph\":\"X\"")==std::string::npos);
+}
+
+void test_packed(){
+    // Arrays of only integers or only decimals are packed
+    printf("\nRunning packed numbers test:\n");
+    njson json;
+    std::string text="{\"ints\" : [3, -1, 4, 1, 5, 9, 2, 6], \"reals\" : [0.5, 1.25, -2.75], "
+                     "\"mixed\" : [1, 2.5, 3], \"other\" : [1, \"two\", 3], \"empty\" : []}";
+    ndict dict=json.decode(text);
+    test("Integer array is packed",dict["ints"].packed() && dict["ints"].size()==8);
+    test("Decimal array is packed",dict["reals"].packed());
+    test("Mixed arrays are not packed",!dict["mixed"].packed() && !dict["other"].packed() && !dict["empty"].packed());
+
+    // Bulk operations
+    const ndict &ints=dict["ints"];
+    test("Packed sum",ints.sum()==29 && dict["reals"].sum()==-1);
+    test("Packed minimum and maximum",ints.min()==-1 && ints.max()==9 && dict["reals"].min()==-2.75);
+    test("Packed mean",dict["reals"].mean()==-1.0/3);
+    test("Unpacked arrays skip other members",dict["other"].sum()==4 && dict["mixed"].max()==3 && dict["mixed"].mean()==6.5/3);
+    test("Empty arrays have no minimum",std::isnan(dict["empty"].min()) && dict["empty"].sum()==0);
+    std::vector<double> numbers=ints.getnumbers();
+    double buffer[4];
+    ndict large=json.decode("{\"packed\" : [3000000000, -9007199254740992], \"scalar\" : 3000000000}");
+    test("Large integers are held exactly",large["packed"].packed() && large["packed"].getjson()=="[3000000000,-9007199254740992]" &&
+         large["packed"][0].getstring<ndict_unchecked>()=="3000000000" && large["scalar"].getstring<ndict_unchecked>()=="3000000000");
+    ndict exact=json.decode("{\"packed\" : [9007199254740993, -9223372036854775807], \"scalar\" : 9007199254740993, "
+                            "\"huge\" : [1, 99999999999999999999], \"scalars\" : 99999999999999999999, \"exponents\" : [1e3,2e3]}");
+    test("Integers beyond 2^53 are held exactly",exact["packed"].packed() && exact["packed"].getjson()=="[9007199254740993,-9223372036854775807]" &&
+         exact["packed"][0].getstring<ndict_unchecked>()=="9007199254740993" && exact["scalar"].getstring<ndict_unchecked>()=="9007199254740993");
+    test("Integers out of range keep their text",!exact["huge"].packed() && exact["huge"][1].getstring<ndict_unchecked>()=="99999999999999999999" &&
+         exact["scalars"].getstring<ndict_unchecked>()=="99999999999999999999");
+    test("Numbers with exponents are decimals",exact["exponents"].packed() && exact["exponents"].getjson()=="[1000.000000,2000.000000]" && exact["exponents"].sum()==3000);
+    test("Copy out numbers",numbers.size()==8 && numbers[5]==9 && ints.getnumbers(buffer,4)==4 && buffer[3]==1);
+
+    // Packed arrays behave like regular arrays
+    ndict copy=json.decode(text);
+    test("Packed members encode as standard JSON",json.encode(copy)==json.encode(dict) && dict["reals"].getjson()=="[0.500000,1.250000,-2.750000]");
+    test("Packed members are accessible",ints[5].getint()==9 && dict["reals"][2].getdouble()==-2.75 && ints.getkeys()[7]=="7");
+    test("Packed arrays compare equal",json.decode(text)==dict && json.decode(text).hash()==dict.hash());
+    ndict before=dict;
+    dict["ints"][0]=10;
+    test("Modified arrays are no longer packed",!dict["ints"].packed() && dict["ints"].sum()==36);
+    test("Copies keep their packed numbers",before["ints"].packed() && before["ints"].sum()==29);
+
+    // Long arrays use the vectorized path
+    std::string series="{\"series\" : [";
+    double expected=0;
+    for(unsigned i=0;i<=NDICT_MAX_ARRAY_SIZE;i++){
+        series+=(i?", ":"")+std::to_string(i%100)+".5";
+        expected+=i%100+0.5;
+    }
+    ndict samples=json.decode(series+"]}");
+    test("Long packed sum",samples["series"].packed() && samples["series"].sum()==expected && samples["series"].max()==99.5);
+    {
+        bool thrown=false;
+        try{
+            json.decode(series+", 1]}");
+        }
+        catch(ndict_exception &e){
+            thrown=true;
+        }
+        test("Too long packed arrays throw exception",thrown);
+    }
+
+    // Concurrent const readers create members once, non-const subscripts would modify the array
+    ndict decoded=json.decode(series+"]}");
+    const ndict &shared=decoded;
+    std::vector<std::thread> readers;
+    std::vector<int> results(4,0);
+    for(unsigned i=0;i<4;i++){
+        readers.emplace_back([&,i](){
+            const ndict &values=shared["series"];
+            results[i]=values[i+1].getdouble()==i%100+1.5;
+        });
+    }
+    for(std::thread &reader : readers) reader.join();
+    test("Concurrent access to packed members",results==std::vector<int>(4,1));
+
+    // Reusing a packed array while decoding
+    ndict reused;
+    json.decode(text,reused);
+    json.decode("{\"ints\" : [7, 8], \"reals\" : [1, \"x\"]}",reused);
+    test("Decoding into packed arrays",reused["ints"].packed() && reused["ints"].sum()==15 && !reused["reals"].packed() && reused["reals"][1].getstring()=="x");
+}
+
+void test_schema(){
+    // Describe the expected messages
+    printf("\nRunning schema decoding test:\n");
+    njson json;
+    njson_schema schema;
+    schema.member("type",ndict::TSTRING)
+          .member("sequence",ndict::TNUMBER)
+          .member("device",njson_schema().member("identifier",ndict::TSTRING).member("online",ndict::TBOOL))
+          .member("values",njson_schema(ndict::TARRAY).items(ndict::TNUMBER,3))
+          .member("tags",njson_schema(ndict::TARRAY).items(ndict::TSTRING))
+          .member("readings",njson_schema(ndict::TARRAY).items(njson_schema().member("at",ndict::TNUMBER)))
+          .member("extra",ndict::TNULL);
+    std::string text="{\"type\" : \"sample\", \"sequence\" : 42, \"device\" : {\"identifier\" : \"unit-1\", \"online\" : true}, "
+                     "\"values\" : [1.5, 2.25, 3.75], \"tags\" : [\"a\", \"b\"], \"readings\" : [{\"at\" : 1}, {\"at\" : 2}], "
+                     "\"extra\" : {\"anything\" : [null, 1, \"x\"]}}";
+
+    // Conforming documents decode like they do without a schema
+    ndict dict=json.decode(text,schema);
+    test("Conforming document decodes",dict==json.decode(text));
+    test("Schema arrays of numbers are packed",dict["values"].packed() && dict["values"].sum()==7.5);
+    std::string reordered="{\"sequence\" : 42, \"extra\" : 1, \"readings\" : [], \"tags\" : [], \"values\" : [1, 2, 3], "
+                          "\"device\" : {\"online\" : false, \"identifier\" : \"unit-2\"}, \"type\" : \"sample\"}";
+    ndict other=json.decode(reordered,schema);
+    test("Members are laid out in schema order",other.getkeys()[0]=="type" && other.getkeys()[6]=="extra");
+    test("Reordered members decode",other["device"]["identifier"].getstring()=="unit-2" && other["sequence"].getint()==42 && other["extra"].getint()==1);
+
+    // Non-conforming documents fail with the path of the value
+    auto failure=[&](const std::string &text,const njson_schema &schema){
+        try{
+            json.decode(text,schema);
+        }
+        catch(njson_exception &e){
+            return std::string(e.what());
+        }
+        return std::string();
+    };
+    std::string mismatch=text;
+    mismatch.replace(mismatch.find("true"),4,"\"yes\"");
+    test("Type mismatch reports path and offset",failure(mismatch,schema)=="Expected bool for /device/online at offset 85");
+    std::string missing=text;
+    missing.replace(missing.find("\"identifier\" : \"unit-1\", "),24,"");
+    test("Missing member reports path",failure(missing,schema).find("Missing member /device/identifier at offset")==0);
+    std::string unexpected=text;
+    unexpected.replace(unexpected.find("\"online\""),0,"\"color\" : \"red\", ");
+    test("Unexpected member reports path",failure(unexpected,schema).find("Unexpected member /device/color at offset")==0);
+    std::string shorter=text;
+    shorter.replace(shorter.find(", 3.75"),6,"");
+    test("Short array reports length",failure(shorter,schema).find("Expected 3 members in /values at offset")==0);
+    std::string longer=text;
+    longer.replace(longer.find("3.75"),4,"3.75, 4.5");
+    test("Long array reports length",failure(longer,schema).find("Expected 3 members in /values at offset")==0);
+    std::string word=text;
+    word.replace(word.find("2.25"),4,"\"x\"");
+    test("Non-numeric member of number array reports path",failure(word,schema).find("Expected number for /values/1 at offset")==0);
+    std::string nested=text;
+    nested.replace(nested.find("{\"at\" : 2}"),10,"{\"at\" : \"2\"}");
+    test("Nested array member reports path",failure(nested,schema).find("Expected number for /readings/1/at at offset")==0);
+
+    // Other members can be allowed
+    njson_schema open=njson_schema().member("a",ndict::TNUMBER).allowextra();
+    ndict extra=json.decode("{\"b\" : [1, 2], \"a\" : 1, \"c\" : \"x\", \"b\" : true}",open);
+    test("Other members follow listed ones",extra.getkeys()==std::vector<std::string>({"a","b","c"}) && extra["b"].getbool());
+
+    // Decoding into the same object reuses its nodes
+    ndict reused;
+    json.decode(text,schema,reused);
+    const ndict *device=&reused["device"];
+    json.decode(reordered,schema,reused);
+    test("Schema decoding reuses nodes",&reused["device"]==device && reused==other);
+}
+
+void test_policy(){
+    // Checked access throws on missing values and mismatching types
+    printf("\nRunning access policy test:\n");
+    ndict object;
+    object["string"]="string";
+    object["int"]=123;
+    object["bool"]=true;
+    const ndict &missing=object["missing"];
+    bool missingthrows=false,typethrows=false;
+    try{
+        missing.getint<ndict_checked>();
+    }
+    catch(ndict_exception &e){
+        missingthrows=std::string(e.what())=="Value is not set!";
+    }
+    try{
+        object["string"].getdouble<ndict_checked>();
+    }
+    catch(ndict_exception &e){
+        typethrows=std::string(e.what())=="Value is not numeric!";
+    }
+    test("Checked access throws on missing values",missingthrows);
+    test("Checked access throws on mismatching types",typethrows);
+    test("Checked access returns matching values",object["int"].getint<ndict_checked>()==123 && object["bool"].getbool<ndict_checked>());
+
+    // Unchecked access converts whatever is stored
+    test("Unchecked access reads missing values as empty",missing.getstring<ndict_unchecked>()=="" && missing.getint<ndict_unchecked>()==0);
+    test("Unchecked access converts mismatching types",object["string"].getdouble<ndict_unchecked>()==0 && object["int"].getstring<ndict_unchecked>()=="123");
+    test("Debug access returns matching values",object["int"].getdouble<ndict_debug>()==123 && !strcmp(object["string"].getchar<ndict_debug>(),"string"));
+    test("Default access follows the build configuration",object["int"].getint()==object["int"].getint<ndict_default>());
+}
+
+void test_watch(){
+    // Watch a configuration file in its own directory
+    printf("\nRunning file watching test:\n");
+    char dirbuffer[64];
+    strcpy(dirbuffer,"/tmp/ndict_utest_XXXXXX");
+    std::string dir=mkdtemp(dirbuffer);
+    std::string path=dir+"/config.json";
+    njson json;
+    ndict config=json.decode("{\"server\" : {\"host\" : \"localhost\", \"port\" : 8080}, "
+                             "\"limits\" : {\"rate\" : 10, \"burst\" : [1, 2, 3]}, \"name\" : \"test\"}");
+    json.write(path,config);
+    nwatch watch(path);
+    test("Watched file is loaded",watch.get()==config);
+    test("Unchanged file is not reloaded",!watch.poll(0));
+
+    // Subscribe to a few paths
+    std::vector<std::string> calls;
+    int port=0;
+    watch.subscribe("/server/port",[&](const std::string &pointer,const ndict &value){
+        calls.push_back(pointer);
+        port=value.getint();
+    });
+    watch.subscribe("/limits",[&](const std::string &pointer,const ndict &){
+        calls.push_back(pointer);
+    });
+    unsigned removed=watch.subscribe("/name",[&](const std::string &pointer,const ndict &value){
+        calls.push_back(pointer+"="+(value.type==ndict::TNULL?"null":value.getstring()));
+    });
+
+    // Rewrite the file in place, changing one value
+    const ndict *limits=&watch.get()["limits"];
+    const ndict *host=&watch.get()["server"]["host"];
+    config["server"]["port"]=9090;
+    json.write(path,config);
+    test("Written file is reloaded",watch.poll(1000) && watch.get()==config);
+    test("Subscriber on changed path is called",calls.size()==1 && calls[0]=="/server/port" && port==9090);
+    test("Unchanged nodes keep their addresses",limits==&watch.get()["limits"] && host==&watch.get()["server"]["host"]);
+
+    // Replace the file by renaming, changing a nested member and removing another
+    calls.clear();
+    config["limits"]["burst"][1]=5;
+    config.erase("name");
+    json.write(path+".new",config);
+    rename((path+".new").c_str(),path.c_str());
+    test("Renamed file is reloaded",watch.poll(1000) && watch.get()==config);
+    test("Subscribers on ancestors and removed paths are called",calls.size()==2 && calls[0]=="/limits" && calls[1]=="/name=null");
+
+    // Unsubscribe, and keep the last version when the file is broken
+    calls.clear();
+    test("Unsubscribe",watch.unsubscribe(removed) && !watch.unsubscribe(removed));
+    FILE *fd=fopen(path.c_str(),"w");
+    fputs("{\"server\" : ",fd);
+    fclose(fd);
+    bool result=false;
+    try{
+        watch.poll(1000);
+    }
+    catch(njson_exception &e){
+        result=true;
+    }
+    test("Broken file throws exception and keeps the live version",result && watch.get()==config && calls.empty());
+    config["name"]="back";
+    json.write(path,config);
+    test("Fixed file is reloaded",watch.poll(1000) && watch.get()["name"].getstring()=="back" && calls.empty());
+    unlink(path.c_str());
+    rmdir(dir.c_str());
+}
+
+void test_escape(){
+    // Escape sequences are decoded
+    printf("\nRunning string escaping test:\n");
+    njson json;
+    ndict object=json.decode("{\"quote\" : \"a\\\"b\", \"slash\" : \"a\\\\b\\/c\", \"controls\" : \"\\b\\f\\n\\r\\t\", "
+                             "\"latin\" : \"caf\\u00e9\", \"euro\" : \"\\u20AC\", \"emoji\" : \"\\ud83d\\ude00\", "
+                             "\"lone\" : \"a\\ud83db\", \"k\\u0065y\" : 1}");
+    test("Decode quote and backslash escapes",object["quote"].getstring()=="a\"b" && object["slash"].getstring()=="a\\b/c");
+    test("Decode control character escapes",object["controls"].getstring()=="\b\f\n\r\t");
+    test("Decode unicode escapes as UTF-8",object["latin"].getstring()=="caf\xc3\xa9" && object["euro"].getstring()=="\xe2\x82\xac");
+    test("Decode surrogate pairs",object["emoji"].getstring()=="\xf0\x9f\x98\x80");
+    test("Replace unpaired surrogates",object["lone"].getstring()=="a\xef\xbf\xbd" "b");
+    test("Decode escaped keys",object.haskey("key") && object["key"].getint()==1);
+
+    // Invalid escape sequences are rejected
+    const char *invalid[]={"{\"a\" : \"\\x\"}","{\"a\" : \"\\u12\"}","{\"a\" : \"\\u12g4\"}"};
+    bool result=true;
+    for(const char *text : invalid){
+        bool thrown=false;
+        try{
+            json.decode(text);
+        }
+        catch(njson_exception &e){
+            thrown=true;
+        }
+        result=result && thrown && !json.validate(text).valid;
+    }
+    test("Invalid escapes throw exception and fail validation",result);
+
+    // Special characters are escaped when encoding, at any position of long strings
+    ndict dict;
+    dict["text"]="say \"hi\"\\\n\t\x01";
+    test("Encode escapes",dict["text"].getjson()=="\"say \\\"hi\\\"\\\\\\n\\t\\u0001\"");
+    result=true;
+    for(unsigned i=0;i<40;i++){
+        for(const char *special : {"\"","\\","\n","\x1f","\xc3\xa9"}){
+            std::string text=std::string(i,'x')+special+std::string(40-i,'y');
+            ndict item;
+            item[text]=text;
+            result=result && json.decode(json.encode(item))[text].getstring()==text;
+        }
+    }
+    test("Round trip special characters at every position",result);
+    std::string bytes;
+    for(unsigned i=1;i<256;i++) bytes+=(char)i;
+    dict["bytes"]=bytes;
+    test("Round trip all byte values",json.decode(json.encode(dict))==dict);
+
+    // Bound structs escape and decode strings the same way
+    umessage message;
+    message.name="quoted \"name\"\n";
+    message.tags={"a\\b","caf\xc3\xa9"};
+    umessage copy;
+    json.decode(json.encode(message),copy);
+    test("Round trip escaped strings in bound structs",copy.name==message.name && copy.tags==message.tags);
+}
+
 int main(){
     printf("utest %s\n",NDICT_VERSION);
     printf("ndict unittest system\n");
@@ -476,6 +2114,30 @@ int main(){
     test_encode_decode();
     test_json_merge();
     test_error();
+    test_diff();
+    test_hash();
+    test_json_cache();
+    test_cow();
+    test_snapshot();
+    test_concurrent();
+    test_shm();
+    test_binding();
+    test_query();
+    test_index();
+    test_projection();
+    test_lazy();
+    test_validate();
+    test_nesting();
+    test_reuse();
+    test_readall();
+    test_compressed();
+    test_stats();
+    test_trace();
+    test_packed();
+    test_schema();
+    test_policy();
+    test_watch();
+    test_escape();
     printf("\nPassed %d/%d tests\n",upassed,upassed+ufailed);
     if(ufailed==0){
         printf("All clear!\n");